@@ -453,15 +453,18 @@ struct TunableIndex {
       "USING btree (mailbox, modseq)",
       false, true, true },
     { "b_text", "bodyparts",
-      "CREATE INDEX b_text ON bodyparts "
-      "USING gin (to_tsvector('simple'::regconfig, text)) "
+      "CREATE INDEX CONCURRENTLY b_text ON bodyparts "
+      "USING gin (to_tsvector('aox'::regconfig, text)) "
       "WHERE (octet_length(text) < (640000))",
       false, false, true },
-    { "hf_subject", "header_fields",
-      "CREATE INDEX hf_subject ON header_fields "
-      "USING gin (to_tsvector('simple'::regconfig, value)) "
-      "WHERE (octet_length(value) < (640000) and field=20)",
+    { "hf_text", "header_fields",
+      "CREATE INDEX CONCURRENTLY hf_text ON header_fields "
+      "USING gin (to_tsvector('aox'::regconfig, value)) "
+      "WHERE (octet_length(value) < (640000))",
       false, false, true },
+    { "hf_subject", "header_fields",
+      "",
+      false, false, false },
     { 0, 0, 0, false, false, false }
 };
 
@@ -470,7 +473,10 @@ class TuneDatabaseData
     : public Garbage
 {
 public:
-    TuneDatabaseData(): mode( Reading ), t( 0 ), find( 0 ), set( false ) {}
+    TuneDatabaseData()
+        : mode( Reading ), t( 0 ), find( 0 ), set( false ),
+          building( new List<Query> ), built( false ), notify( 0 )
+    {}
     enum Mode {
         Writing, Reading, Advanced
     };
@@ -478,6 +484,9 @@ public:
     Transaction * t;
     Query * find;
     bool set;
+    List<Query> * building;
+    bool built;
+    Query * notify;
 };
 
 
@@ -491,7 +500,10 @@ f5( "tune", "database", "Adds or removes indices.",
     "    Mode mostly-reading tunes the database for message reading,\n"
     "    but without full-text indexing.\n"
     "    Mode advanced-reading tunes the database for fast message\n"
-    "    searching and reading, at the cost of injection speed.\n" );
+    "    searching and reading, at the cost of injection speed.\n\n"
+    "    The full-text indices used by advanced-reading are built\n"
+    "    concurrently, so the servers can keep running meanwhile, but\n"
+    "    on a large database this command may take hours to finish.\n" );
 
 /*! \class TuneDatabase db.h
     This class handles the "aox tune database" command.
@@ -529,8 +541,13 @@ void TuneDatabase::execute()
             indexnames.append( tunableIndices[i].name );
             ++i;
         }
-        d->find = new Query( "select indexname::text from pg_indexes where "
-                             "schemaname=$1 and indexname=any($2::text[])",
+        d->find = new Query( "select c.relname::text as indexname, "
+                             "i.indisvalid "
+                             "from pg_index i "
+                             "join pg_class c on (i.indexrelid=c.oid) "
+                             "join pg_namespace n on (c.relnamespace=n.oid) "
+                             "where n.nspname=$1 "
+                             "and c.relname=any($2::text[])",
                              this );
         d->find->bind( 1, Configuration::text( Configuration::DbSchema ) );
         d->find->bind( 2, indexnames );
@@ -547,6 +564,7 @@ void TuneDatabase::execute()
 
     if ( !d->set ) {
         EStringList present;
+        EStringList invalid;
         while ( d->find->hasResults() ) {
             Row * r = d->find->nextRow();
             EString name = r->getEString( "indexname" );
@@ -554,8 +572,12 @@ void TuneDatabase::execute()
             while ( tunableIndices[i].name &&
                     name != tunableIndices[i].name )
                 i++;
-            if ( tunableIndices[i].name )
+            if ( !tunableIndices[i].name )
+                ;
+            else if ( r->getBoolean( "indisvalid" ) )
                 present.append( tunableIndices[i].name );
+            else
+                invalid.append( tunableIndices[i].name );
         }
         uint i = 0;
         while ( tunableIndices[i].name ) {
@@ -571,29 +593,29 @@ void TuneDatabase::execute()
                 wanted = tunableIndices[i].advanced;
                 break;
             }
-            Query * q = 0;
-            if ( wanted && !present.find( tunableIndices[i].name ) ) {
-                if ( EString( tunableIndices[i].name ) == "b_text" &&
-                     Postgres::version() < 80300 ) {
-                    printf( "Error: "
-                            "Full-text indexing needs PostgreSQL 8.3\n" );
-                }
-                else {
-                    q = new Query( tunableIndices[i].definition, 0 );
-                    printf( "Executing %s;\n", tunableIndices[i].definition );
-                }
+            EString name( tunableIndices[i].name );
+            EString definition( tunableIndices[i].definition );
+            // an interrupted CREATE INDEX CONCURRENTLY leaves an
+            // invalid index behind. we drop it and start over.
+            if ( invalid.find( name ) ) {
+                d->t->enqueue( new Query( "drop index " + name, 0 ) );
+                printf( "Dropping incomplete index %s.\n", name.cstr() );
+            }
+            if ( wanted && !present.find( name ) ) {
+                printf( "Executing %s;\n", definition.cstr() );
+                // CREATE INDEX CONCURRENTLY cannot run in a
+                // transaction, so we send it after the commit.
+                if ( definition.startsWith( "CREATE INDEX CONCURRENTLY" ) )
+                    d->building->append( new Query( definition, this ) );
+                else
+                    d->t->enqueue( new Query( definition, 0 ) );
             }
-            else if ( present.find( tunableIndices[i].name ) && !wanted ) {
-                q = new Query( EString("drop index ") + tunableIndices[i].name,
-                               0 );
-                printf( "Dropping index %s.\n",
-                        tunableIndices[i].name );
+            else if ( present.find( name ) && !wanted ) {
+                d->t->enqueue( new Query( "drop index " + name, 0 ) );
+                printf( "Dropping index %s.\n", name.cstr() );
             }
-            if ( q )
-                d->t->enqueue( q );
             i++;
         }
-        d->t->enqueue( new Query( "notify database_retuned", 0 ) );
         d->t->commit();
         d->set = true;
     }
@@ -601,6 +623,35 @@ void TuneDatabase::execute()
     if ( !d->t->done() )
         return;
 
+    if ( d->t->failed() )
+        error( "Cannot tune database: " + d->t->error() );
+
+    if ( !d->built ) {
+        List<Query>::Iterator q( d->building );
+        while ( q ) {
+            q->execute();
+            ++q;
+        }
+        d->built = true;
+    }
+
+    List<Query>::Iterator q( d->building );
+    while ( q ) {
+        if ( !q->done() )
+            return;
+        if ( q->failed() )
+            error( "Cannot build index: " + q->error() );
+        ++q;
+    }
+
+    if ( !d->notify ) {
+        d->notify = new Query( "notify database_retuned", this );
+        d->notify->execute();
+    }
+
+    if ( !d->notify->done() )
+        return;
+
     finish();
 }
 
@@ -8,11 +8,12 @@
 #include "smtp.h"
 #include "graph.h"
 
-#include "tlsthread.h"
+#include "tlsengine.h"
 #include "flag.h"
 #include "event.h"
 #include "cache.h"
 #include "mailbox.h"
+#include "messagecache.h"
 #include "listener.h"
 #include "database.h"
 #include "dbsignal.h"
@@ -272,7 +273,7 @@ int main( int argc, char *argv[] )
     );
 
     if ( Configuration::toggle( Configuration::UseTls ) ) {
-        TlsThread::setup();
+        TlsEngine::setup();
     }
 
     s.setup( Server::LogStartup );
@@ -284,6 +285,9 @@ int main( int argc, char *argv[] )
 
     EventLoop::global()->setMemoryUsage(
         1024 * 1024 * Configuration::scalar( Configuration::MemoryLimit ) );
+    Allocator::setGenerational(
+        Configuration::toggle( Configuration::UseGenerationalGc ) );
+    MessageCache::setup();
 
     s.setup( Server::Finish );
 
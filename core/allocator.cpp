@@ -22,6 +22,12 @@
 // malloc, free
 #include <stdlib.h>
 
+// sigaction, SIGSEGV
+#include <signal.h>
+
+// sysconf
+#include <unistd.h>
+
 #include <errno.h>
 
 
@@ -87,9 +93,9 @@ public:
     static void insert( Allocator * a ) {
         Allocator::ulong v = ((Allocator::ulong)a->buffer) >> BlockShift;
         Allocator::ulong i = 0;
-        while ( i < a->step * a->capacity ) {
+        while ( ( i << BlockShift ) < a->step * a->capacity ) {
             insert( v + i, a );
-            i += BlockSize;
+            i++;
         }
     }
 
@@ -101,9 +107,9 @@ public:
     static void remove( Allocator * a ) {
         Allocator::ulong v = ((Allocator::ulong)a->buffer) >> BlockShift;
         Allocator::ulong i = 0;
-        while ( i < a->step * a->capacity ) {
+        while ( ( i << BlockShift ) < a->step * a->capacity ) {
             remove( v + i, a );
-            i += BlockSize;
+            i++;
         }
     }
 
@@ -151,6 +157,19 @@ static uint tos;
 static uint peak;
 static AllocationBlock ** stack;
 
+// generational collection: see Allocator::setGenerational()
+static bool generational;
+static bool needFullCollection = true;
+static uint minorCollections;
+static uint oldGeneration;
+static uint pageSize = 4096;
+static uint lastPauseTime;
+static bool pauseWasFull;
+static struct sigaction previousFaultHandler;
+
+// at most this many minor collections happen between two full ones
+static const uint MaxMinorCollections = 16;
+
 
 static void oneMegabyteAllocated()
 {
@@ -284,7 +303,7 @@ Allocator * Allocator::allocator( uint size )
 
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
-      used( 0 ), marked( 0 ), buffer( 0 ),
+      used( 0 ), marked( 0 ), dirty( 0 ), pages( 0 ), buffer( 0 ),
       next( 0 )
 {
     if ( s < ( BlockSize ) )
@@ -328,6 +347,14 @@ Allocator::Allocator( uint s )
     if ( !marked )
         die( Memory );
 
+    // all pages start out writable, ie. dirty
+    pages = ( l + ::pageSize - 1 ) / ::pageSize;
+    uint pl = ( pages + bits - 1 ) / bits;
+    dirty = (ulong*)::malloc( pl * sizeof( ulong ) );
+    if ( !dirty )
+        die( Memory );
+    memset( dirty, 0xff, pl * sizeof( ulong ) );
+
     AllocatorMapTable::insert( this );
 }
 
@@ -344,9 +371,12 @@ Allocator::~Allocator()
 
     ::free( used );
     ::free( marked );
+    ::free( dirty );
 
     next = 0;
     used = 0;
+    marked = 0;
+    dirty = 0;
     buffer = 0;
 }
 
@@ -377,6 +407,8 @@ void * Allocator::allocate( uint size, uint pointers )
                         b->x.number = 127;
                     else
                         b->x.number = pointers;
+                    if ( ::generational )
+                        makeWritable( base );
                     b->x.magic = ::magic;
                     marked[base/bits] &= ~( 1UL << j );
                     used[base/bits] |= ( 1UL << j );
@@ -455,6 +487,31 @@ void Allocator::setNumPointers( const void * p, uint n )
 }
 
 
+/*! This helper puts \a b on the stack so that mark() will
+    mark its children.
+*/
+
+static void push( AllocationBlock * b )
+{
+    // is there space on the stack for this object?
+    if ( tos == 524288 ) {
+        log( "Ran out of stack space while collecting garbage",
+             Log::Disaster );
+        return;
+    }
+    // yes. put it on the stack so the children, too, can be marked.
+    if ( !stack ) {
+        stack = (AllocationBlock**)malloc( 524288 * sizeof(AllocationBlock *) );
+        if ( !stack )
+            die( Memory );
+        tos = 0;
+    }
+    stack[tos++] = b;
+    if ( tos > peak )
+        peak = tos;
+}
+
+
 /*! This private helper checks that \a p is a valid pointer to
     unmarked GCable memory, marks it, and puts it on a stack so that
     mark() can process it and add its children to the stack.
@@ -487,22 +544,7 @@ void Allocator::mark( void * p )
     // is there any chance that it contains children?
     if ( !b->x.number )
         return;
-    // is there space on the stack for this object?
-    if ( tos == 524288 ) {
-        log( "Ran out of stack space while collecting garbage",
-             Log::Disaster );
-        return;
-    }
-    // yes. put it on the stack so the children, too, can be marked.
-    if ( !stack ) {
-        stack = (AllocationBlock**)malloc( 524288 * sizeof(AllocationBlock *) );
-        if ( !stack )
-            die( Memory );
-        tos = 0;
-    }
-    stack[tos++] = b;
-    if ( tos > peak )
-        peak = tos;
+    push( b );
 }
 
 
@@ -535,12 +577,18 @@ void Allocator::mark()
 
 /*! Frees all memory that's no longer in use. This can take some time.
 
+    If \a full is false and generational() is true, free() may perform
+    a minor collection instead, which only frees objects allocated
+    since the last collection. Every so often, and whenever \a full is
+    true (the default), it performs a full collection.
+
     Returns null if entries is null or empty, returns an object in
     entries else. The returned object is (in some sense) the one
-    that's responsible for the largest share of allocated memory.
+    that's responsible for the largest share of allocated memory. A
+    minor collection always returns null.
 */
 
-Garbage * Allocator::free( List<Garbage> * entries )
+Garbage * Allocator::free( List<Garbage> * entries, bool full )
 {
     struct timeval start, afterMark, afterSweep;
     start.tv_sec = 0;
@@ -553,6 +601,28 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
     Cache::clearAllCaches( false );
 
+    if ( !::generational ||
+         ::needFullCollection ||
+         ::minorCollections >= MaxMinorCollections ||
+         (uint)::total > ::oldGeneration + ::oldGeneration / 2 )
+        full = true;
+
+    uint i = 0;
+    if ( full && ::generational ) {
+        // the mark bits are sticky in generational mode, so they
+        // have to be cleared before a full collection
+        while ( i < 32 ) {
+            Allocator * a = allocators[i];
+            while ( a ) {
+                memset( a->marked, 0,
+                        ( ( a->capacity + bits - 1 ) / bits ) *
+                        sizeof( ulong ) );
+                a = a->next;
+            }
+            i++;
+        }
+    }
+
     total = 0;
     peak = 0;
     uint freed = 0;
@@ -561,8 +631,32 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
     Garbage * biggest = 0;
 
+    if ( !full ) {
+        // a minor collection treats every old object as live, and
+        // those which have been modified since the last collection
+        // as roots, since they may point to new objects.
+        i = 0;
+        while ( i < 32 ) {
+            Allocator * a = allocators[i];
+            while ( a ) {
+                a->scanDirtyPages();
+                a = a->next;
+            }
+            i++;
+        }
+        mark();
+    }
+
     // mark
-    if ( entries ) {
+    if ( entries && !full ) {
+        List<Garbage>::Iterator i( entries );
+        while ( i ) {
+            mark( i );
+            mark();
+            ++i;
+        }
+    }
+    else if ( entries ) {
         uint size = 0;
         List<Garbage>::Iterator i( entries );
         while ( i ) {
@@ -576,15 +670,17 @@ Garbage * Allocator::free( List<Garbage> * entries )
             ++i;
         }
     }
-    uint i = 0;
+    i = 0;
     while ( i < ::numRoots ) {
         if ( ::roots[i].root ) {
             uint o = objects;
             uint m = ::marked;
             mark( ::roots[i].root );
             mark();
-            ::roots[i].objects = objects - o;
-            ::roots[i].size = ::marked - m;
+            if ( full ) {
+                ::roots[i].objects = objects - o;
+                ::roots[i].size = ::marked - m;
+            }
         }
 
         i++;
@@ -621,6 +717,29 @@ Garbage * Allocator::free( List<Garbage> * entries )
         allocators[i] = s;
         i++;
     }
+
+    if ( ::generational ) {
+        // everything that survived is now old. make it read-only, so
+        // that unprotect() notices when the next collection has to
+        // look at it.
+        i = 0;
+        while ( i < 32 ) {
+            Allocator * a = allocators[i];
+            while ( a ) {
+                a->protect();
+                a = a->next;
+            }
+            i++;
+        }
+        if ( full ) {
+            ::oldGeneration = total;
+            ::minorCollections = 0;
+            ::needFullCollection = false;
+        }
+        else {
+            ::minorCollections++;
+        }
+    }
     gettimeofday( &afterSweep, 0 );
 
     uint timeToMark = 0;
@@ -631,14 +750,20 @@ Garbage * Allocator::free( List<Garbage> * entries )
         timeToSweep = ( afterSweep.tv_sec - afterMark.tv_sec ) * 1000000 +
                       ( afterSweep.tv_usec - afterMark.tv_usec );
     }
+    ::lastPauseTime = timeToMark + timeToSweep;
+    ::pauseWasFull = full;
     // dumpRandomObject();
 
+    if ( !full )
+        biggest = 0;
+
     if ( !freed )
         return biggest;
 
     if ( verbose && ( ::allocated >= 4*1024*1024 ||
                       timeToMark + timeToSweep >= 10000 ) )
-        log( "Allocator: allocated " +
+        log( EString( full ? "Allocator" : "Allocator (minor)" ) +
+             ": allocated " +
              EString::humanNumber( ::allocated ) +
              " then freed " +
              EString::humanNumber( freed ) +
@@ -655,7 +780,7 @@ Garbage * Allocator::free( List<Garbage> * entries )
              fn( (timeToMark+500)/1000 ) + "ms. To sweep: " +
              fn( (timeToSweep+500)/1000 ) + "ms.",
              Log::Info );
-    if ( verbose && total > 8 * 1024 * 1024 ) {
+    if ( verbose && full && total > 8 * 1024 * 1024 ) {
         EString objects;
         i = 0;
         while ( i < 32 ) {
@@ -684,7 +809,7 @@ Garbage * Allocator::free( List<Garbage> * entries )
         log( objects, Log::Debug );
     }
     const uint ObjectLimit = 8192;
-    if ( verbose && objects > ObjectLimit ) {
+    if ( verbose && full && objects > ObjectLimit ) {
         i = 0;
         while ( i < numRoots ) {
             if ( roots[i].root && roots[i].objects > ObjectLimit/2 ) {
@@ -730,13 +855,259 @@ void Allocator::sweep()
             }
             i++;
         }
-        marked[b] = 0;
+        if ( ::generational )
+            marked[b] = used[b];
+        else
+            marked[b] = 0;
         b++;
     }
     base = 0;
 }
 
 
+/*! Pushes every old object on a dirty page on the mark stack, so
+    that a minor collection finds any new objects to which old ones
+    point. An object is old if it survived the last collection, and a
+    page is dirty if something has been written to it since then.
+*/
+
+void Allocator::scanDirtyPages()
+{
+    uint last = UINT_MAX;
+    uint p = 0;
+    while ( p < pages ) {
+        if ( !dirty[p/bits] ) {
+            p = ( p | ( bits-1 ) ) + 1;
+        }
+        else {
+            if ( dirty[p/bits] & 1UL << (p%bits) ) {
+                uint i = (uint)( ( (ulong)p * ::pageSize ) / step );
+                uint end = (uint)( ( (ulong)( p + 1 ) * ::pageSize - 1 ) /
+                                   step );
+                if ( last != UINT_MAX && i <= last )
+                    i = last + 1;
+                while ( i <= end && i < capacity ) {
+                    ulong bit = 1UL << (i%bits);
+                    if ( ( used[i/bits] & bit ) && ( marked[i/bits] & bit ) ) {
+                        AllocationBlock * b = (AllocationBlock*)block( i );
+                        if ( b->x.magic != ::magic )
+                            die( Memory );
+                        if ( b->x.number )
+                            push( b );
+                        // don't let the stack overflow
+                        if ( tos >= 262144 )
+                            mark();
+                    }
+                    last = i;
+                    i++;
+                }
+            }
+            p++;
+        }
+    }
+}
+
+
+/*! Makes sure that block \a i can be written to, and notes that the
+    pages it occupies are dirty.
+*/
+
+void Allocator::makeWritable( uint i )
+{
+    uint p = (uint)( ( (ulong)i * step ) / ::pageSize );
+    uint end = (uint)( ( (ulong)( i + 1 ) * step - 1 ) / ::pageSize );
+    while ( p <= end && p < pages ) {
+        if ( !( dirty[p/bits] & 1UL << (p%bits) ) ) {
+            uint first = p;
+            while ( p <= end && p < pages &&
+                    !( dirty[p/bits] & 1UL << (p%bits) ) ) {
+                dirty[p/bits] |= 1UL << (p%bits);
+                p++;
+            }
+            if ( ::mprotect( (char*)buffer + (ulong)first * ::pageSize,
+                             (ulong)( p - first ) * ::pageSize,
+                             PROT_READ|PROT_WRITE ) )
+                die( Memory );
+        }
+        else {
+            p++;
+        }
+    }
+}
+
+
+/*! Makes this Allocator's memory read-only and marks all its pages
+    as clean. unprotect() undoes this one page at a time.
+*/
+
+void Allocator::protect()
+{
+    uint pl = ( pages + bits - 1 ) / bits;
+    if ( ::mprotect( buffer, (ulong)pages * ::pageSize, PROT_READ ) ) {
+        // we can't know which pages are protected, so we must treat
+        // all as dirty and make sure all are writable.
+        memset( dirty, 0xff, pl * sizeof( ulong ) );
+        ::mprotect( buffer, (ulong)pages * ::pageSize,
+                    PROT_READ|PROT_WRITE );
+        return;
+    }
+    memset( dirty, 0, pl * sizeof( ulong ) );
+}
+
+
+/*! Makes the page containing \a p writable and notes that it's
+    dirty, if \a p points into a page protected by protect(). Returns
+    true if it did so, and false if \a p isn't in such a page.
+
+    This is called by the SIGSEGV handler, and must not allocate
+    memory.
+*/
+
+bool Allocator::unprotect( const void * p )
+{
+    Allocator * a = AllocatorMapTable::find( p );
+    if ( !a || !a->dirty || (ulong)a->buffer > (ulong)p )
+        return false;
+    ulong page = ( (ulong)p - (ulong)a->buffer ) / ::pageSize;
+    if ( page >= a->pages )
+        return false;
+    if ( a->dirty[page/bits] & 1UL << (page%bits) )
+        return false;
+    a->dirty[page/bits] |= 1UL << (page%bits);
+    return !::mprotect( (char*)a->buffer + page * ::pageSize, ::pageSize,
+                        PROT_READ|PROT_WRITE );
+}
+
+
+static void writeFault( int sig, siginfo_t * info, void * context )
+{
+    if ( Allocator::unprotect( info->si_addr ) )
+        return;
+
+    // not ours. let whatever would have handled it handle it, by
+    // restoring the old handler and letting the fault happen again.
+    ::sigaction( SIGSEGV, &previousFaultHandler, 0 );
+    (void)sig;
+    (void)context;
+}
+
+
+/*! Instructs the Allocator to use generational collection if \a
+    enable is true, and to collect everything each time if \a enable
+    is false. The initial value is false.
+
+    In generational mode, objects which survive a collection are old,
+    and their memory is made read-only. The first write to each page
+    afterwards is caught by a SIGSEGV handler, which makes the page
+    writable and notes that it's dirty. A minor collection can
+    therefore skip old objects on clean pages, since they are alive
+    and cannot point to anything new, and so takes time in proportion
+    to the new objects and the modified pages rather than to the
+    entire heap.
+
+    Old objects are only freed by full collections, which happen at
+    intervals, and whenever the old objects grow by half.
+
+    Code which asks the kernel to write into old GCable memory (e.g.
+    using read(2)) must not be used in generational mode, since the
+    kernel reports EFAULT instead of raising SIGSEGV. Newly allocated
+    objects are always writable.
+*/
+
+void Allocator::setGenerational( bool enable )
+{
+    if ( enable == ::generational )
+        return;
+
+    if ( enable ) {
+        long ps = ::sysconf( _SC_PAGESIZE );
+        if ( ps < 4096 || ( ps & ( ps - 1 ) ) || (uint)ps > BlockSize ) {
+            log( "Allocator: Unusable page size " + fn( ps ) +
+                 ", not using generational collection", Log::Error );
+            return;
+        }
+        if ( (uint)ps != ::pageSize ) {
+            // the page bitmaps of existing allocators use the old
+            // page size, so make them all dirty and recompute them
+            ::pageSize = ps;
+            uint i = 0;
+            while ( i < 32 ) {
+                Allocator * a = allocators[i];
+                while ( a ) {
+                    uint l = ( ( a->capacity * a->step - 1 ) | 4095 ) + 1;
+                    a->pages = ( l + ::pageSize - 1 ) / ::pageSize;
+                    memset( a->dirty, 0xff,
+                            ( ( a->pages + bits - 1 ) / bits ) *
+                            sizeof( ulong ) );
+                    a = a->next;
+                }
+                i++;
+            }
+        }
+
+        struct sigaction sa;
+        memset( &sa, 0, sizeof( sa ) );
+        sa.sa_sigaction = writeFault;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+        sigemptyset( &sa.sa_mask );
+        if ( ::sigaction( SIGSEGV, &sa, &previousFaultHandler ) ) {
+            log( "Allocator: Cannot install SIGSEGV handler, "
+                 "not using generational collection", Log::Error );
+            return;
+        }
+        ::generational = true;
+        ::needFullCollection = true;
+        return;
+    }
+
+    // make everything writable and forget the sticky marks
+    uint i = 0;
+    while ( i < 32 ) {
+        Allocator * a = allocators[i];
+        while ( a ) {
+            ::mprotect( a->buffer, (ulong)a->pages * ::pageSize,
+                        PROT_READ|PROT_WRITE );
+            memset( a->dirty, 0xff,
+                    ( ( a->pages + bits - 1 ) / bits ) * sizeof( ulong ) );
+            memset( a->marked, 0,
+                    ( ( a->capacity + bits - 1 ) / bits ) * sizeof( ulong ) );
+            a = a->next;
+        }
+        i++;
+    }
+    ::sigaction( SIGSEGV, &previousFaultHandler, 0 );
+    ::generational = false;
+}
+
+
+/*! Returns true if the Allocator uses generational collection, as
+    set by setGenerational(), and false otherwise.
+*/
+
+bool Allocator::generational()
+{
+    return ::generational;
+}
+
+
+/*! Returns the number of microseconds the last call to free() took. */
+
+uint Allocator::lastPause()
+{
+    return ::lastPauseTime;
+}
+
+
+/*! Returns true if the last call to free() collected everything,
+    and false if it performed a minor collection.
+*/
+
+bool Allocator::lastCollectionWasFull()
+{
+    return ::pauseWasFull;
+}
+
+
 /*! Returns the amount of memory allocated to hold \a p and any object
     to which p points.
 
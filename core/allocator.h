@@ -20,13 +20,18 @@ public:
 
     static Allocator * allocator( uint size );
 
-    static Garbage * free( List<Garbage> * = 0 );
+    static Garbage * free( List<Garbage> * = 0, bool = true );
     static void addEternal( const void *, const char * );
 
     static void removeEternal( void * );
     static void removeEternal( const void * );
 
     static void setReporting( bool );
+    static void setGenerational( bool );
+    static bool generational();
+
+    static uint lastPause();
+    static bool lastCollectionWasFull();
 
     static uint allocated();
     static uint inUse();
@@ -45,6 +50,8 @@ public:
 
     static uint allocatedFromOS();
 
+    static bool unprotect( const void * );
+
 private:
     typedef unsigned long int ulong;
 
@@ -54,6 +61,8 @@ private:
     uint capacity;
     ulong * used;
     ulong * marked;
+    ulong * dirty;
+    uint pages;
     void * buffer;
     Allocator * next;
 
@@ -64,6 +73,9 @@ private:
     static void mark( void * );
     static void mark();
     void sweep();
+    void scanDirtyPages();
+    void makeWritable( uint );
+    void protect();
 };
 
 
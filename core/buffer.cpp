@@ -241,7 +241,7 @@ void Buffer::remove( uint n )
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
         vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        if ( v && !v->shared && ( v->len > 100 && v->len < 20000 ) )
             vecs.append( v );
         return;
     }
@@ -337,6 +337,77 @@ EString Buffer::string( uint num ) const
 }
 
 
+/*! Returns a string containing the first \a num bytes in the
+    buffer, like string(), but without copying them if they are stored
+    contiguously. In that case the returned string refers to the
+    Buffer's own memory, and the Buffer will never reuse that memory
+    for later data. This function does not remove() the returned data.
+
+    reserve() can be used to make sure that a slice will be contiguous.
+*/
+
+EString Buffer::slice( uint num )
+{
+    Vector * v = vecs.firstElement();
+    if ( !v || !num )
+        return string( num );
+
+    uint max = v->len;
+    if ( vecs.count() == 1 )
+        max = firstfree;
+    if ( num > bytes )
+        num = bytes;
+    if ( max - firstused < num )
+        return string( num );
+
+    v->shared = true;
+    EString r;
+    r.d = new EStringData;
+    r.d->str = v->base + firstused;
+    r.d->len = num;
+    return r;
+}
+
+
+/*! Ensures that the current contents of the Buffer and the next \a num
+    bytes appended to it are stored contiguously, so that slice() need
+    not copy them. The existing contents may be moved to achieve that.
+*/
+
+void Buffer::reserve( uint num )
+{
+    Vector * v = vecs.firstElement();
+    if ( v && vecs.count() == 1 && firstfree + num <= v->len )
+        return;
+    if ( !v && !num )
+        return;
+
+    Vector * f = new Vector;
+    f->len = Allocator::rounded( bytes + num );
+    f->base = (char*)Allocator::alloc( f->len, 0 );
+
+    uint copied = 0;
+    List< Vector >::Iterator it( vecs );
+    while ( it && copied < bytes ) {
+        Vector * x = it;
+        uint start = 0;
+        uint end = x->len;
+        if ( x == v )
+            start = firstused;
+        if ( x == vecs.lastElement() )
+            end = firstfree;
+        memmove( f->base + copied, x->base + start, end - start );
+        copied += end - start;
+        ++it;
+    }
+
+    vecs.clear();
+    vecs.append( f );
+    firstused = 0;
+    firstfree = bytes;
+}
+
+
 /*! This function removes a line (terminated by LF or CRLF) of at most
     \a s bytes from the Buffer, and returns a pointer to a EString with
     the line ending removed. If the Buffer does not contain a complete
@@ -29,6 +29,8 @@ public:
     uint size() const { return bytes; }
     void remove( uint );
     EString string( uint ) const;
+    EString slice( uint );
+    void reserve( uint );
     EString * removeLine( uint = 0 );
 
     char operator[]( uint i ) const {
@@ -55,12 +57,13 @@ private:
     struct Vector
         : public Garbage
     {
-        Vector() : base( 0 ), len( 0 ) {
+        Vector() : base( 0 ), len( 0 ), shared( false ) {
             setFirstNonPointer( &len );
         }
         char *base;
         // no pointers after this line
         uint len;
+        bool shared;
     };
 
     List< Vector > vecs;
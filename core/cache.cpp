@@ -59,9 +59,10 @@ Cache::~Cache()
 }
 
 
-/*! Calls clear() for each currently extant Cache. Called from
+/*! Calls shrink() for each currently extant Cache. Called from
     Allocator::free(). If \a harder is set, then all caches are
-    cleared completely, no matter how high their duration factors are.
+    cleared completely using clear(), no matter how high their
+    duration factors are.
 */
 
 void Cache::clearAllCaches( bool harder)
@@ -73,7 +74,11 @@ void Cache::clearAllCaches( bool harder)
         c->n++;
         if ( harder || c->n > c->factor ) {
             c->n = 0;
-            c->clear(); // careful: no iterator pointing to c meanwhile
+            // careful: no iterator pointing to c meanwhile
+            if ( harder )
+                c->clear();
+            else
+                c->shrink();
         }
     }
 }
@@ -82,3 +87,14 @@ void Cache::clearAllCaches( bool harder)
 /*! \fn virtual void Cache::clear() = 0;
     Implemented by subclasses to discards the contents of the cache.
 */
+
+
+/*! Discards whatever the cache doesn't want to keep past the current
+    garbage collection. The default implementation calls clear();
+    subclasses may override it to keep some of their contents.
+*/
+
+void Cache::shrink()
+{
+    clear();
+}
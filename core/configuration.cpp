@@ -164,7 +164,13 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 389 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "db-pipeline-depth", Configuration::DbPipelineDepth, 16 },
+    { "tls-session-lifetime", Configuration::TlsSessionLifetime, 3600 },
+    { "tls-session-cache-size", Configuration::TlsSessionCacheSize, 1024 },
+    { "message-cache-size", Configuration::MessageCacheSize, 16 },
+    { "shared-message-cache-size", Configuration::SharedMessageCacheSize, 0 },
+    { "smarthost-connections", Configuration::SmartHostConnections, 4 }
 };
 
 
@@ -244,7 +250,9 @@ static struct {
     { "use-statistics", Configuration::UseStatistics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "use-imap-quota", Configuration::UseImapQuota, true }
+    { "use-imap-quota", Configuration::UseImapQuota, true },
+    { "use-generational-gc", Configuration::UseGenerationalGc, true },
+    { "store-rendered-messages", Configuration::StoreRenderedMessages, false }
 };
 
 
@@ -57,6 +57,12 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        DbPipelineDepth,
+        TlsSessionLifetime,
+        TlsSessionCacheSize,
+        MessageCacheSize,
+        SharedMessageCacheSize,
+        SmartHostConnections,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -135,6 +141,8 @@ public:
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
+        UseGenerationalGc,
+        StoreRenderedMessages,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
@@ -1134,7 +1134,7 @@ EString EString::deUue() const
 
 
 
-static char from64[128] =
+static const unsigned char from64[256] =
 {
     64, 99, 99, 99,  99, 99, 99, 99,
     65, 99, 65, 99,  99, 65, 99, 99,
@@ -1157,7 +1157,17 @@ static char from64[128] =
     99, 26, 27, 28,  29, 30, 31, 32,
     33, 34, 35, 36,  37, 38, 39, 40,
     41, 42, 43, 44,  45, 46, 47, 48,
-    49, 50, 51, 99,  99, 99, 99, 99
+    49, 50, 51, 99,  99, 99, 99, 99,
+
+        // 128
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,
+    99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99,  99, 99, 99, 99
 };
 
 
@@ -1169,16 +1179,38 @@ EString EString::de64() const
     // this code comes from mailchen, adapted for EString.
     EString result;
     result.reserve( length() * 3 / 4 + 20 ); // 20 = fudge
-    EString body;
+    const unsigned char * s = (const unsigned char *)data();
+    char * o = result.d->str;
+    uint l = length();
     uint bp = 0;
     uint decoded = 0;
     int m = 0;
     uint p = 0;
     bool done = false;
-    while ( p < length() && !done ) {
-        uint c = d->str[p++];
-        if ( c <= 'z' )
-            c = from64[c];
+    while ( p < l && !done ) {
+        // the common case is a run of unbroken groups of four
+        // characters, which we decode without looking at them one by
+        // one. anything unusual (whitespace, padding, garbage) goes
+        // through the loop below.
+        if ( m == 0 ) {
+            while ( p + 4 <= l ) {
+                uint c0 = from64[s[p]];
+                uint c1 = from64[s[p+1]];
+                uint c2 = from64[s[p+2]];
+                uint c3 = from64[s[p+3]];
+                if ( ( c0 | c1 | c2 | c3 ) >= 64 )
+                    break;
+                o[bp] = ( c0 << 2 ) | ( c1 >> 4 );
+                o[bp+1] = ( ( c1 & 15 ) << 4 ) | ( c2 >> 2 );
+                o[bp+2] = ( ( c2 & 3 ) << 6 ) | c3;
+                bp += 3;
+                p += 4;
+            }
+            if ( p >= l )
+                break;
+        }
+
+        uint c = from64[s[p++]];
         if ( c < 64 ) {
             switch ( m ) {
             case 0:
@@ -1186,17 +1218,17 @@ EString EString::de64() const
                 break;
             case 1:
                 decoded += ( (c & 0xf0) >> 4 );
-                result.d->str[bp++] = decoded;
+                o[bp++] = decoded;
                 decoded = (c & 15) << 4;
                 break;
             case 2:
                 decoded += ( (c & 0xfc) >> 2 );
-                result.d->str[bp++] = decoded;
+                o[bp++] = decoded;
                 decoded = (c & 3) << 6;
                 break;
             case 3:
                 decoded += c;
-                result.d->str[bp++] = decoded;
+                o[bp++] = decoded;
                 break;
             }
             m = (m+1)&3;
@@ -1230,50 +1262,105 @@ static char to64[65] =
 EString EString::e64( uint lineLength ) const
 {
     // this code comes from mailchen, adapted for EString
-    int l = length();
-    int i = 0;
+    uint l = length();
+    uint groups = ( l + 2 ) / 3;
+    uint size = groups * 4;
+    uint perLine = 0;
+    if ( lineLength > 0 ) {
+        perLine = ( lineLength + 3 ) / 4;
+        size += 2 * ( groups / perLine + 1 );
+    }
+
     EString r;
-    r.reserve( l*2 );
-    int p = 0;
-    uint c = 0;
-    while ( i <= l-3 ) {
-        r.d->str[p++] = to64[ ((d->str[i]>>2))&63 ];
-        r.d->str[p++] = to64[ ((d->str[i]<<4)&48) + ((d->str[i+1]>>4)&15) ];
-        r.d->str[p++] = to64[ ((d->str[i+1]<<2)&60) + ((d->str[i+2]>>6)&3) ];
-        r.d->str[p++] = to64[ (d->str[i+2]&63) ];
+    r.reserve( size );
+    const unsigned char * s = (const unsigned char *)data();
+    char * o = r.d->str;
+    uint i = 0;
+    uint p = 0;
+    uint g = 0;
+    while ( i + 3 <= l ) {
+        uint i0 = s[i];
+        uint i1 = s[i+1];
+        uint i2 = s[i+2];
+        o[p] = to64[ i0 >> 2 ];
+        o[p+1] = to64[ ( ( i0 & 3 ) << 4 ) | ( i1 >> 4 ) ];
+        o[p+2] = to64[ ( ( i1 & 15 ) << 2 ) | ( i2 >> 6 ) ];
+        o[p+3] = to64[ i2 & 63 ];
+        p += 4;
         i += 3;
-        c += 4;
-        if ( lineLength > 0 && c >= lineLength ) {
-            r.d->str[p++] = 13;
-            r.d->str[p++] = 10;
-            c = 0;
+        g++;
+        if ( g == perLine ) {
+            o[p++] = 13;
+            o[p++] = 10;
+            g = 0;
         }
     }
     if ( i < l ) {
-        int i0, i1, i2;
-        i0 = d->str[i];
-        i1 = i+1 < l ? d->str[i+1] : 0;
-        i2 = i+2 < l ? d->str[i+2] : 0;
-        r.d->str[p++] = to64[ ((i0>>2))&63 ];
-        r.d->str[p++] = to64[ ((i0<<4)&48) + ((i1>>4)&15) ];
+        uint i0, i1, i2;
+        i0 = s[i];
+        i1 = i+1 < l ? s[i+1] : 0;
+        i2 = i+2 < l ? s[i+2] : 0;
+        o[p++] = to64[ i0 >> 2 ];
+        o[p++] = to64[ ( ( i0 & 3 ) << 4 ) | ( i1 >> 4 ) ];
         if ( i+1 < l )
-            r.d->str[p++] = to64[ ((i1<<2)&60) + ((i2>>6)&3) ];
+            o[p++] = to64[ ( ( i1 & 15 ) << 2 ) | ( i2 >> 6 ) ];
         else
-            r.d->str[p++] = '=';
+            o[p++] = '=';
         if ( i+2 < l )
-            r.d->str[p++] = to64[ (i2&63) ];
+            o[p++] = to64[ i2 & 63 ];
         else
-            r.d->str[p++] = '=';
+            o[p++] = '=';
     }
-    if ( lineLength > 0 && c > 0 ) {
-        r.d->str[p++] = 13;
-        r.d->str[p++] = 10;
+    if ( perLine && g > 0 ) {
+        o[p++] = 13;
+        o[p++] = 10;
     }
     r.d->len = p;
     return r;
 }
 
 
+// the value of each hex digit as number( ok, 16 ) sees it, or 255
+// for characters it rejects. number() accepts a few punctuation
+// characters too, and so must we, or the output would change.
+static const unsigned char hexValue[256] =
+{
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+      0,   1,   2,   3,   4,   5,   6,   7,
+      8,   9,   3,   4,   5,   6,   7,   8,
+      9,  10,  11,  12,  13,  14,  15, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255,   4,   5,   6,   7,   8,
+      9,  10,  11,  12,  13,  14,  15, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255
+};
+
+
 /*! Decodes this string according to the quoted-printable algorithm,
     and returns the result. Errors are overlooked, to cope with all
     the mail-munging brokenware in the great big world.
@@ -1287,12 +1374,23 @@ EString EString::deQP( bool underscore ) const
     uint i = 0;
     EString r;
     r.reserve( length() );
-    while ( i < length() ) {
-        if ( d->str[i] != '=' ) {
-            char c = d->str[i++];
-            if ( underscore && c == '_' )
-                c = ' ';
-            r.d->str[r.d->len++] = c;
+    uint l = length();
+    const char * s = data();
+    char * o = r.d->str;
+    while ( i < l ) {
+        if ( s[i] != '=' ) {
+            // copy everything up to the next = in one go
+            const char * e = (const char *)memchr( s + i, '=', l - i );
+            uint n = e ? e - s - i : l - i;
+            memmove( o + r.d->len, s + i, n );
+            if ( underscore ) {
+                char * u = o + r.d->len;
+                char * end = u + n;
+                while ( ( u = (char *)memchr( u, '_', end - u ) ) != 0 )
+                    *u++ = ' ';
+            }
+            r.d->len += n;
+            i += n;
         }
         else {
             // are we looking at = followed by end-of-line?
@@ -1301,21 +1399,25 @@ EString EString::deQP( bool underscore ) const
             bool eol = false;
             uint j = i+1;
             // skip possibly appended whitespace first
-            while ( j < length() &&
-                    ( d->str[j] == ' ' || d->str[j] == '\t' ) )
+            while ( j < l && ( s[j] == ' ' || s[j] == '\t' ) )
                 j++;
             // there are two types of soft EOLs:
-            if ( j < d->len && d->str[j] == 10 ) {
+            if ( j < l && s[j] == 10 ) {
                 eol = true;
                 j++;
             }
-            else if ( j < d->len-1 && d->str[j] == 13 && d->str[j+1] == 10 ) {
+            else if ( j < l-1 && s[j] == 13 && s[j+1] == 10 ) {
                 eol = true;
                 j = j + 2;
             }
-            else if ( i + 2 < d->len ) {
+            else if ( i + 2 < l ) {
                 // ... and one common case: a two-digit hex number, not EOL
-                c = mid( i+1, 2 ).number( &ok, 16 );
+                uint h = hexValue[(unsigned char)s[i+1]];
+                uint lo = hexValue[(unsigned char)s[i+2]];
+                if ( h < 16 && lo < 16 ) {
+                    ok = true;
+                    c = h * 16 + lo;
+                }
             }
 
             // write the proper decoded string and increase i.
@@ -1323,11 +1425,11 @@ EString EString::deQP( bool underscore ) const
                 i = j;
             }
             else if ( ok ) { // ... or if it's a two-digit hex number
-                r.d->str[r.d->len++] = c;
+                o[r.d->len++] = c;
                 i = i + 3;
             }
             else { // ... or if it's an error... we overlook it
-                r.d->str[r.d->len++] = d->str[i++];
+                o[r.d->len++] = s[i++];
             }
         }
     }
@@ -1399,10 +1501,10 @@ EString EString::eQP( bool underscore, bool from ) const
         return *this;
     uint i = 0;
     EString r;
-    // no input character can use more than six output characters (=
-    // CR LF = 3 D), so we allocate as much space as we could possibly
-    // need.
-    r.reserve( length()*6 );
+    // no input character uses more than three output characters, and
+    // a soft line break (= CR LF) is added at most once per 64 output
+    // characters, so this is as much space as we could possibly need.
+    r.reserve( length()*3 + length()/4 + 16 );
     uint c = 0;
     while ( i < d->len ) {
         if ( d->str[i] == 10 ||
@@ -16,6 +16,7 @@ private:
     EStringData( int );
 
     friend class EString;
+    friend class Buffer;
     friend bool operator==( const class EString &, const class EString & );
     friend bool operator==( const class EString &, const char * );
     void * operator new( size_t, uint );
@@ -149,6 +150,7 @@ public:
                     bool spaceAtEOL ) const;
 
 private:
+    friend class Buffer;
     EStringData * d;
 };
 
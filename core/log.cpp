@@ -176,3 +176,16 @@ void Log::setLogLevel( Severity s )
 {
     logLevel = s;
 }
+
+
+/*! Returns true if messages with severity \a s are logged at all, and
+    false if log() would discard them.
+
+    Callers that build expensive messages (typically at Debug level)
+    can use this to avoid building them in vain.
+*/
+
+bool Log::enabled( Severity s )
+{
+    return s >= logLevel;
+}
@@ -24,6 +24,7 @@ public:
     bool isChildOf( Log * ) const;
 
     static void setLogLevel( Severity );
+    static bool enabled( Severity );
     static const char * severity( Severity );
     static bool disastersYet();
 
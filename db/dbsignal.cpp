@@ -16,9 +16,10 @@ class DatabaseSignalData
     : public Garbage
 {
 public:
-    DatabaseSignalData(): o( 0 ), l( new Log ) {}
+    DatabaseSignalData(): o( 0 ), p( 0 ), l( new Log ) {}
     EString n;
     EventHandler * o;
+    EStringList * p;
     Log * l;
 };
 
@@ -37,15 +38,22 @@ public:
 
 /*! Constructs a DatabaseSignal for \a name which will notify \a
     owner. Forever.
+
+    If \a payloads is non-null, the payload of each notification (the
+    second argument to pg_notify(), which is empty for a plain NOTIFY)
+    is appended to it before \a owner is notified. The owner is
+    expected to empty the list as it handles the notifications.
 */
 
-DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
+DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner,
+                                EStringList * payloads )
     : Garbage(), d( new DatabaseSignalData )
 {
     Scope x( d->l );
     owner->setLog( d->l );
     d->n = name;
     d->o = owner;
+    d->p = payloads;
     if ( !signals ) {
         signals = new List<DatabaseSignal>;
         Allocator::addEternal( signals, "database notify/listen listeners" );
@@ -57,17 +65,21 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name, and records \a payload for those which asked for it.
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
-            s->d->o->notify();
+        if ( name != s->d->n || !s->d->o )
+            continue;
+        if ( s->d->p )
+            s->d->p->append( payload );
+        s->d->o->notify();
     }
 }
 
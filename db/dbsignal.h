@@ -12,9 +12,9 @@ class DatabaseSignal
     : public Garbage
 {
 public:
-    DatabaseSignal( const EString &, EventHandler * );
+    DatabaseSignal( const EString &, EventHandler *, EStringList * = 0 );
 
-    static void notifyAll( const EString & );
+    static void notifyAll( const EString &, const EString & = "" );
 
     static EStringList * names();
 
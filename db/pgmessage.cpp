@@ -858,8 +858,28 @@ void PgExecute::encodeData()
 
     The message data contains the 16-bit number of columns, and pairs of
     (Int32 n, Byten) for each column. A column with length -1 is NULL.
+
+    The whole message is taken from the Buffer at once and decoded in
+    place. Text and bytea columns share memory with the message rather
+    than being copied, and if the message is large, the message itself
+    shares memory with the Buffer (see Buffer::slice()).
 */
 
+
+static inline uint decode16( const char * s )
+{
+    const unsigned char * p = (const unsigned char *)s;
+    return ( p[0] << 8 ) | p[1];
+}
+
+
+static inline uint decode32( const char * s )
+{
+    const unsigned char * p = (const unsigned char *)s;
+    return ( (uint)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+}
+
+
 /*! This function constructs a new PgDataRow based on the contents of
     the Buffer \a b, and the PgRowDescription \a d.
 */
@@ -867,7 +887,24 @@ void PgExecute::encodeData()
 PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
     : PgServerMessage( b )
 {
-    uint c = decodeInt16();
+    if ( buf->size() < l || l < 2 )
+        throw Syntax;
+
+    // small rows are copied, so that a long-lived column value
+    // doesn't keep a large read buffer alive.
+    EString m;
+    if ( l < 1024 )
+        m = buf->string( l );
+    else
+        m = buf->slice( l );
+    buf->remove( l );
+    n = l;
+
+    const char * p = m.data();
+    uint pos = 0;
+
+    uint c = decode16( p );
+    pos += 2;
     if ( c != d->columns.count() )
         // Is this really "Syntax"?
         throw Syntax;
@@ -910,83 +947,72 @@ PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
             break;
         }
 
-        int length = decodeInt32();
-        if ( length == -1 )
+        if ( pos + 4 > l )
+            throw Syntax;
+        int length = (int)decode32( p + pos );
+        pos += 4;
+        if ( length == -1 ) {
             cv->type = Column::Null;
+            length = 0;
+        }
+        else if ( length < 0 || pos + length > l ) {
+            throw Syntax;
+        }
+        const char * v = p + pos;
 
         switch ( cv->type ) {
         case Column::Unknown:
             // we've just logged the error, but supplement it
             if ( length > 0 )
                 log( "Unknown column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
+                     " has value " + m.mid( pos, length ).quoted() );
             break;
         case Column::Boolean:
-            if ( length != 1 ) {
+            if ( length != 1 )
                 log( "Boolean column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
-            else {
-                cv->b = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-            }
+                     " has value " + m.mid( pos, length ).quoted() );
+            else
+                cv->b = v[0];
             break;
         case Column::Integer:
             switch ( length ) {
             case 1:
-                cv->i = (*buf)[0];
-                buf->remove( 1 );
-                n++;
+                cv->i = (unsigned char)v[0];
                 break;
             case 2:
-                cv->i = ((*buf)[0] << 8) | (*buf)[1];
-                buf->remove( 2 );
-                n += 2;
+                cv->i = decode16( v );
                 break;
             case 4:
-                cv->i = ((*buf)[0] << 24) | ((*buf)[1] << 16) |
-                        ((*buf)[2] <<  8) | (*buf)[3];
-                buf->remove( 4 );
-                n += 4;
+                cv->i = decode32( v );
                 break;
             default:
                 log( "Integer column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
+                     " has value " + m.mid( pos, length ).quoted() );
             }
             break;
         case Column::Bigint:
-            if ( length == 8 ) {
-                cv->bi = (((int64)(*buf)[0]) << 56) |
-                         (((int64)(*buf)[1]) << 48) |
-                         (((int64)(*buf)[2]) << 40) |
-                         (((int64)(*buf)[3]) << 32) |
-                         (((int64)(*buf)[4]) << 24) |
-                         (((int64)(*buf)[5]) << 16) |
-                         (((int64)(*buf)[6]) <<  8) |
-                         (*buf)[7];
-                buf->remove( 8 );
-                n += 8;
-            }
+            if ( length == 8 )
+                cv->bi = (int64)( ( (unsigned long long)decode32( v ) << 32 ) |
+                                  decode32( v + 4 ) );
             else
                 log( "Bigint column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
+                     " has value " + m.mid( pos, length ).quoted() );
             break;
         case Column::Bytes:
-            cv->s = decodeByten( length );
-            break;
         case Column::Timestamp:
-            cv->s = decodeByten( length );
+            cv->s = m.mid( pos, length );
             break;
         case Column::Null:
             // nothing needed
             break;
         }
 
+        pos += length;
         ++it;
         i++;
     }
-    end();
+    if ( pos != l )
+        throw Syntax;
 
     r = new Row( d, columns );
 }
@@ -43,7 +43,7 @@ public:
           sendingCopy( false ), error( false ),
           keydata( 0 ),
           description( 0 ), transaction( 0 ),
-          needNotify( 0 ), backendPid( 0 )
+          needNotify( 0 ), failed( 0 ), backendPid( 0 )
         {}
 
     bool active;
@@ -62,8 +62,10 @@ public:
     EStringList preparesPending;
 
     List< Query > queries;
+    List< Query > syncs;
     Transaction *transaction;
     Query * needNotify;
+    Query * failed;
 
     EString user;
 
@@ -180,10 +182,18 @@ Postgres::~Postgres()
 
 void Postgres::processQueue()
 {
-    if ( !d->queries.isEmpty() )
+    if ( d->sendingCopy )
         return;
 
-    if ( d->sendingCopy )
+    uint depth = Configuration::scalar( Configuration::DbPipelineDepth );
+    if ( depth < 1 )
+        depth = 1;
+
+    // A transaction may send further queries while earlier ones are
+    // still in flight. Anything else waits for the handle to drain.
+    if ( !d->queries.isEmpty() &&
+         ( depth == 1 || !d->transaction || d->transaction->done() ||
+           d->queries.count() >= depth ) )
         return;
 
     if ( d->transaction &&
@@ -201,16 +211,35 @@ void Postgres::processQueue()
         l = d->transaction->submittedQueries();
     }
     else {
+        bool transactionOK = true;
         if ( listener == this && numHandles() > 1 )
-            l = Database::firstSubmittedQuery( false );
-        else
-            l = Database::firstSubmittedQuery( true );
+            transactionOK = false;
+        l = Database::firstSubmittedQuery( transactionOK );
 
         if ( l->firstElement() && l->firstElement()->transaction() ) {
             Transaction * t = l->firstElement()->transaction();
             d->transaction = t;
             t->setDatabase( this );
         }
+        else {
+            // If more standalone queries are waiting than there are
+            // handles to run them, we take a few more and send them
+            // back-to-back. Each still gets its own Sync, so they
+            // succeed or fail independently.
+            uint waiting = queries->count();
+            List< Query >::Iterator i( queries );
+            while ( i && l->firstElement() && l->count() < depth &&
+                    waiting > numHandles() &&
+                    !l->firstElement()->inputLines() ) {
+                if ( i->transaction() || i->inputLines() ) {
+                    ++i;
+                }
+                else {
+                    l->append( queries->take( i ) );
+                    waiting--;
+                }
+            }
+        }
     }
 
     Query * q = l->shift();
@@ -218,6 +247,15 @@ void Postgres::processQueue()
         q->setState( Query::Executing );
         if ( !d->error ) {
             processQuery( q );
+            // Queries in a transaction share one Sync per batch. We
+            // sync early after a query the caller expects may fail,
+            // after a COPY, and before a rollback, since the server
+            // skips everything between an error and the next Sync.
+            Query * next = l->firstElement();
+            if ( !d->transaction || depth == 1 || !next ||
+                 q->canFail() || q->inputLines() ||
+                 next->string().startsWith( "rollback" ) )
+                sync();
         }
         else {
             q->setError( "Database handle no longer usable." );
@@ -232,14 +270,15 @@ void Postgres::processQueue()
 
 
 /*! Sends whatever messages are required to make the backend process the
-    query \a q.
+    query \a q. The caller must call sync() after this query, or after a
+    later one, to make the server respond.
 */
 
 void Postgres::processQuery( Query * q )
 {
     Scope x( q->log() );
     d->queries.append( q );
-    EString s( "Sent " );
+    bool parsed = false;
     if ( q->name() == "" ||
          !d->prepared.contains( q->name() ) )
     {
@@ -251,7 +290,7 @@ void Postgres::processQuery( Query * q )
             d->preparesPending.append( q->name() );
         }
 
-        s.append( "parse/" );
+        parsed = true;
     }
 
     PgBind b( q->name() );
@@ -264,15 +303,70 @@ void Postgres::processQuery( Query * q )
     PgExecute ex;
     ex.enqueue( writeBuffer() );
 
+    if ( q->inputLines() )
+        d->sendingCopy = true;
+
+    if ( Log::enabled( Log::Debug ) ) {
+        EString s( "Sent " );
+        if ( parsed )
+            s.append( "parse/" );
+        s.append( "execute for " );
+        s.append( q->description() );
+        s.append( " on backend " );
+        s.appendNumber( connectionNumber() );
+        ::log( s, Log::Debug );
+    }
+    recordExecution();
+}
+
+
+/*! Sends a Sync message, which ends the batch of queries sent since
+    the previous Sync. The server responds to each query in the batch,
+    and then sends ReadyForQuery.
+
+    If one query in the batch fails, the server silently skips the
+    rest of it, so we remember the last query in each batch and fail
+    any skipped queries when ReadyForQuery arrives.
+*/
+
+void Postgres::sync()
+{
+    Query * last = d->queries.lastElement();
+    if ( !last || d->syncs.lastElement() == last )
+        return;
+
     PgSync e;
     e.enqueue( writeBuffer() );
+    d->syncs.append( last );
+}
 
-    s.append( "execute for " );
-    s.append( q->description() );
-    s.append( " on backend " );
-    s.appendNumber( connectionNumber() );
-    ::log( s, Log::Debug );
-    recordExecution();
+
+/*! This private helper is called when the server sends ReadyForQuery
+    at the end of a batch. Any query in the batch that is still
+    unanswered was skipped by the server because an earlier query in
+    the same batch failed, so we fail it with an error that names the
+    query responsible.
+*/
+
+void Postgres::finishBatch()
+{
+    Query * last = d->syncs.shift();
+    if ( !last || !d->queries.find( last ) )
+        return;
+
+    Query * q = 0;
+    while ( q != last && !d->queries.isEmpty() ) {
+        q = d->queries.shift();
+        if ( q->inputLines() )
+            d->sendingCopy = false;
+        if ( !q->done() ) {
+            EString e( "Not executed because an earlier query failed" );
+            if ( d->failed )
+                e.append( ": " + d->failed->description() );
+            q->setError( e );
+            q->notify();
+        }
+    }
 }
 
 
@@ -461,19 +555,26 @@ void Postgres::backendStartup( char type )
 {
     switch ( type ) {
     case 'Z':
+        {
+            // This successfully concludes connection startup. The
+            // ReadyForQuery doesn't end any batch of ours, so we
+            // handle it here rather than in process().
+            PgReady msg( readBuffer() );
+            setState( msg.state() );
+        }
         setTimeout( 0 );
         d->startup = false;
-        if ( CitextLookup::necessary() )
+        if ( CitextLookup::necessary() ) {
             processQuery( (new CitextLookup())->q );
+            sync();
+        }
         addHandle( this );
 
-        // This successfully concludes connection startup. We'll leave
-        // this message unparsed, so that process() can handle it like
-        // any other PgReady.
-
-        if ( d->setSessionAuthorisation )
+        if ( d->setSessionAuthorisation ) {
             processQuery( new Query( "SET SESSION AUTHORIZATION " +
                                      Database::user(), 0 ) );
+            sync();
+        }
 
         break;
 
@@ -583,11 +684,6 @@ void Postgres::process( char type )
                 PgEmptyQueryResponse msg( readBuffer() );
 
             if ( q ) {
-                EString s;
-                s.append( "Dequeueing query " );
-                s.append( q->description() );
-                s.append( " on backend " );
-                s.appendNumber( connectionNumber() );
                 EString command;
                 if ( cc )
                     command = cc->tag().section( " ", 1 );
@@ -597,14 +693,21 @@ void Postgres::process( char type )
                         an = 3;
                     q->setRows( cc->tag().section( " ", an ).number( 0 ) );
                 }
-                if ( q->rows() ||
-                     command == "SELECT" || command == "FETCH" ||
-                     command == "INSERT" || command == "UPDATE" ) {
-                    s.append( " (with " );
-                    s.appendNumber( q->rows() );
-                    s.append( " rows)" );
+                if ( Log::enabled( Log::Info ) ) {
+                    EString s;
+                    s.append( "Dequeueing query " );
+                    s.append( q->description() );
+                    s.append( " on backend " );
+                    s.appendNumber( connectionNumber() );
+                    if ( q->rows() ||
+                         command == "SELECT" || command == "FETCH" ||
+                         command == "INSERT" || command == "UPDATE" ) {
+                        s.append( " (with " );
+                        s.appendNumber( q->rows() );
+                        s.append( " rows)" );
+                    }
+                    ::log( s, Log::Info );
                 }
-                ::log( s, Log::Info );
                 if ( !q->done() ) {
                     q->setState( Query::Completed );
                     countQueries( q );
@@ -620,6 +723,8 @@ void Postgres::process( char type )
         {
             PgReady msg( readBuffer() );
             setState( msg.state() );
+            finishBatch();
+            d->failed = 0;
         }
         break;
 
@@ -631,7 +736,7 @@ void Postgres::process( char type )
                 s = " (" + msg.source() + ")";
             log( "Received notify " + msg.name().quoted() +
                  " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -908,6 +1013,7 @@ void Postgres::serverMessage()
         if ( q->inputLines() )
             d->sendingCopy = false;
         d->queries.shift();
+        d->failed = q;
         m = mapped( m );
         if ( !msg.detail().isEmpty() )
             s.append( " (" + msg.detail() + ")" );
@@ -1098,11 +1204,17 @@ void Postgres::shutdown()
 
 static bool hasMessage( Buffer *b )
 {
-    if ( b->size() < 5 ||
-         b->size() < 1+( (uint)((*b)[1]<<24)|((*b)[2]<<16)|
-                               ((*b)[3]<<8)|((*b)[4]) ) )
+    if ( b->size() < 5 )
         return false;
-    return true;
+    uint l = 1 + ( ((uint)(*b)[1]<<24)|((*b)[2]<<16)|
+                   ((*b)[3]<<8)|((*b)[4]) );
+    if ( b->size() >= l )
+        return true;
+    // if it's large, have the rest of the message arrive next to the
+    // part we have, so PgDataRow can use it without copying.
+    if ( l > 8192 )
+        b->reserve( l - b->size() );
+    return false;
 }
 
 
@@ -1174,6 +1286,7 @@ void Postgres::sendListen()
             if ( !name.boring() )
                 name = name.quoted();
             processQuery( new Query( "listen " + name, 0 ) );
+            sync();
         }
     }
 }
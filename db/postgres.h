@@ -30,6 +30,8 @@ private:
     class PgData *d;
 
     void processQuery( Query * );
+    void sync();
+    void finishBatch();
     void authentication( char );
     void backendStartup( char );
     void process( char );
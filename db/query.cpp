@@ -748,6 +748,33 @@ Row *Query::nextRow()
 }
 
 
+/*! Removes up to \a max unread rows, stores the integer in the first
+    column of each in \a values, and returns the number of rows
+    removed. Returns 0 if there are no rows left to read.
+
+    This is meant for queries which return a single integer column,
+    such as a list of UIDs: the caller can decode a batch of rows into
+    a plain array instead of calling nextRow() and Row::getInt() for
+    each. NULL values are stored as 0.
+*/
+
+uint Query::nextIntegers( uint * values, uint max )
+{
+    uint n = 0;
+    while ( n < max ) {
+        Row * r = d->rows.shift();
+        if ( !r )
+            break;
+        if ( r->isNull( 0 ) )
+            values[n] = 0;
+        else
+            values[n] = r->getInt( 0 );
+        n++;
+    }
+    return n;
+}
+
+
 /*! \class Row query.h
     Represents a single row of data retrieved from the Database.
 
@@ -759,6 +786,10 @@ Row *Query::nextRow()
     and use the getInt()/getEString()/etc. accessor functions, each of
     which takes a column name, to retrieve the values of each column
     in the Row.
+
+    Each accessor also exists in a form which takes a column number,
+    as returned by column(). Code which processes many rows should use
+    those, and look up each column number once per result.
 */
 
 
@@ -772,28 +803,68 @@ Row::Row( const PgRowDescription * desc, Column * c )
 }
 
 
-/*! This private helper returns the column named \a f, or a null
-    pointer if \a f does not exist.
-
-    If \a warn is true and \a f does not exist or has a type other
-    than \a type, then fetch() logs a warning.
+/*! This private helper returns the index of the column named \a f,
+    or -1 if \a f does not exist. If \a warn is true and \a f does not
+    exist, find() logs a warning.
 */
 
-const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
+int Row::find( const char * f, bool warn ) const
 {
     int * x = layout->names.find( f, strlen( f ) * 8 );
-    if ( !x ) {
+    if ( x )
+        return *x;
+    if ( warn )
+        log( "Note: Column " + EString( f ).quoted() + " does not exist",
+             Log::Error );
+    return -1;
+}
+
+
+/*! This private helper returns column number \a i, or a null pointer
+    if \a i is not a valid column number.
+
+    If \a warn is true and column \a i has a type other than \a type,
+    then fetch() logs a warning.
+*/
+
+const Column * Row::fetch( int i, Column::Type type, bool warn ) const
+{
+    if ( i < 0 )
+        return 0;
+    if ( (uint)i >= layout->count ) {
         if ( warn )
-            log( "Note: Column " + EString( f ).quoted() + " does not exist",
+            log( "Note: Column " + fn( i ) + " does not exist",
                  Log::Error );
         return 0;
     }
 
-    if ( warn && type != data[*x].type )
+    if ( warn && type != data[i].type ) {
+        EString name;
+        List<PgRowDescription::Column>::Iterator c( layout->columns );
+        while ( c && c->column2 != i )
+            ++c;
+        if ( c )
+            name = c->name;
         log( "Note: Expected type " + Column::typeName( type ) +
-             " for column " + EString( f ).quoted() + ", but received " +
-             Column::typeName( data[*x].type ), Log::Error );
-    return &data[*x];
+             " for column " + name.quoted() + ", but received " +
+             Column::typeName( data[i].type ), Log::Error );
+    }
+    return &data[i];
+}
+
+
+/*! Returns the index of the column named \a f, or -1 if there is no
+    such column.
+
+    All rows received in response to the same query share their column
+    layout, so a caller which processes many rows can look up the
+    index once and then use the accessors that take an index, such as
+    getInt( int ), instead of looking up the name for each row.
+*/
+
+int Row::column( const char * f ) const
+{
+    return find( f, false );
 }
 
 
@@ -803,7 +874,17 @@ const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
 
 bool Row::isNull( const char *f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
+    return isNull( find( f, false ) );
+}
+
+
+/*! Returns true if column number \a i is NULL or does not exist,
+    and false in all other cases.
+*/
+
+bool Row::isNull( int i ) const
+{
+    const Column * c = fetch( i, Column::Null, false );
     if ( !c )
         return true; // XXX the two isNull()s differed
 
@@ -819,7 +900,17 @@ bool Row::isNull( const char *f ) const
 
 bool Row::getBoolean( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Boolean, true );
+    return getBoolean( find( f, true ) );
+}
+
+
+/*! Returns the boolean value of column number \a i if it exists
+    and is NOT NULL, and false otherwise.
+*/
+
+bool Row::getBoolean( int i ) const
+{
+    const Column * c = fetch( i, Column::Boolean, true );
     if ( !c )
         return false;
     if ( c->type != Column::Boolean )
@@ -834,7 +925,17 @@ bool Row::getBoolean( const char * f ) const
 
 int Row::getInt( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Integer, true );
+    return getInt( find( f, true ) );
+}
+
+
+/*! Returns the integer value of column number \a i if it exists
+    and is NOT NULL, and 0 otherwise.
+*/
+
+int Row::getInt( int i ) const
+{
+    const Column * c = fetch( i, Column::Integer, true );
     if ( !c )
         return 0;
     if ( c->type != Column::Integer )
@@ -849,7 +950,17 @@ int Row::getInt( const char * f ) const
 
 int64 Row::getBigint( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Bigint, true );
+    return getBigint( find( f, true ) );
+}
+
+
+/*! Returns the 64-bit integer value of column number \a i if it
+    exists and is NOT NULL; 0 otherwise.
+*/
+
+int64 Row::getBigint( int i ) const
+{
+    const Column * c = fetch( i, Column::Bigint, true );
     if ( !c )
         return 0;
     if ( c->type != Column::Bigint )
@@ -864,7 +975,17 @@ int64 Row::getBigint( const char * f ) const
 
 EString Row::getEString( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Bytes, true );
+    return getEString( find( f, true ) );
+}
+
+
+/*! Returns the string value of column number \a i if it exists and
+    is NOT NULL, and an empty string otherwise.
+*/
+
+EString Row::getEString( int i ) const
+{
+    const Column * c = fetch( i, Column::Bytes, true );
     if ( !c )
         return "";
     if ( c->type != Column::Bytes )
@@ -878,9 +999,19 @@ EString Row::getEString( const char * f ) const
 */
 
 UString Row::getUString( const char * f ) const
+{
+    return getUString( find( f, true ) );
+}
+
+
+/*! Returns the string value of column number \a i if it exists and
+    is NOT NULL, and an empty string otherwise.
+*/
+
+UString Row::getUString( int i ) const
 {
     UString r;
-    const Column * c = fetch( f, Column::Bytes, true );
+    const Column * c = fetch( i, Column::Bytes, true );
     if ( !c )
         return r;
     if ( c->type != Column::Bytes )
@@ -897,10 +1028,7 @@ UString Row::getUString( const char * f ) const
 
 bool Row::hasColumn( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( c )
-        return true;
-    return false;
+    return find( f, false ) >= 0;
 }
 
 
@@ -910,7 +1038,7 @@ bool Row::hasColumn( const char * f ) const
 
 Column::Type Row::columnType( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
+    const Column * c = fetch( find( f, false ), Column::Null, false );
     if ( c )
         return c->type;
     return Column::Unknown;
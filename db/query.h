@@ -115,6 +115,7 @@ public:
     bool hasResults() const;
     void addRow( Row * );
     Row *nextRow();
+    uint nextIntegers( uint *, uint );
 
     class Log * log() const;
 
@@ -156,13 +157,22 @@ public:
     bool hasColumn( const char * ) const;
     Column::Type columnType( const char * ) const;
 
+    int column( const char * ) const;
+    bool isNull( int ) const;
+    int getInt( int ) const;
+    int64 getBigint( int ) const;
+    bool getBoolean( int ) const;
+    EString getEString( int ) const;
+    UString getUString( int ) const;
+
     EStringList * columnNames() const;
 
 private:
     const Column * data;
     const class PgRowDescription * layout;
 
-    const Column * fetch( const char *, Column::Type, bool ) const;
+    int find( const char *, bool ) const;
+    const Column * fetch( int, Column::Type, bool ) const;
 };
 
 
@@ -592,6 +592,18 @@ bool Schema::singleStep()
         c = stepTo97(); break;
     case 97:
         c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4420,3 +4432,201 @@ bool Schema::stepTo98()
     d->t->enqueue( "alter table mailboxes add flag text" );
     return true;
 }
+
+
+/*! Add a table to hold rendered copies of messages. */
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding rendered_messages." );
+    d->t->enqueue( "create table rendered_messages ("
+                   "message integer not null references messages(id) "
+                   "on delete cascade, "
+                   "downgraded boolean not null, "
+                   "data bytea not null, "
+                   "primary key(message, downgraded))" );
+    return true;
+}
+
+
+/*! Adds a trigger which sends the mailbox id along with
+    mailboxes_updated, so that the servers can reread only the rows
+    that changed.
+*/
+
+bool Schema::stepTo100()
+{
+    describeStep( "Notifying the id of each changed mailbox." );
+    d->t->enqueue( "create or replace function check_mailbox_update() "
+                   "returns trigger as $$"
+                   "declare address text; "
+                   "begin "
+                   "if new.deleted='t' and old.deleted='f' then "
+                   "perform * from mailbox_messages where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is not empty', new.name;"
+                   "end if; "
+                   "select a.localpart||'@'||a.domain into address"
+                   " from addresses a join aliases al on (a.id=al.address)"
+                   " where al.mailbox=new.id;"
+                   "if address is not null then "
+                   "raise exception '% used by alias %', new.name, address; "
+                   "end if; "
+                   "perform * from fileinto_targets where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is used by sieve fileinto', new.name;"
+                   "end if; "
+                   "end if; "
+                   "return new; "
+                   "end;$$ language plpgsql" );
+    d->t->enqueue( "create function note_mailbox_change() "
+                   "returns trigger as $$"
+                   "begin "
+                   "perform pg_notify('mailboxes_updated', new.id::text); "
+                   "return null; "
+                   "end;$$ language plpgsql" );
+    d->t->enqueue( "create trigger mailbox_change_trigger "
+                   "after insert or update on mailboxes for each row "
+                   "execute procedure note_mailbox_change()" );
+    return true;
+}
+
+
+/*! Creates the aox text search configuration, which the full-text
+    indices on bodyparts and header_fields use. It starts out as a
+    copy of simple, since IMAP SEARCH wants substrings rather than
+    stems, and can be changed locally with alter text search
+    configuration.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Adding the aox text search configuration." );
+    d->t->enqueue( "create text search configuration aox "
+                   "(copy = pg_catalog.simple)" );
+    return true;
+}
+
+
+/*! Adds sort_keys, which holds the keys SORT uses for each message
+    injected from now on.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding sort_keys." );
+    d->t->enqueue( "create table sort_keys ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "subject text not null, "
+                   "from_address text not null, "
+                   "from_display text not null, "
+                   "to_address text not null, "
+                   "to_display text not null, "
+                   "cc_address text not null, "
+                   "sent integer)" );
+    return true;
+}
+
+
+/*! Adds mailbox_counters, which triggers keep current, so that STATUS
+    can read the number of messages, unseen messages and bytes in a
+    mailbox instead of counting them.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Adding mailbox_counters." );
+    d->t->enqueue( "create table mailbox_counters ("
+                   "mailbox integer primary key references mailboxes(id) "
+                   "on delete cascade, "
+                   "messages integer not null default 0, "
+                   "unseen integer not null default 0, "
+                   "size bigint not null default 0)" );
+    d->t->enqueue( "lock mailbox_messages in exclusive mode" );
+    d->t->enqueue( "insert into mailbox_counters "
+                   "(mailbox, messages, unseen, size) "
+                   "select mb.id, count(mm.uid), "
+                   "coalesce(sum(case when mm.seen then 0 else 1 end),0), "
+                   "coalesce(sum(m.rfc822size),0) "
+                   "from mailboxes mb "
+                   "left join mailbox_messages mm on (mb.id=mm.mailbox) "
+                   "left join messages m on (mm.message=m.id) "
+                   "group by mb.id" );
+    d->t->enqueue( "create function add_mailbox_counters() "
+                   "returns trigger as $$"
+                   "begin "
+                   "insert into mailbox_counters (mailbox) values (new.id); "
+                   "return null; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger mailbox_counters_insert_trigger "
+                   "after insert on mailboxes for each row "
+                   "execute procedure add_mailbox_counters()" );
+    d->t->enqueue( "create function count_mailbox_messages() "
+                   "returns trigger as $$"
+                   "begin "
+                   "if tg_op = 'INSERT' then "
+                   "update mailbox_counters set "
+                   "messages=messages+1, "
+                   "unseen=unseen+(case when new.seen then 0 else 1 end), "
+                   "size=size+coalesce((select rfc822size from messages"
+                   " where id=new.message), 0) "
+                   "where mailbox=new.mailbox; "
+                   "elsif tg_op = 'DELETE' then "
+                   "update mailbox_counters set "
+                   "messages=messages-1, "
+                   "unseen=unseen-(case when old.seen then 0 else 1 end), "
+                   "size=size-coalesce((select rfc822size from messages"
+                   " where id=old.message), 0) "
+                   "where mailbox=old.mailbox; "
+                   "elsif new.seen <> old.seen then "
+                   "update mailbox_counters set "
+                   "unseen=unseen+(case when new.seen then -1 else 1 end) "
+                   "where mailbox=new.mailbox; "
+                   "end if; "
+                   "return null; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger mailbox_counters_trigger "
+                   "after insert or delete or update of seen "
+                   "on mailbox_messages for each row "
+                   "execute procedure count_mailbox_messages()" );
+    return true;
+}
+
+
+/*! Adds triggers to notify the servers when aliases, users, scripts
+    or the deleted/owner columns of mailboxes change, so that they can
+    cache what they know about recipients.
+*/
+
+bool Schema::stepTo104()
+{
+    describeStep( "Adding notifications for aliases and scripts." );
+    d->t->enqueue( "create function notify_aliases() "
+                   "returns trigger as $$"
+                   "begin "
+                   "notify aliases_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger aliases_trigger "
+                   "after insert or update or delete on aliases "
+                   "for each statement "
+                   "execute procedure notify_aliases()" );
+    d->t->enqueue( "create trigger users_aliases_trigger "
+                   "after update or delete on users "
+                   "for each statement "
+                   "execute procedure notify_aliases()" );
+    d->t->enqueue( "create trigger mailboxes_aliases_trigger "
+                   "after update of deleted, owner on mailboxes "
+                   "for each statement "
+                   "execute procedure notify_aliases()" );
+    d->t->enqueue( "create function notify_scripts() "
+                   "returns trigger as $$"
+                   "begin "
+                   "notify scripts_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger scripts_trigger "
+                   "after insert or update or delete on scripts "
+                   "for each statement "
+                   "execute procedure notify_scripts()" );
+    return true;
+}
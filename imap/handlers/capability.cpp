@@ -127,6 +127,8 @@ EString Capability::capabilities( IMAP * i, bool all )
     }
     if ( Configuration::toggle( Configuration::UseTls ) && !i->hasTls() )
         c.append( "STARTTLS" );
+    if ( all || login )
+        c.append( "STATUS=SIZE" );
     if ( all || login ) {
         c.append( "THREAD=ORDEREDSUBJECT" );
         c.append( "THREAD=REFS" );
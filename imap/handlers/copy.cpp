@@ -220,7 +220,10 @@ void Copy::execute()
 
         transaction()->enqueue( new Query( "drop table t", 0 ) );
 
-        Mailbox::refreshMailboxes( transaction() );
+        IntegerSet ids;
+        ids.add( d->mailbox->id() );
+        ids.add( session()->mailbox()->id() );
+        Mailbox::refreshMailboxes( transaction(), ids );
 
         transaction()->commit();
     }
@@ -222,7 +222,9 @@ void Expunge::execute()
         q->bind( 1, d->modseq + 1 );
         q->bind( 2, d->s->mailbox()->id() );
         transaction()->enqueue( q );
-        Mailbox::refreshMailboxes( transaction() );
+        IntegerSet ids;
+        ids.add( d->s->mailbox()->id() );
+        Mailbox::refreshMailboxes( transaction(), ids );
         transaction()->commit();
     }
 
@@ -60,6 +60,7 @@ public:
           databaseId( false ), threadId( false ), vanished( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          rendered( false ), pushdown( 0 ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
           annotationFetcher( 0 ), modseqFetcher( 0 )
     {}
@@ -97,6 +98,26 @@ public:
     bool needsAddresses;
     bool needsBody;
     bool needsPartNumbers;
+    // ... or, if all sections are the entire message, its text
+    bool rendered;
+    // ... or, if only one partial section needs a body, that section
+    // read straight from the database
+    Section * pushdown;
+
+    class PartialQuery
+        : public Garbage
+    {
+    public:
+        PartialQuery(): q( 0 ), skip( 0 ), base64( false ) {}
+        Query * q;
+        IntegerSet uids;
+        uint skip;
+        bool base64;
+    };
+    List<PartialQuery> partialQueries;
+    IntegerSet requested;
+    IntegerSet fullBody;
+    Map<EString> slices;
 
     EStringList entries;
     EStringList attribs;
@@ -261,6 +282,39 @@ void Fetch::parse()
     }
     if ( d->needsBody )
         d->needsHeader = true; // Bodypart::asText() needs mime type etc
+    if ( d->needsBody && !d->envelope && !d->body && !d->bodystructure ) {
+        // if the client wants nothing but entire messages, the
+        // Fetcher may be able to use the stored rendered text
+        d->rendered = true;
+        List<Section>::Iterator s( d->sections );
+        while ( s && d->rendered ) {
+            if ( s->id != "rfc822" &&
+                 !( s->id.isEmpty() && s->part.isEmpty() ) )
+                d->rendered = false;
+            ++s;
+        }
+    }
+    if ( d->needsBody && !d->rendered ) {
+        // if the only body the client wants is a byte range of a
+        // single bodypart, e.g. BODY.PEEK[2]<0.2048>, we can ask the
+        // database for just that range instead of fetching bodies.
+        Section * partial = 0;
+        uint bodies = 0;
+        List<Section>::Iterator s( d->sections );
+        while ( s ) {
+            if ( s->needsBody ||
+                 s->id == "rfc822" || s->id == "rfc822.text" ) {
+                bodies++;
+                if ( s->partial && s->id.isEmpty() && !s->part.isEmpty() )
+                    partial = s;
+            }
+            ++s;
+        }
+        if ( bodies == 1 && partial ) {
+            d->pushdown = partial;
+            d->needsBody = false;
+        }
+    }
     if ( !ok() )
         return;
     EStringList l;
@@ -874,6 +928,7 @@ void Fetch::sendFetchQueries()
     bool haveBody = true;
     bool havePartNumbers = true;
     bool haveTrivia = true;
+    bool haveRendered = true;
 
     List<Message> * l = new List<Message>;
 
@@ -891,16 +946,25 @@ void Fetch::sendFetchQueries()
             haveBody = false;
         if ( !m->hasTrivia() )
             haveTrivia = false;
+        if ( !m->hasRfc822() &&
+             !( m->hasAddresses() && m->hasHeaders() && m->hasBodies() ) )
+            haveRendered = false;
         l->append( m );
     }
 
     Fetcher * f = new Fetcher( l, this, imap() );
-    if ( d->needsAddresses && !haveAddresses )
-        f->fetch( Fetcher::Addresses );
-    if ( d->needsHeader && !haveHeader )
-        f->fetch( Fetcher::OtherHeader );
-    if ( d->needsBody && !haveBody )
-        f->fetch( Fetcher::Body );
+    if ( d->rendered ) {
+        if ( !haveRendered )
+            f->fetch( Fetcher::Rendered );
+    }
+    else {
+        if ( d->needsAddresses && !haveAddresses )
+            f->fetch( Fetcher::Addresses );
+        if ( d->needsHeader && !haveHeader )
+            f->fetch( Fetcher::OtherHeader );
+        if ( d->needsBody && !haveBody )
+            f->fetch( Fetcher::Body );
+    }
     if ( ( d->rfc822size || d->internaldate ||
            d->databaseId || d->threadId ) && !haveTrivia )
         f->fetch( Fetcher::Trivia );
@@ -1144,7 +1208,21 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
 
     List< Section >::Iterator it( d->sections );
     while ( it ) {
-        l.append( sectionResponse( it, m, unicode ) );
+        EString * slice = 0;
+        if ( it == d->pushdown )
+            slice = d->slices.find( uid );
+        if ( slice ) {
+            EString item( it->binary ? "BINARY[" : "BODY[" );
+            item.append( it->part );
+            item.append( "]<" );
+            item.appendNumber( it->offset );
+            item.append( "> " );
+            item.append( imapQuoted( *slice, NString ) );
+            l.append( item );
+        }
+        else {
+            l.append( sectionResponse( it, m, unicode ) );
+        }
         ++it;
     }
 
@@ -1725,19 +1803,39 @@ void Fetch::pickup()
     if ( d->modseqFetcher && !d->modseqFetcher->done() )
         return;
 
+    if ( d->pushdown )
+        sendPartialQueries();
+
     bool ok = true;
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
         uint uid = d->remaining.smallest();
         Message * m = d->messages.find( uid );
-        if ( d->needsAddresses && !m->hasAddresses() )
-            ok = false;
-        if ( d->needsHeader && !m->hasHeaders() )
-            ok = false;
+        if ( d->rendered ) {
+            if ( !m->hasRfc822() &&
+                 !( m->hasAddresses() && m->hasHeaders() &&
+                    m->hasBodies() ) )
+                ok = false;
+        }
+        else {
+            if ( d->needsAddresses && !m->hasAddresses() )
+                ok = false;
+            if ( d->needsHeader && !m->hasHeaders() )
+                ok = false;
+            if ( d->needsBody && !m->hasBodies() )
+                ok = false;
+        }
         if ( d->needsPartNumbers && !m->hasBytesAndLines() )
             ok = false;
-        if ( d->needsBody && !m->hasBodies() )
-            ok = false;
+        if ( d->pushdown ) {
+            if ( d->fullBody.contains( uid ) ) {
+                if ( !m->hasBodies() )
+                    ok = false;
+            }
+            else if ( !d->slices.find( uid ) ) {
+                ok = false;
+            }
+        }
         if ( ( d->rfc822size || d->internaldate ||
                d->databaseId || d->threadId ) && !m->hasTrivia() )
             ok = false;
@@ -1810,6 +1908,7 @@ void ImapFetchResponse::setSent()
 void Fetch::forget( uint uid )
 {
     d->messages.remove( uid );
+    d->slices.remove( uid );
 }
 
 
@@ -1823,6 +1922,141 @@ Message * Fetch::message( uint uid ) const
 }
 
 
+/*! Reads the results of the queries issued for a partial section
+    (see FetchData::pushdown), and issues more queries for the
+    messages whose headers have arrived since the last call.
+
+    A range can be read from the database if the bodypart is a leaf
+    whose content is stored as binary data, and either isn't encoded
+    or is encoded using base64. For base64, each line of output
+    contains 54 bytes of data, so we read whole lines and encode them.
+    Anything else, including text parts, needs the entire bodypart,
+    so we fall back to fetching the entire body of such messages.
+*/
+
+void Fetch::sendPartialQueries()
+{
+    Section * s = d->pushdown;
+    List<Message> * full = new List<Message>;
+
+    List<FetchData::PartialQuery>::Iterator pq( d->partialQueries );
+    while ( pq ) {
+        FetchData::PartialQuery * p = pq;
+        while ( p->q->hasResults() ) {
+            Row * r = p->q->nextRow();
+            uint uid = r->getInt( "uid" );
+            EString data = r->getEString( "data" );
+            if ( p->base64 )
+                data = data.e64( 70 ).mid( p->skip, s->length );
+            d->slices.insert( uid, new EString( data ) );
+            p->uids.remove( uid );
+        }
+        if ( p->q->done() ) {
+            // the part isn't a leaf in the database after all
+            while ( !p->uids.isEmpty() ) {
+                uint uid = p->uids.smallest();
+                p->uids.remove( uid );
+                Message * m = d->messages.find( uid );
+                d->fullBody.add( uid );
+                if ( m && !m->hasBodies() )
+                    full->append( m );
+            }
+            d->partialQueries.take( pq );
+        }
+        else {
+            ++pq;
+        }
+    }
+
+    FetchData::PartialQuery * base64 = 0;
+    FetchData::PartialQuery * plain = 0;
+    IntegerSet r( d->remaining );
+    r.remove( d->requested );
+    while ( !r.isEmpty() ) {
+        uint uid = r.smallest();
+        r.remove( uid );
+        Message * m = d->messages.find( uid );
+        if ( !m || !m->hasHeaders() )
+            break;
+        d->requested.add( uid );
+
+        Bodypart * bp = m->bodypart( s->part, false );
+        ContentType * ct = 0;
+        EString::Encoding e = EString::Binary;
+        if ( bp ) {
+            ct = bp->contentType();
+            e = bp->contentTransferEncoding();
+        }
+        if ( m->hasBodies() || !bp || !bp->children()->isEmpty() ||
+             !ct || ct->type() == "text" ||
+             ct->type() == "multipart" || ct->type() == "message" ||
+             ( !s->binary && e == EString::QP ) ) {
+            d->fullBody.add( uid );
+            if ( !m->hasBodies() )
+                full->append( m );
+        }
+        else if ( !s->binary && e == EString::Base64 ) {
+            if ( !base64 ) {
+                base64 = new FetchData::PartialQuery;
+                base64->base64 = true;
+            }
+            base64->uids.add( uid );
+        }
+        else {
+            if ( !plain )
+                plain = new FetchData::PartialQuery;
+            plain->uids.add( uid );
+        }
+    }
+
+    uint n = 0;
+    while ( n < 2 ) {
+        FetchData::PartialQuery * p = n ? plain : base64;
+        n++;
+        if ( !p )
+            continue;
+
+        // sectionData() encodes base64 with 70-character lines, which
+        // e64() rounds up to 72 characters (54 bytes) plus CRLF.
+        int64 start = s->offset;
+        int64 length = s->length;
+        if ( p->base64 ) {
+            int64 first = s->offset / 74;
+            int64 last = ( (int64)s->offset + s->length - 1 ) / 74;
+            start = first * 54;
+            length = ( last - first + 1 ) * 54;
+            p->skip = s->offset - first * 74;
+        }
+        if ( start > 0x7fffffff )
+            start = 0x7fffffff;
+        if ( length > 0x7fffffff - start )
+            length = 0x7fffffff - start;
+
+        p->q = new Query( "select mm.uid, "
+                          "substring(bp.data from $3 for $4) as data "
+                          "from mailbox_messages mm "
+                          "join part_numbers pn on (mm.message=pn.message) "
+                          "join bodyparts bp on (pn.bodypart=bp.id) "
+                          "where mm.mailbox=$1 and mm.uid=any($2) "
+                          "and pn.part=$5 and bp.data is not null",
+                          this );
+        p->q->bind( 1, session()->mailbox()->id() );
+        p->q->bind( 2, p->uids );
+        p->q->bind( 3, (uint)start + 1 );
+        p->q->bind( 4, (uint)length );
+        p->q->bind( 5, s->part );
+        p->q->execute();
+        d->partialQueries.append( p );
+    }
+
+    if ( !full->isEmpty() ) {
+        Fetcher * f = new Fetcher( full, this, imap() );
+        f->fetch( Fetcher::Body );
+        f->execute();
+    }
+}
+
+
 /*! Sends a query to retrieve all flags. */
 
 void Fetch::sendFlagQuery()
@@ -46,6 +46,7 @@ private:
     void sendFlagQuery();
     void sendAnnotationsQuery();
     void sendModSeqQuery();
+    void sendPartialQueries();
     EString dotLetters( uint, uint );
     EString internalDate( Message * );
     EString envelope( Message * );
@@ -2,6 +2,7 @@
 
 #include "search.h"
 
+#include "messagecolumns.h"
 #include "imapsession.h"
 #include "imapparser.h"
 #include "annotation.h"
@@ -460,19 +461,35 @@ void Search::execute()
         return;
     }
 
+    if ( !d->returnModseq ) {
+        // the selector's query returns uid as its first column
+        uint uids[256];
+        uint n = d->query->nextIntegers( uids, 256 );
+        while ( n ) {
+            uint i = 0;
+            while ( i < n )
+                d->matches.add( uids[i++] );
+            n = d->query->nextIntegers( uids, 256 );
+        }
+    }
+
     bool firstRow = true;
+    int uid = -1;
+    int modseq = -1;
     Row * r;
     while ( (r=d->query->nextRow()) != 0 ) {
-        d->matches.add( r->getInt( "uid" ) );
-        if ( d->returnModseq ) {
-            int64 ms = r->getBigint( "modseq" );
-            if ( firstRow )
-                d->firstmodseq = ms;
-            d->lastmodseq = ms;
-            firstRow = false;
-            if ( ms > d->highestmodseq )
-                d->highestmodseq = ms;
+        if ( firstRow ) {
+            uid = r->column( "uid" );
+            modseq = r->column( "modseq" );
         }
+        d->matches.add( r->getInt( uid ) );
+        int64 ms = r->getBigint( modseq );
+        if ( firstRow )
+            d->firstmodseq = ms;
+        d->lastmodseq = ms;
+        firstRow = false;
+        if ( ms > d->highestmodseq )
+            d->highestmodseq = ms;
     }
 
     sendResponse();
@@ -480,52 +497,46 @@ void Search::execute()
 }
 
 
-/*! Considers whether this search can and should be solved using this
-    cache, and if so, finds all the matches.
+/*! Considers whether this search can and should be solved using the
+    session's MessageColumns, and if so, finds all the matches.
 */
 
 void Search::considerCache()
 {
-    if ( d->returnModseq )
-        return;
     Session * s = imap()->session();
     bool needDb = false;
     if ( !s ) {
         needDb = true;
     }
-    else if ( d->root->field() == Selector::Uid &&
+    else if ( !d->returnModseq &&
+              d->root->field() == Selector::Uid &&
               d->root->action() == Selector::Contains ) {
         d->matches = s->messages().intersection( d->root->messageSet() );
         log( "UID-only search matched " +
              fn( d->matches.count() ) + " messages",
              Log::Debug );
     }
+    else if ( !d->root->evaluate( s, d->matches ) ) {
+        log( "Search must go to database: session is being updated, "
+             "or condition could not be evaluated in RAM", Log::Debug );
+        needDb = true;
+    }
     else {
-        uint max = s->count();
-         // don't consider more than 300 messages - pg does it better
-        if ( max > 300 )
-            needDb = true;
-        uint c = 0;
-        while ( c < max && !needDb ) {
-            c++;
-            uint uid = s->uid( c );
-            switch ( d->root->match( s, uid ) ) {
-            case Selector::Yes:
-                d->matches.add( uid );
-                break;
-            case Selector::No:
-                break;
-            case Selector::Punt:
-                log( "Search must go to database: message " + fn( uid ) +
-                     " could not be tested in RAM",
-                     Log::Debug );
-                needDb = true;
-                d->matches.clear();
-                break;
+        log( "Search matched " + fn( d->matches.count() ) + " of " +
+             fn( s->count() ) + " messages using cache", Log::Debug );
+        if ( d->returnModseq && !d->matches.isEmpty() ) {
+            MessageColumns * c = s->columns();
+            uint i = 1;
+            uint n = d->matches.count();
+            while ( i <= n ) {
+                int64 ms = c->modseq( d->matches.value( i ) );
+                if ( ms > d->highestmodseq )
+                    d->highestmodseq = ms;
+                i++;
             }
+            d->firstmodseq = c->modseq( d->matches.smallest() );
+            d->lastmodseq = c->modseq( d->matches.largest() );
         }
-        log( "Search considered " + fn( c ) + " of " + fn( max ) +
-             " messages using cache", Log::Debug );
     }
     if ( !needDb )
         d->done = true;
@@ -2,19 +2,75 @@
 
 #include "sort.h"
 
+#include "map.h"
+#include "dict.h"
 #include "user.h"
+#include "cache.h"
 #include "field.h"
 #include "codec.h"
+#include "query.h"
+#include "address.h"
 #include "mailbox.h"
+#include "message.h"
 #include "imapparser.h"
 #include "imapsession.h"
 
 
+class SortKeys
+    : public Garbage
+{
+public:
+    SortKeys(): Garbage(), uid( 0 ), arrival( 0 ), size( 0 ), sent( 0 ) {}
+
+    uint uid;
+    uint arrival;
+    uint size;
+    uint sent;
+    UString subject;
+    UString from;
+    UString displayFrom;
+    UString to;
+    UString displayTo;
+    UString cc;
+};
+
+
+class SortOrder
+    : public Garbage
+{
+public:
+    SortOrder(): Garbage(), uidnext( 1 ) {}
+
+    uint uidnext;
+    List<SortKeys> sorted;
+};
+
+
+class SortedMailbox
+    : public Garbage
+{
+public:
+    SortedMailbox()
+        : Garbage(), id( 0 ), uidvalidity( 0 ), uidnext( 1 ), used( true )
+    {}
+
+    uint id;
+    uint uidvalidity;
+    uint uidnext;
+    List<SortKeys> keys;
+    Dict<SortOrder> orders;
+    bool used;
+};
+
+
 class SortData
     : public Garbage
 {
 public:
-    SortData(): Garbage(), s( 0 ), q( 0 ), u( false ) {}
+    SortData()
+        : Garbage(), s( 0 ), q( 0 ), u( false ),
+          sm( 0 ), from( 0 ), to( 0 ), fresh( 0 ), legacy( 0 )
+    {}
 
     enum SortCriterionType {
         Arrival,
@@ -51,13 +107,69 @@ public:
     Query * q;
     bool u;
 
+    SortedMailbox * sm;
+    IntegerSet matches;
+    uint from;
+    uint to;
+    Query * fresh;
+    Query * legacy;
+
     bool usingCriterionType( SortCriterionType );
 
     void addCondition( EString &, class SortCriterion * );
     void addJoin( EString &, const EString &, const EString &, bool );
+
+    EString orderName() const;
+    void addKeys();
+    SortOrder * order();
+
+    class SortCache
+        : public Cache
+    {
+    public:
+        SortCache(): Cache( 1 ) {}
+
+        Map<SortedMailbox> c;
+
+        SortedMailbox * find( Mailbox * m ) {
+            SortedMailbox * sm = c.find( m->id() );
+            if ( !sm || sm->uidvalidity != m->uidvalidity() ) {
+                sm = new SortedMailbox;
+                sm->id = m->id();
+                sm->uidvalidity = m->uidvalidity();
+                c.insert( m->id(), sm );
+            }
+            sm->used = true;
+            return sm;
+        }
+
+        void clear() {
+            c.clear();
+        }
+
+        void shrink() {
+            // keep the mailboxes that have been sorted since the
+            // last time we were asked to shrink
+            IntegerSet unused;
+            Map<SortedMailbox>::Iterator i( c );
+            while ( i ) {
+                if ( !i->used )
+                    unused.add( i->id );
+                i->used = false;
+                ++i;
+            }
+            while ( !unused.isEmpty() ) {
+                c.remove( unused.smallest() );
+                unused.remove( unused.smallest() );
+            }
+        }
+    };
 };
 
 
+static SortData::SortCache * sortCache = 0;
+
+
 /*! \class Sort sort.h
 
     The Sort class implements the IMAP SORT extension, which is
@@ -172,13 +284,151 @@ void Sort::parse()
 }
 
 
-/*! This reimplementation hides Search::execute() entirely. */
+/*! This reimplementation hides Search::execute() entirely.
+
+    Unless the client sorts by annotation, Sort keeps the sort keys of
+    each mailbox it has sorted, and a sorted list of messages for each
+    combination of sort criteria, in RAM. When new messages arrive,
+    it fetches their keys (usually from sort_keys) and merges them
+    into the sorted lists, so the database only has to find the
+    messages matching the search criteria, and often not even that.
+*/
 
 void Sort::execute()
 {
     if ( state() != Executing )
         return;
 
+    if ( d->usingCriterionType( SortData::Annotation ) ) {
+        sortInDatabase();
+        return;
+    }
+
+    ImapSession * s = session();
+
+    if ( !d->sm ) {
+        if ( !::sortCache )
+            ::sortCache = new SortData::SortCache;
+        d->sm = ::sortCache->find( s->mailbox() );
+
+        d->s->simplify();
+        if ( !d->s->evaluate( s, d->matches ) ) {
+            d->q = d->s->query( imap()->user(), s->mailbox(),
+                                s, this, false );
+            d->q->execute();
+        }
+    }
+
+    if ( d->q ) {
+        uint uids[256];
+        uint n = d->q->nextIntegers( uids, 256 );
+        while ( n ) {
+            uint i = 0;
+            while ( i < n )
+                d->matches.add( uids[i++] );
+            n = d->q->nextIntegers( uids, 256 );
+        }
+        if ( !d->q->done() )
+            return;
+        if ( d->q->failed() ) {
+            error( No, "Database error: " + d->q->error() );
+            return;
+        }
+    }
+
+    if ( !d->to ) {
+        d->to = s->uidnext();
+        if ( !d->matches.isEmpty() && d->matches.largest() >= d->to )
+            d->to = d->matches.largest() + 1;
+        d->from = d->sm->uidnext;
+        if ( d->from < d->to ) {
+            d->fresh = new Query(
+                "select mm.uid, m.idate, m.rfc822size, sk.subject, "
+                "sk.from_address, sk.from_display, "
+                "sk.to_address, sk.to_display, sk.cc_address, sk.sent "
+                "from mailbox_messages mm "
+                "join messages m on (mm.message=m.id) "
+                "join sort_keys sk on (mm.message=sk.message) "
+                "where mm.mailbox=$1 and mm.uid>=$2 and mm.uid<$3",
+                this );
+            // messages injected before sort_keys existed have no
+            // row there, so we compute their keys the old way
+            d->legacy = new Query(
+                "select mm.uid, m.idate, m.rfc822size, "
+                "(select hf.value from header_fields hf"
+                " where hf.message=mm.message and hf.part=''"
+                " and hf.field=" + fn( HeaderField::Subject ) +
+                " order by hf.position limit 1) as subject, "
+                "(select extract(epoch from df.value)::integer"
+                " from date_fields df where df.message=mm.message"
+                " limit 1) as sent, "
+                "fa.name as from_name, fa.localpart as from_localpart, "
+                "fa.domain as from_domain, "
+                "ta.name as to_name, ta.localpart as to_localpart, "
+                "ta.domain as to_domain, "
+                "ca.localpart as cc_localpart "
+                "from mailbox_messages mm "
+                "join messages m on (mm.message=m.id) "
+                "left join sort_keys sk on (mm.message=sk.message) "
+                "left join address_fields faf on "
+                "(mm.message=faf.message and faf.part='' and "
+                "faf.number=0 and faf.field=" + fn( HeaderField::From ) + ") "
+                "left join addresses fa on (faf.address=fa.id) "
+                "left join address_fields taf on "
+                "(mm.message=taf.message and taf.part='' and "
+                "taf.number=0 and taf.field=" + fn( HeaderField::To ) + ") "
+                "left join addresses ta on (taf.address=ta.id) "
+                "left join address_fields caf on "
+                "(mm.message=caf.message and caf.part='' and "
+                "caf.number=0 and caf.field=" + fn( HeaderField::Cc ) + ") "
+                "left join addresses ca on (caf.address=ca.id) "
+                "where mm.mailbox=$1 and mm.uid>=$2 and mm.uid<$3 "
+                "and sk.message is null",
+                this );
+            List<Query> queries;
+            queries.append( d->fresh );
+            queries.append( d->legacy );
+            List<Query>::Iterator q( queries );
+            while ( q ) {
+                q->bind( 1, s->mailbox()->id() );
+                q->bind( 2, d->from );
+                q->bind( 3, d->to );
+                q->execute();
+                ++q;
+            }
+        }
+    }
+
+    if ( d->fresh ) {
+        if ( !d->fresh->done() || !d->legacy->done() )
+            return;
+        if ( d->fresh->failed() || d->legacy->failed() ) {
+            error( No, "Database error: " + d->fresh->error() +
+                   d->legacy->error() );
+            return;
+        }
+        d->addKeys();
+    }
+
+    List<uint> * result = new List<uint>;
+    List<SortKeys>::Iterator i( d->order()->sorted );
+    while ( i ) {
+        if ( d->matches.contains( i->uid ) )
+            result->append( &i->uid );
+        ++i;
+    }
+    waitFor( new ImapSortResponse( session(), result, d->u ) );
+    finish();
+}
+
+
+/*! Sorts using a single database query, which does both the search
+    and the sorting. This is used for sorting by annotation, since
+    Sort doesn't keep annotations in RAM.
+*/
+
+void Sort::sortInDatabase()
+{
     if ( !d->q ) {
         d->s->simplify();
         d->q = d->s->query( imap()->user(), session()->mailbox(),
@@ -216,6 +466,213 @@ void Sort::execute()
 }
 
 
+static List<SortData::SortCriterion> * criteria;
+
+
+// Compares x and y as the criteria say, and by UID if the criteria
+// consider them equal. Returns a negative number if x sorts first.
+
+static int compare( const SortKeys * x, const SortKeys * y )
+{
+    List<SortData::SortCriterion>::Iterator c( ::criteria );
+    while ( c ) {
+        int r = 0;
+        switch ( c->t ) {
+        case SortData::Arrival:
+            r = x->arrival < y->arrival ? -1 : x->arrival > y->arrival;
+            break;
+        case SortData::Cc:
+            r = x->cc.compare( y->cc );
+            break;
+        case SortData::Date:
+            {
+                uint a = x->sent ? x->sent : x->arrival;
+                uint b = y->sent ? y->sent : y->arrival;
+                r = a < b ? -1 : a > b;
+            }
+            break;
+        case SortData::DisplayFrom:
+            r = x->displayFrom.compare( y->displayFrom );
+            break;
+        case SortData::DisplayTo:
+            r = x->displayTo.compare( y->displayTo );
+            break;
+        case SortData::From:
+            r = x->from.compare( y->from );
+            break;
+        case SortData::Size:
+            r = x->size < y->size ? -1 : x->size > y->size;
+            break;
+        case SortData::Subject:
+            r = x->subject.compare( y->subject );
+            break;
+        case SortData::To:
+            r = x->to.compare( y->to );
+            break;
+        case SortData::Annotation:
+        case SortData::Unknown:
+            break;
+        }
+        if ( r )
+            return c->reverse ? -r : r;
+        ++c;
+    }
+    return x->uid < y->uid ? -1 : x->uid > y->uid;
+}
+
+
+static int compareForQsort( const void * a, const void * b )
+{
+    return compare( *(const SortKeys **)a, *(const SortKeys **)b );
+}
+
+
+static int compareByUid( const void * a, const void * b )
+{
+    uint x = (*(const SortKeys **)a)->uid;
+    uint y = (*(const SortKeys **)b)->uid;
+    return x < y ? -1 : x > y;
+}
+
+
+/*! Returns a string naming the sort criteria, e.g. "reverse size
+    arrival".
+*/
+
+EString SortData::orderName() const
+{
+    EStringList l;
+    List<SortCriterion>::Iterator i( c );
+    while ( i ) {
+        if ( i->reverse )
+            l.append( "reverse" );
+        l.append( fn( i->t ) );
+        ++i;
+    }
+    return l.join( " " );
+}
+
+
+/*! Adds the keys found by the fresh and legacy queries to the
+    mailbox's keys, unless another Sort got there first.
+*/
+
+void SortData::addKeys()
+{
+    List<SortKeys> found;
+    IntegerSet seen;
+
+    Row * r;
+    while ( (r=fresh->nextRow()) != 0 ) {
+        SortKeys * k = new SortKeys;
+        k->uid = r->getInt( "uid" );
+        k->arrival = r->getInt( "idate" );
+        if ( !r->isNull( "rfc822size" ) )
+            k->size = r->getInt( "rfc822size" );
+        if ( !r->isNull( "sent" ) )
+            k->sent = r->getInt( "sent" );
+        k->subject = r->getUString( "subject" );
+        k->from = r->getUString( "from_address" );
+        k->displayFrom = r->getUString( "from_display" );
+        k->to = r->getUString( "to_address" );
+        k->displayTo = r->getUString( "to_display" );
+        k->cc = r->getUString( "cc_address" );
+        seen.add( k->uid );
+        found.append( k );
+    }
+
+    while ( (r=legacy->nextRow()) != 0 ) {
+        SortKeys * k = new SortKeys;
+        k->uid = r->getInt( "uid" );
+        // a message may have more than one From field
+        if ( seen.contains( k->uid ) )
+            continue;
+        k->arrival = r->getInt( "idate" );
+        if ( !r->isNull( "rfc822size" ) )
+            k->size = r->getInt( "rfc822size" );
+        if ( !r->isNull( "sent" ) )
+            k->sent = r->getInt( "sent" );
+        if ( !r->isNull( "subject" ) )
+            k->subject = Message::baseSubject( r->getUString( "subject" ) );
+        if ( !r->isNull( "from_localpart" ) ) {
+            Address a( r->getUString( "from_name" ),
+                       r->getUString( "from_localpart" ),
+                       r->getUString( "from_domain" ) );
+            k->from = Message::sortKey( &a, false );
+            k->displayFrom = Message::sortKey( &a, true );
+        }
+        if ( !r->isNull( "to_localpart" ) ) {
+            Address a( r->getUString( "to_name" ),
+                       r->getUString( "to_localpart" ),
+                       r->getUString( "to_domain" ) );
+            k->to = Message::sortKey( &a, false );
+            k->displayTo = Message::sortKey( &a, true );
+        }
+        if ( !r->isNull( "cc_localpart" ) ) {
+            Address a( UString(), r->getUString( "cc_localpart" ),
+                       UString() );
+            k->cc = Message::sortKey( &a, false );
+        }
+        seen.add( k->uid );
+        found.append( k );
+    }
+
+    fresh = 0;
+    legacy = 0;
+
+    if ( sm->uidnext > from )
+        from = sm->uidnext;
+    if ( to <= from )
+        return;
+
+    List<SortKeys>::Iterator i( found.sorted( compareByUid ) );
+    while ( i ) {
+        if ( i->uid >= from )
+            sm->keys.append( i );
+        ++i;
+    }
+    sm->uidnext = to;
+}
+
+
+/*! Returns the SortOrder for this command's criteria, after merging
+    any keys it hasn't seen yet into it.
+*/
+
+SortOrder * SortData::order()
+{
+    EString name( orderName() );
+    SortOrder * o = sm->orders.find( name );
+    if ( !o ) {
+        o = new SortOrder;
+        sm->orders.insert( name, o );
+    }
+    if ( o->uidnext >= sm->uidnext )
+        return o;
+
+    List<SortKeys> added;
+    List<SortKeys>::Iterator k( sm->keys.last() );
+    while ( k && k->uid >= o->uidnext ) {
+        added.prepend( k );
+        --k;
+    }
+    o->uidnext = sm->uidnext;
+
+    ::criteria = &c;
+    List<SortKeys>::Iterator n( added.sorted( compareForQsort ) );
+    List<SortKeys>::Iterator i( o->sorted );
+    while ( n ) {
+        while ( i && compare( i, n ) < 0 )
+            ++i;
+        o->sorted.insert( i, n );
+        ++n;
+    }
+    ::criteria = 0;
+
+    return o;
+}
+
+
 void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
 {
     switch ( c->t ) {
@@ -17,6 +17,8 @@ public:
 
 private:
     class SortData * d;
+
+    void sortInDatabase();
 };
 
 
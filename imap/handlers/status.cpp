@@ -18,16 +18,16 @@ class StatusData
 public:
     StatusData() :
         messages( false ), uidnext( false ), uidvalidity( false ),
-        recent( false ), unseen( false ),
+        recent( false ), unseen( false ), size( false ),
         modseq( false ), mailboxid( false ),
         mailbox( 0 ),
-        unseenCount( 0 ), messageCount( 0 ), recentCount( 0 ),
+        counters( 0 ), recentCount( 0 ),
         cacheState( 0 )
         {}
-    bool messages, uidnext, uidvalidity, recent, unseen, modseq, mailboxid;
+    bool messages, uidnext, uidvalidity, recent, unseen, size,
+        modseq, mailboxid;
     Mailbox * mailbox;
-    Query * unseenCount;
-    Query * messageCount;
+    Query * counters;
     Query * recentCount;
     uint cacheState;
 
@@ -36,16 +36,16 @@ public:
     {
     public:
         CacheItem():
-            hasMessages( false ), hasUnseen( false ), hasRecent( false ),
-            messages( 0 ), unseen( 0 ), recent( 0 ),
+            hasCounters( false ), hasRecent( false ),
+            messages( 0 ), unseen( 0 ), recent( 0 ), size( 0 ),
             nextmodseq( 0 ), mailbox( 0 )
             {}
-        bool hasMessages;
-        bool hasUnseen;
+        bool hasCounters;
         bool hasRecent;
         uint messages;
         uint unseen;
         uint recent;
+        int64 size;
         int64 nextmodseq;
         Mailbox * mailbox;
     };
@@ -70,8 +70,7 @@ public:
             }
             if ( i->nextmodseq < m->nextModSeq() ) {
                 i->nextmodseq = m->nextModSeq();
-                i->hasMessages = false;
-                i->hasUnseen = false;
+                i->hasCounters = false;
                 i->hasRecent = false;
             }
             return i;
@@ -152,6 +151,8 @@ void Status::parse()
             d->uidvalidity = true;
         else if ( item == "unseen" )
             d->unseen = true;
+        else if ( item == "size" )
+            d->size = true;
         else if ( item == "highestmodseq" )
             d->modseq = true;
         else if ( item == "mailboxid" )
@@ -191,10 +192,8 @@ void Status::execute()
 
     // second part. see if anything has happened, and feed the cache if
     // so. make sure we feed the cache at once.
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
+    if ( d->counters || d->recentCount ) {
+        if ( d->counters && !d->counters->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
@@ -202,14 +201,16 @@ void Status::execute()
     if ( !::cache )
         ::cache = new StatusData::StatusCache;
 
-    if ( d->unseenCount ) {
-        while ( d->unseenCount->hasResults() ) {
-            Row * r = d->unseenCount->nextRow();
+    if ( d->counters ) {
+        while ( d->counters->hasResults() ) {
+            Row * r = d->counters->nextRow();
             StatusData::CacheItem * ci =
                 ::cache->find( r->getInt( "mailbox" ) );
             if ( ci ) {
-                ci->hasUnseen = true;
+                ci->hasCounters = true;
+                ci->messages = r->getInt( "messages" );
                 ci->unseen = r->getInt( "unseen" );
+                ci->size = r->getBigint( "size" );
             }
         }
     }
@@ -224,17 +225,6 @@ void Status::execute()
             }
         }
     }
-    if ( d->messageCount ) {
-        while ( d->messageCount->hasResults() ) {
-            Row * r = d->messageCount->nextRow();
-            StatusData::CacheItem * ci =
-                ::cache->find( r->getInt( "mailbox" ) );
-            if ( ci ) {
-                ci->hasMessages = true;
-                ci->messages = r->getInt( "messages" );
-            }
-        }
-    }
 
     // third part. are we processing the first command in a STATUS
     // loop? if so, see if we ought to preload the cache.
@@ -246,9 +236,9 @@ void Status::execute()
             while ( i ) {
                 StatusData::CacheItem * ci = ::cache->provide( i );
                 bool need = false;
-                if ( d->unseen || d->recent || d->messages )
+                if ( d->unseen || d->recent || d->messages || d->size )
                     need = true;
-                if ( ci->hasUnseen || ci->hasRecent || ci->hasMessages )
+                if ( ci->hasCounters || ci->hasRecent )
                     need = false;
                 if ( need )
                     mailboxes.add( i->id() );
@@ -259,14 +249,13 @@ void Status::execute()
         }
         if ( d->cacheState == 1 ) {
             // state 1: send queries
-            if ( d->unseen ) {
-                d->unseenCount
-                    = new Query( "select mailbox, count(uid)::int as unseen "
-                                 "from mailbox_messages "
-                                 "where mailbox=any($1) and not seen "
-                                 "group by mailbox", this );
-                d->unseenCount->bind( 1, mailboxes );
-                d->unseenCount->execute();
+            if ( d->unseen || d->messages || d->size ) {
+                d->counters
+                    = new Query( "select mailbox, messages, unseen, size "
+                                 "from mailbox_counters "
+                                 "where mailbox=any($1)", this );
+                d->counters->bind( 1, mailboxes );
+                d->counters->execute();
             }
             if ( d->recent ) {
                 d->recentCount
@@ -276,14 +265,6 @@ void Status::execute()
                 d->recentCount->bind( 1, mailboxes );
                 d->recentCount->execute();
             }
-            if ( d->messages ) {
-                d->messageCount
-                    = new Query( "select count(*)::int as messages, mailbox "
-                                 "from mailbox_messages where mailbox=any($1) "
-                                 "group by mailbox", this );
-                d->messageCount->bind( 1, mailboxes );
-                d->messageCount->execute();
-            }
             d->cacheState = 2;
         }
         if ( d->cacheState == 2 ) {
@@ -292,19 +273,16 @@ void Status::execute()
             List<Mailbox>::Iterator i( mailboxGroup()->contents() );
             while ( i ) {
                 StatusData::CacheItem * ci = ::cache->find( i->id() );
-                if ( ci && d->unseenCount )
-                    ci->hasUnseen = true;
+                if ( ci && d->counters )
+                    ci->hasCounters = true;
                 if ( ci && d->recentCount )
                     ci->hasRecent = true;
-                if ( ci && d->messageCount )
-                    ci->hasMessages = true;
                 ++i;
             }
             // and drop the queries
             d->cacheState = 3;
-            d->unseenCount = 0;
+            d->counters = 0;
             d->recentCount = 0;
-            d->messageCount = 0;
         }
     }
 
@@ -312,14 +290,14 @@ void Status::execute()
     StatusData::CacheItem * i = ::cache->provide( d->mailbox );
 
     // fourth part: send individual queries if there's anything we need
-    if ( d->unseen && !d->unseenCount && !i->hasUnseen ) {
-        d->unseenCount
-            = new Query( "select $1::int as mailbox, "
-                         "count(uid)::int as unseen "
-                         "from mailbox_messages "
-                         "where mailbox=$1 and not seen", this );
-        d->unseenCount->bind( 1, d->mailbox->id() );
-        d->unseenCount->execute();
+    bool messages = d->messages && d->mailbox != current;
+    if ( ( d->unseen || d->size || messages ) &&
+         !d->counters && !i->hasCounters ) {
+        d->counters
+            = new Query( "select mailbox, messages, unseen, size "
+                         "from mailbox_counters where mailbox=$1", this );
+        d->counters->bind( 1, d->mailbox->id() );
+        d->counters->execute();
     }
 
     if ( !d->recent ) {
@@ -340,28 +318,8 @@ void Status::execute()
         d->recentCount->execute();
     }
 
-    if ( !d->messages ) {
-        // we don't need to collect
-    }
-    else if ( d->mailbox == current ) {
-        // we'll pick it up
-    }
-    else if ( i->hasMessages ) {
-        // the cache has it
-    }
-    else if ( d->messages && !d->messageCount ) {
-        d->messageCount
-            = new Query( "select count(*)::int as messages, "
-                         "$1::int as mailbox "
-                         "from mailbox_messages where mailbox=$1", this );
-        d->messageCount->bind( 1, d->mailbox->id() );
-        d->messageCount->execute();
-    }
-
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
+    if ( d->counters || d->recentCount ) {
+        if ( d->counters && !d->counters->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
@@ -370,10 +328,10 @@ void Status::execute()
     // fifth part: return the payload.
     EStringList status;
 
-    if ( d->messages && i->hasMessages )
-        status.append( "MESSAGES " + fn( i->messages ) );
-    else if ( d->messages && d->mailbox == current )
+    if ( d->messages && d->mailbox == current )
         status.append( "MESSAGES " + fn( session->messages().count() ) );
+    else if ( d->messages && i->hasCounters )
+        status.append( "MESSAGES " + fn( i->messages ) );
 
     if ( d->recent && i->hasRecent )
         status.append( "RECENT " + fn( i->recent ) );
@@ -386,9 +344,12 @@ void Status::execute()
     if ( d->uidvalidity )
         status.append( "UIDVALIDITY " + fn( d->mailbox->uidvalidity() ) );
 
-    if ( d->unseen && i->hasUnseen )
+    if ( d->unseen && i->hasCounters )
         status.append( "UNSEEN " + fn( i->unseen ) );
 
+    if ( d->size && i->hasCounters )
+        status.append( "SIZE " + fn( i->size ) );
+
     if ( d->modseq ) {
         int64 hms = d->mailbox->nextModSeq();
         // don't like this. an empty mailbox will have a STATUS HMS of
@@ -9,6 +9,7 @@
 #include "imapsession.h"
 #include "annotation.h"
 #include "integerset.h"
+#include "allocator.h"
 #include "selector.h"
 #include "mailbox.h"
 #include "message.h"
@@ -22,6 +23,9 @@
 #include "user.h"
 #include "map.h"
 
+// time
+#include <time.h>
+
 
 class StoreData
     : public Garbage
@@ -29,18 +33,18 @@ class StoreData
 public:
     StoreData()
         : op( ReplaceFlags ), silent( false ), uid( false ),
-          checkedPermission( false ),
+          checkedPermission( false ), exclusive( false ),
           seen( false ), deleted( false ),
           unchangedSince( 0 ), seenUnchangedSince( false ),
           sentWorkQueries( false ),
           modseq( 0 ),
-          modSeqQuery( 0 ), obtainModSeq( 0 ), findSet( 0 ),
+          modSeqQuery( 0 ), batch( 0 ), findSet( 0 ),
           presentFlags( 0 ), present( 0 ),
           flagCreator( 0 ),
           annotationNameCreator( 0 ), session( 0 ),
           changeSeen( false ), changeDeleted( false ),
           newSeen( false ), newDeleted( false ),
-          sentNextModSeq( false ), modseqUpdate( 0 )
+          left( false ), modseqUpdate( 0 )
     {}
     IntegerSet specified;
     IntegerSet s;
@@ -53,6 +57,7 @@ public:
     bool silent;
     bool uid;
     bool checkedPermission;
+    bool exclusive;
     bool seen;
     bool deleted;
 
@@ -61,7 +66,7 @@ public:
     bool sentWorkQueries;
     int64 modseq;
     Query * modSeqQuery;
-    Query * obtainModSeq;
+    class StoreBatch * batch;
     Query * findSet;
     Query * presentFlags;
     Map<IntegerSet> * present;
@@ -77,11 +82,205 @@ public:
     bool newDeleted;
     IntegerSet changedUids;
 
-    bool sentNextModSeq;
+    bool left;
     Query * modseqUpdate;
 };
 
 
+static List<StoreBatch> * batches = 0;
+
+
+// The StoreBatch class lets concurrent STORE commands from the same
+// session share one transaction and one modseq. The first Store to
+// execute creates the batch; others join it as long as it's open.
+// When the last member is done with its flag work, the batch consumes
+// the modseq, refreshes the mailboxes and commits once for all of
+// them.
+
+class StoreBatch
+    : public EventHandler
+{
+public:
+    StoreBatch( Store *, ImapSession *, Transaction *, bool );
+
+    static StoreBatch * join( Store *, ImapSession *, Transaction *, bool );
+
+    void execute();
+    int64 modseq();
+    void leave( bool, bool );
+
+    ImapSession * session;
+    Transaction * t;
+    Query * obtainModSeq;
+    int64 ms;
+    List<Store> members;
+    uint working;
+    uint started;
+    bool exclusive;
+    bool updated;
+    bool silent;
+    bool closed;
+    bool broken;
+};
+
+
+// Creates a batch for the Store s in the session is, using
+// transaction if that's non-null and a new Transaction if not. If x
+// is true, the batch is exclusive and no other Store may join it.
+
+StoreBatch::StoreBatch( Store * s, ImapSession * is,
+                        Transaction * transaction, bool x )
+    : EventHandler(),
+      session( is ), t( transaction ), obtainModSeq( 0 ), ms( 0 ),
+      working( 0 ), started( (uint)::time( 0 ) ), exclusive( x ),
+      updated( false ), silent( true ), closed( false ), broken( false )
+{
+    setLog( s->log() );
+    if ( !t )
+        t = new Transaction( this );
+    obtainModSeq = new Query( "select nextmodseq from mailboxes "
+                              "where id=$1 for update", this );
+    obtainModSeq->bind( 1, session->mailbox()->id() );
+    t->enqueue( obtainModSeq );
+
+    if ( x )
+        return;
+    if ( !batches ) {
+        batches = new List<StoreBatch>;
+        Allocator::addEternal( batches, "open store batches" );
+    }
+    batches->append( this );
+}
+
+
+// Returns an open batch for s to join, creating one if necessary.
+// The arguments are as for the constructor. A Store that brings its
+// own transaction always gets an exclusive batch.
+//
+// The batch holds the lock on its mailboxes row until its last member
+// leaves, so a batch stops taking new members once it's a couple of
+// seconds old or has 32 members. Later STOREs start a new batch.
+// Batches that can't take new members are dropped from the list
+// here, including ones whose members were errored from outside
+// (e.g. when the client closed the connection) and never left.
+
+StoreBatch * StoreBatch::join( Store * s, ImapSession * session,
+                               Transaction * transaction, bool exclusive )
+{
+    StoreBatch * b = 0;
+    if ( !transaction && !exclusive && batches ) {
+        uint now = (uint)::time( 0 );
+        List<StoreBatch>::Iterator i( batches );
+        while ( i && !b ) {
+            if ( i->closed || i->t->done() ||
+                 i->members.count() >= 32 ||
+                 i->started + 2 <= now )
+                batches->take( i );
+            else if ( i->session != session )
+                ++i;
+            else
+                b = i;
+        }
+    }
+    if ( !b )
+        b = new StoreBatch( s, session, transaction,
+                            exclusive || transaction );
+    else
+        s->log( "Joining the STORE batch started by " + b->log()->id(),
+                Log::Debug );
+    b->members.append( s );
+    b->working++;
+    return b;
+}
+
+
+// Returns the modseq shared by all members, or 0 if it isn't known
+// (yet).
+
+int64 StoreBatch::modseq()
+{
+    if ( !ms && obtainModSeq->hasResults() )
+        ms = obtainModSeq->nextRow()->getBigint( "nextmodseq" );
+    return ms;
+}
+
+
+// Records that a member has finished its work. u is true if that
+// member updated any mailbox_messages rows, s if it was silent. When
+// the last member leaves, the batch is closed and committed, or
+// rolled back if the transaction failed or a member marked the batch
+// as broken. If it was already rolled back, there's nothing to do.
+
+void StoreBatch::leave( bool u, bool s )
+{
+    if ( u ) {
+        updated = true;
+        if ( !s )
+            silent = false;
+    }
+    working--;
+    if ( working )
+        return;
+
+    closed = true;
+    if ( batches )
+        batches->remove( this );
+    if ( t->failed() || broken ) {
+        t->rollback();
+        return;
+    }
+    if ( t->done() )
+        return;
+
+    if ( updated ) {
+        Query * q = new Query( "update mailboxes set nextmodseq=$1 "
+                               "where id=$2", 0 );
+        q->bind( 1, ms + 1 );
+        q->bind( 2, session->mailbox()->id() );
+        t->enqueue( q );
+
+        if ( silent )
+            session->ignoreModSeq( ms );
+        IntegerSet ids;
+        ids.add( session->mailbox()->id() );
+        Mailbox::refreshMailboxes( t, ids );
+    }
+    t->commit();
+}
+
+
+void StoreBatch::execute()
+{
+    if ( !t->done() )
+        return;
+
+    // if a member's error() rolled the transaction back, nobody can
+    // join us any more.
+    closed = true;
+    if ( batches )
+        batches->remove( this );
+
+    List<Store>::Iterator i( members );
+    while ( i ) {
+        Store * s = i;
+        ++i;
+        s->notify();
+    }
+}
+
+
+// Tells the batch that the Store with data d is done with its work,
+// unless it did that already.
+
+static void leave( StoreData * d, bool updated )
+{
+    if ( d->left )
+        return;
+    d->left = true;
+    d->batch->leave( updated, d->silent );
+}
+
+
 /*! \class Store store.h
 
     Alters message flags (RFC 3501 section 6.4.6) or annotations (RFC
@@ -97,6 +296,12 @@ public:
     order, and the x flag on message 1 may have any value afterwards.
     Generally, the second command's finished last, because of how the
     database does locking.
+
+    Concurrent STORE commands in the same session share a single
+    transaction and a single modseq, so that a client which pipelines
+    many small STOREs causes one modseq bump and one mailbox update
+    instead of one per command. A STORE with UNCHANGEDSINCE always
+    runs on its own, and so does the implicit STORE used by Fetch.
 */
 
 /*! Constructs a Store handler. If \a u is set, the first argument is
@@ -130,6 +335,7 @@ Store::Store( IMAP * imap, const IntegerSet & set, bool silent,
     log( "Store \\seen on " + set.set() );
     d->uid = true;
     d->op = StoreData::AddFlags;
+    d->exclusive = true;
     setGroup( 0 );
     d->specified = set;
     d->silent = silent;
@@ -315,7 +521,8 @@ void Store::parseAnnotationEntry()
 
 /*! Stores all the annotations/flags, using potentially enormous
     numbers of database queries. The command is kept atomic by the use
-    of a Transaction.
+    of a Transaction, which it may share with other concurrent Store
+    commands.
 */
 
 void Store::execute()
@@ -370,15 +577,11 @@ void Store::execute()
     if ( !ok() || !permitted() )
         return;
 
-    if ( !d->obtainModSeq ) {
-        if ( !transaction() )
-            setTransaction( new Transaction( this ) );
-
-        d->obtainModSeq
-            = new Query( "select nextmodseq from mailboxes "
-                         "where id=$1 for update", this );
-        d->obtainModSeq->bind( 1, m->id() );
-        transaction()->enqueue( d->obtainModSeq );
+    if ( !d->batch ) {
+        d->batch = StoreBatch::join( this, d->session, transaction(),
+                                     d->exclusive ||
+                                     d->seenUnchangedSince );
+        setTransaction( d->batch->t );
 
         Selector * work = new Selector;
         work->add( new Selector( d->specified ) );
@@ -425,6 +628,17 @@ void Store::execute()
         transaction()->execute();
     }
 
+    if ( transaction()->failed() ||
+         ( !d->left && transaction()->done() ) ) {
+        // the transaction failed, or another member's error() rolled
+        // it back. the batch rolls back when its last member leaves,
+        // so error() mustn't do it now.
+        leave( d, false );
+        setTransaction( 0 );
+        error( No, "Database error. Rolling transaction back" );
+        return;
+    }
+
     while ( d->findSet->hasResults() )
         d->s.add( d->findSet->nextRow()->getInt( "uid" ) );
 
@@ -467,7 +681,10 @@ void Store::execute()
         }
 
         if ( d->s.isEmpty() ) {
-            transaction()->commit();
+            leave( d, false );
+            // the transaction isn't ours alone, so error() mustn't
+            // roll it back.
+            setTransaction( 0 );
             if ( !d->silent && !d->expunged.isEmpty() )
                 error( No, "Cannot store on expunged messages" );
             finish();
@@ -496,7 +713,7 @@ void Store::execute()
 
         if ( !work && !d->changeSeen && !d->changeDeleted ) {
             // there's no actual work to be done.
-            transaction()->commit();
+            leave( d, false );
             finish();
             return;
         }
@@ -504,16 +721,18 @@ void Store::execute()
         transaction()->execute();
     }
 
-    if ( !d->obtainModSeq->done() )
+    if ( !d->batch->obtainModSeq->done() )
         return;
 
     if ( !d->modseq ) {
-        Row * r = d->obtainModSeq->nextRow();
-        if ( !r ) {
+        d->modseq = d->batch->modseq();
+        if ( !d->modseq ) {
+            d->batch->broken = true;
+            leave( d, false );
+            setTransaction( 0 );
             error( No, "Could not obtain modseq" );
             return;
         }
-        d->modseq = r->getBigint( "nextmodseq" );
 
         d->modseqUpdate = new Query( "", this );
         d->modseqUpdate->bind( 1, d->modseq );
@@ -585,31 +804,22 @@ void Store::execute()
     if ( !d->modseqUpdate->done() )
         return;
 
-    if ( !d->sentNextModSeq ) {
+    if ( !d->left ) {
+        // if we updated zero mailbox_messages rows, we don't need
+        // the batch to consume its modseq, and we don't need to wait
+        // for its commit either.
         if ( !d->modseqUpdate->rows() ) {
-            // we updated zero mailbox_messages rows, so we also
-            // should not consume a modseq.
-            transaction()->commit();
+            leave( d, false );
             finish();
             return;
         }
-        d->sentNextModSeq = true;
-
-        Query * q = new Query( "update mailboxes set nextmodseq=$1 "
-                               "where id=$2", 0 );
-        q->bind( 1, d->modseq + 1 );
-        q->bind( 2, m->id() );
-        transaction()->enqueue( q );
-
-        if ( d->silent )
-            d->session->ignoreModSeq( d->modseq );
-        Mailbox::refreshMailboxes( transaction() );
-        transaction()->commit();
+        leave( d, true );
     }
 
     if ( !transaction()->done() )
         return;
-    if ( transaction()->failed() ) {
+    if ( transaction()->failed() || d->batch->broken ) {
+        setTransaction( 0 );
         error( No, "Database error. Rolling transaction back" );
         finish();
         return;
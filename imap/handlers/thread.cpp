@@ -12,6 +12,12 @@
 #include "dict.h"
 #include "list.h"
 #include "map.h"
+#include "cache.h"
+#include "mailbox.h"
+
+
+class ThreadNode;
+class ThreadedMailbox;
 
 
 class ThreadData
@@ -20,7 +26,7 @@ class ThreadData
 public:
     ThreadData(): Garbage(), uid( true ), s( 0 ),
                   session( 0 ),
-                  find( 0 ) {}
+                  find( 0 ), fresh( 0 ), tm( 0 ), from( 0 ), to( 0 ) {}
 
     bool uid;
     enum Algorithm { OrderedSubject, Refs, References };
@@ -29,6 +35,12 @@ public:
 
     ImapSession * session;
     Query * find;
+    Query * fresh;
+
+    ThreadedMailbox * tm;
+    IntegerSet matches;
+    uint from;
+    uint to;
 
     class Node
         : public Garbage
@@ -38,44 +50,124 @@ public:
             : Garbage(),
               uid( 0 ), threadRoot( 0 ),
               idate( 0 ),
-              reported( false ), added( false ),
               parent( 0 ) {}
 
         uint uid;
         uint threadRoot;
         UString subject;
         uint idate;
-        EString references;
-        EString messageId;
-
-        bool reported;
-        bool added;
 
         class Node * parent;
         List<Node> children;
-
-        Node * root() {
-            Node * r = this;
-            while ( r->parent )
-                r = r->parent;
-            return r;
-        }
     };
 
-    Dict<Node> nodes;
+    List<Node> nodes;
+    Dict<Node> ids;
     List<Node> roots;
 
-    List<Node> result;
+    void addMessages();
+    void add( ThreadNode * );
+    Node * node( const EString & );
 
     void splice( List<Node> * );
     void append( EString &, List<Node> *, bool );
+
+    class ThreadCache;
+};
+
+
+// The parts of a message THREAD needs.
+
+class ThreadNode
+    : public Garbage
+{
+public:
+    ThreadNode()
+        : Garbage(),
+          uid( 0 ), threadRoot( 0 ), idate( 0 ) {}
+
+    uint uid;
+    uint threadRoot;
+    uint idate;
+    UString subject;
+    EString messageId;
+    EString references;
+};
+
+
+class ThreadedMailbox
+    : public Garbage
+{
+public:
+    ThreadedMailbox()
+        : Garbage(), id( 0 ), uidvalidity( 0 ), uidnext( 1 ), used( true )
+    {}
+
+    uint id;
+    uint uidvalidity;
+    uint uidnext;
+    List<ThreadNode> messages;
+    bool used;
+};
+
+
+class ThreadData::ThreadCache
+    : public Cache
+{
+public:
+    ThreadCache(): Cache( 1 ) {}
+
+    Map<ThreadedMailbox> c;
+
+    ThreadedMailbox * find( Mailbox * m ) {
+        ThreadedMailbox * tm = c.find( m->id() );
+        if ( !tm || tm->uidvalidity != m->uidvalidity() ) {
+            tm = new ThreadedMailbox;
+            tm->id = m->id();
+            tm->uidvalidity = m->uidvalidity();
+            c.insert( m->id(), tm );
+        }
+        tm->used = true;
+        return tm;
+    }
+
+    void clear() {
+        c.clear();
+    }
+
+    void shrink() {
+        // keep the mailboxes that have been threaded since the
+        // last time we were asked to shrink
+        IntegerSet unused;
+        Map<ThreadedMailbox>::Iterator i( c );
+        while ( i ) {
+            if ( !i->used )
+                unused.add( i->id );
+            i->used = false;
+            ++i;
+        }
+        while ( !unused.isEmpty() ) {
+            c.remove( unused.smallest() );
+            unused.remove( unused.smallest() );
+        }
+    }
 };
 
 
+static ThreadData::ThreadCache * threadCache = 0;
+
+
 /*! \class Thread thread.h
 
     The Thread class implements the IMAP THREAD command, specified in
     RFC 5256 section BASE.6.4.THREAD.
+
+    Thread keeps the Message-Id, References, base subject and
+    internaldate of each message in the mailboxes it has threaded in
+    RAM. When new messages arrive, only those are fetched, so the
+    database is only asked for the new messages and for the messages
+    matching the search. The threads are built from the matching
+    messages alone, as RFC 5256 requires.
 */
 
 
@@ -136,74 +228,97 @@ void Thread::execute()
     if ( state() != Executing )
         return;
 
-    if ( !d->session )
+    if ( !d->session ) {
         d->session = session();
 
-    if ( !d->find ) {
-        EStringList * want = new EStringList;
-        want->append( "uid" );
-        want->append( "message" );
-        want->append( "m.idate" );
-        want->append( "m.thread_root" );
-        want->append( "tmid.value as messageid" );
-        want->append( "tref.value as references" );
-        EString ts;
-        if ( d->threadAlg == ThreadData::References ) {
-            want->append( "tsubj.value as subject" );
-            ts = "left join header_fields tsubj on"
-                 " (m.id=tsubj.message and"
-                 " tsubj.field=" + fn( HeaderField::Subject ) +
-                 " and tsubj.part='') ";
+        if ( !::threadCache )
+            ::threadCache = new ThreadData::ThreadCache;
+        d->tm = ::threadCache->find( d->session->mailbox() );
+
+        if ( !d->s->evaluate( d->session, d->matches ) ) {
+            d->find = d->s->query( imap()->user(),
+                                   d->session->mailbox(), d->session,
+                                   this, false );
+            d->find->execute();
         }
+    }
 
-        d->find = d->s->query( imap()->user(),
-                               d->session->mailbox(), d->session,
-                               this, false, want );
-        EString j = d->find->string();
-
-        // we need to get the References and Message-Id fields as well
-        const char * x = "left join";
-        if ( !j.contains( x ) )
-            x = "where";
-        j.replace( x,
-                   "left join header_fields tref on"
-                   " (m.id=tref.message and"
-                   " tref.field=" + fn( HeaderField::References ) +
-                   " and tref.part='') "
-                   "left join header_fields tmid on"
-                   " (m.id=tmid.message and"
-                   " tmid.field=" + fn( HeaderField::MessageId ) +
-                   " and tmid.part='') " + ts + x );
-
-        d->find->setString( j );
-
-        d->find->execute();
-        return;
+    if ( d->find ) {
+        uint uids[256];
+        uint n = d->find->nextIntegers( uids, 256 );
+        while ( n ) {
+            uint i = 0;
+            while ( i < n )
+                d->matches.add( uids[i++] );
+            n = d->find->nextIntegers( uids, 256 );
+        }
+        if ( !d->find->done() )
+            return;
+        if ( d->find->failed() ) {
+            error( No, "Database error: " + d->find->error() );
+            return;
+        }
     }
 
-    while ( d->find->hasResults() ) {
-        Row * r = d->find->nextRow();
-        ThreadData::Node * n = new ThreadData::Node;
-        n->uid = r->getInt( "uid" );
-        n->idate = r->getInt( "idate" );
-        if ( !r->isNull( "thread_root" ) )
-            n->threadRoot = r->getInt( "thread_root" );
-        if ( !r->isNull( "references" ) )
-            n->references = r->getEString( "references" );
-        if ( !r->isNull( "messageid" ) )
-            n->messageId = r->getEString( "messageid" );
-        if ( !r->isNull( "subject" ) )
-            n->subject = Message::baseSubject( r->getUString( "subject" ) );
+    if ( !d->to ) {
+        d->to = d->session->uidnext();
+        if ( !d->matches.isEmpty() && d->matches.largest() >= d->to )
+            d->to = d->matches.largest() + 1;
+        d->from = d->tm->uidnext;
+        if ( d->from < d->to ) {
+            // the base subject is in sort_keys, except for messages
+            // injected before sort_keys existed.
+            d->fresh = new Query(
+                "select mm.uid, m.idate, m.thread_root, "
+                "sk.subject as basesubject, "
+                "case when sk.message is null then "
+                "(select hf.value from header_fields hf"
+                " where hf.message=mm.message and hf.part=''"
+                " and hf.field=" + fn( HeaderField::Subject ) +
+                " order by hf.position limit 1) end as subject, "
+                "tmid.value as messageid, tref.value as references "
+                "from mailbox_messages mm "
+                "join messages m on (mm.message=m.id) "
+                "left join sort_keys sk on (mm.message=sk.message) "
+                "left join header_fields tref on"
+                " (m.id=tref.message and"
+                " tref.field=" + fn( HeaderField::References ) +
+                " and tref.part='') "
+                "left join header_fields tmid on"
+                " (m.id=tmid.message and"
+                " tmid.field=" + fn( HeaderField::MessageId ) +
+                " and tmid.part='') "
+                "where mm.mailbox=$1 and mm.uid>=$2 and mm.uid<$3 "
+                "order by mm.uid",
+                this );
+            d->fresh->bind( 1, d->session->mailbox()->id() );
+            d->fresh->bind( 2, d->from );
+            d->fresh->bind( 3, d->to );
+            d->fresh->execute();
+        }
+    }
 
-        d->result.append( n );
-        if ( !n->messageId.isEmpty() )
-            d->nodes.insert( n->messageId, n );
+    if ( d->fresh ) {
+        if ( !d->fresh->done() )
+            return;
+        if ( d->fresh->failed() ) {
+            error( No, "Database error: " + d->fresh->error() );
+            return;
+        }
+        d->addMessages();
     }
 
-    if ( !d->find->done() )
-        return;
+    // build the forest of matching messages. messages they refer to
+    // that don't match become dummies, which ThreadResponse splices
+    // away.
+    List<ThreadNode>::Iterator m( d->tm->messages );
+    while ( m ) {
+        if ( d->matches.contains( m->uid ) )
+            d->add( m );
+        ++m;
+    }
 
-    List<ThreadData::Node>::Iterator ri( d->result );
+    List<ThreadData::Node>::Iterator ri( d->nodes );
     if ( d->threadAlg == ThreadData::OrderedSubject ) {
         UDict<ThreadData::Node> roots;
         while ( ri ) {
@@ -218,50 +333,13 @@ void Thread::execute()
         }
     }
     else {
-        while ( ri ) {
-            ThreadData::Node * n = ri;
-            ++ri;
-
-            EStringList l;
-            int lt = 0;
-            while ( lt >= 0 ) {
-                lt = n->references.find( '<', lt );
-                if ( lt >= 0 ) {
-                    int gt = n->references.find( '>', lt );
-                    if ( gt > 0 )
-                        l.append( n->references.mid( lt, gt + 1 - lt ) );
-                    lt = gt;
-                }
-            }
-            l.append( n->messageId );
-
-            EStringList::Iterator s( l );
-            ThreadData::Node * parent = 0;
-            while ( s ) {
-                if ( !s->isEmpty() ) {
-                    ThreadData::Node * n = d->nodes.find( *s );
-                    if ( !n ) {
-                        n = new ThreadData::Node;
-                        n->messageId = *s;
-                        n->threadRoot = n->threadRoot;
-                        d->nodes.insert( *s, n );
-                    }
-                    if ( parent && !n->parent && parent->root() != n )
-                        n->parent = parent;
-                    parent = n;
-                }
-                ++s;
-            };
-        }
-
         // merge big threads where the start has been deleted, or
         // isn't part of the search expression.
-        Dict<ThreadData::Node>::Iterator i( d->nodes );
         Map<ThreadData::Node> roots;
-        while ( i ) {
-            ThreadData::Node * n = i;
-            ++i;
-            if ( !n->parent ) {
+        while ( ri ) {
+            ThreadData::Node * n = ri;
+            ++ri;
+            if ( !n->parent && n->threadRoot ) {
                 ThreadData::Node * found = roots.find( n->threadRoot );
                 if ( !found )
                     roots.insert( n->threadRoot, n );
@@ -272,10 +350,10 @@ void Thread::execute()
 
         // if thread=references is used, we need to jump through extra hoops
         if ( d->threadAlg == ThreadData::References ) {
-            Dict<ThreadData::Node>::Iterator i( d->nodes );
+            List<ThreadData::Node>::Iterator i( d->nodes );
             UDict<ThreadData::Node> subjects;
             while ( i ) {
-                if ( !i->parent ) {
+                if ( !i->parent && !i->subject.isEmpty() ) {
                     ThreadData::Node * potential = subjects.find( i->subject );
                     if ( potential )
                         i->parent = potential;
@@ -288,26 +366,20 @@ void Thread::execute()
     }
 
     // set up child lists and the root list
-    Dict<ThreadData::Node>::Iterator i( d->nodes );
+    List<ThreadData::Node>::Iterator i( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
-        while ( n ) {
-            if ( !n->added ) {
-                n->added = true;
-                if ( n->parent )
-                    n->parent->children.append( n );
-                else
-                    d->roots.append( n );
-            }
-            n = n->parent;
-        }
+        if ( n->parent )
+            n->parent->children.append( n );
+        else
+            d->roots.append( n );
     }
 
     // we need to sort root nodes (and children) by idate, so we
     // extend the definition until sorting works: a non-message's
     // idate is the oldest idate of a direct descendant.
-    i = Dict<ThreadData::Node>::Iterator( d->nodes );
+    i = List<ThreadData::Node>::Iterator( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
@@ -327,6 +399,129 @@ void Thread::execute()
 }
 
 
+/*! Adds the messages found by the fresh query to the mailbox's
+    cache, unless another Thread got there first.
+*/
+
+void ThreadData::addMessages()
+{
+    if ( tm->uidnext > from )
+        from = tm->uidnext;
+
+    uint last = 0;
+    Row * r;
+    while ( (r=fresh->nextRow()) != 0 ) {
+        uint uid = r->getInt( "uid" );
+        // there may be more than one Message-Id or References field
+        if ( uid < from || uid >= to || uid == last )
+            continue;
+        last = uid;
+
+        ThreadNode * n = new ThreadNode;
+        n->uid = uid;
+        n->idate = r->getInt( "idate" );
+        if ( !r->isNull( "thread_root" ) )
+            n->threadRoot = r->getInt( "thread_root" );
+        if ( !r->isNull( "basesubject" ) )
+            n->subject = r->getUString( "basesubject" );
+        else if ( !r->isNull( "subject" ) )
+            n->subject = Message::baseSubject( r->getUString( "subject" ) );
+        if ( !r->isNull( "messageid" ) )
+            n->messageId = r->getEString( "messageid" );
+        if ( !r->isNull( "references" ) )
+            n->references = r->getEString( "references" );
+        tm->messages.append( n );
+    }
+
+    fresh = 0;
+    if ( to > tm->uidnext )
+        tm->uidnext = to;
+}
+
+
+/*! Returns the node for the message-id \a id, creating a dummy if
+    necessary.
+*/
+
+ThreadData::Node * ThreadData::node( const EString & id )
+{
+    Node * n = ids.find( id );
+    if ( !n ) {
+        n = new Node;
+        nodes.append( n );
+        ids.insert( id, n );
+    }
+    return n;
+}
+
+
+// Returns true if a is n or one of n's ancestors.
+
+static bool isAncestor( ThreadData::Node * a, ThreadData::Node * n )
+{
+    while ( n && n != a )
+        n = n->parent;
+    return n == a;
+}
+
+
+/*! Adds the matching message \a m to the forest, and links it to its
+    parent using the message-ids in its References field, creating
+    dummies for the ones we haven't seen. The first link found for
+    any message is kept.
+*/
+
+void ThreadData::add( ThreadNode * m )
+{
+    // a message we've seen referred to becomes a real message, but a
+    // second message with the same Message-Id doesn't replace the
+    // first.
+    Node * n = 0;
+    if ( !m->messageId.isEmpty() ) {
+        n = node( m->messageId );
+        if ( n->uid )
+            n = 0;
+    }
+    if ( !n ) {
+        n = new Node;
+        nodes.append( n );
+    }
+    n->uid = m->uid;
+    n->idate = m->idate;
+    n->threadRoot = m->threadRoot;
+    n->subject = m->subject;
+
+    if ( threadAlg == OrderedSubject )
+        return;
+
+    EStringList l;
+    int lt = 0;
+    while ( lt >= 0 ) {
+        lt = m->references.find( '<', lt );
+        if ( lt >= 0 ) {
+            int gt = m->references.find( '>', lt );
+            if ( gt > 0 )
+                l.append( m->references.mid( lt, gt + 1 - lt ) );
+            lt = gt;
+        }
+    }
+
+    Node * parent = 0;
+    EStringList::Iterator i( l );
+    while ( i ) {
+        if ( !i->isEmpty() && *i != m->messageId ) {
+            Node * r = node( *i );
+            if ( parent && !r->parent && !isAncestor( r, parent ) )
+                r->parent = parent;
+            parent = r;
+        }
+        ++i;
+    }
+    if ( parent && !n->parent && !isAncestor( n, parent ) )
+        n->parent = parent;
+}
+
+
 /*! \class ThreadResponse thread.h
 
     The Thread class formats the IMAP THREAD response, as specified in
@@ -294,12 +294,22 @@ void IMAP::parse()
             }
         }
         else if ( d->readingLiteral ) {
-            // Have we finished reading a complete literal?
-            if ( r->size() < d->literalSize )
+            // We move the literal out of the read buffer as it
+            // arrives, so that a large APPEND isn't held in the
+            // buffer and then copied in one piece.
+            uint n = r->size();
+            if ( n > d->literalSize )
+                n = d->literalSize;
+            if ( !n && d->literalSize )
+                return;
+            if ( n ) {
+                d->str.reserve( d->str.length() + d->literalSize );
+                d->str.append( r->slice( n ) );
+                r->remove( n );
+                d->literalSize -= n;
+            }
+            if ( d->literalSize )
                 return;
-
-            d->str.append( r->string( d->literalSize ) );
-            r->remove( d->literalSize );
             d->readingLiteral = false;
         }
         else if ( d->reader ) {
@@ -382,7 +392,8 @@ void IMAP::addCommand()
     d->nextOkTime = time( 0 ) + 117;
 
     Scope x( cmd->log() );
-    if ( name.lower() != "login" && name.lower() != "authenticate" )
+    if ( Log::enabled( Log::Debug ) &&
+         name.lower() != "login" && name.lower() != "authenticate" )
         ::log( "First line: " + p->firstLine(), Log::Debug );
 }
 
@@ -527,8 +538,9 @@ void IMAP::runCommands()
 
     while ( d->runCommandsAgain ) {
         d->runCommandsAgain = false;
-        log( "IMAP::runCommands, " + fn( d->commands.count() ) + " commands",
-             Log::Debug );
+        if ( Log::enabled( Log::Debug ) )
+            log( "IMAP::runCommands, " + fn( d->commands.count() ) +
+                 " commands", Log::Debug );
 
         // run all currently executing commands once
         uint n = 0;
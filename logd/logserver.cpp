@@ -22,6 +22,22 @@ static uint id;
 static File *logFile;
 static Log::Severity logLevel;
 static bool useSyslog;
+static EString * pending;
+static bool batching;
+
+
+// Writes whatever output() has collected to the log file.
+
+static void flush()
+{
+    if ( !pending || pending->isEmpty() )
+        return;
+    if ( logFile )
+        logFile->write( *pending );
+    else
+        fprintf( stderr, "%s", pending->cstr() );
+    pending->truncate();
+}
 
 
 /*! \class LogServer logserver.h
@@ -86,9 +102,12 @@ void LogServer::react( Event e )
 
 void LogServer::parse()
 {
+    batching = true;
     EString *s;
     while ( ( s = readBuffer()->removeLine() ) != 0 )
         processLine( *s );
+    batching = false;
+    flush();
 }
 
 
@@ -136,6 +155,9 @@ void LogServer::processLine( const EString &line )
 /*! This private function actually writes \a line to the log file with
     the \a tag and severity \a s converted into their
     textual representations.
+
+    While parse() is working through a batch of lines, the output is
+    collected and written with a single write() at the end.
 */
 
 void LogServer::output( EString tag, Log::Severity s,
@@ -179,22 +201,21 @@ void LogServer::output( EString tag, Log::Severity s,
         return;
     }
 
-    EString msg;
-    msg.reserve( line.length() );
-
-    msg.append( Log::severity( s ) );
-    msg.append( ": " );
-    msg.appendNumber( d->id, 36 );
-    msg.append( "/" );
-    msg.append( tag );
-    msg.append( ": " );
-    msg.append( line );
-    msg.append( "\n" );
-
-    if ( logFile )
-        logFile->write( msg );
-    else
-        fprintf( stderr, "%s", msg.cstr() );
+    if ( !pending ) {
+        pending = new EString;
+        Allocator::addEternal( pending, "pending log output" );
+    }
+    pending->append( Log::severity( s ) );
+    pending->append( ": " );
+    pending->appendNumber( d->id, 36 );
+    pending->append( "/" );
+    pending->append( tag );
+    pending->append( ": " );
+    pending->append( line );
+    pending->append( "\n" );
+
+    if ( !batching || pending->length() >= 65536 )
+        flush();
 }
 
 
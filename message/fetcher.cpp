@@ -5,6 +5,7 @@
 #include "addressfield.h"
 #include "transaction.h"
 #include "integerset.h"
+#include "configuration.h"
 #include "allocator.h"
 #include "bodypart.h"
 #include "selector.h"
@@ -21,6 +22,8 @@
 #include "log.h"
 
 #include <time.h> // time()
+#include <string.h> // memset()
+#include <zlib.h>
 
 
 enum State { NotStarted, Fetching, Done };
@@ -42,7 +45,8 @@ public:
           lastBatchStarted( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
-          partnumbers( 0 ),
+          partnumbers( 0 ), rendered( 0 ),
+          fellBack( false ),
           throttler( 0 )
     {}
 
@@ -82,6 +86,11 @@ public:
     Decoder * body;
     Decoder * trivia;
     Decoder * partnumbers;
+    Decoder * rendered;
+
+    List<Decoder> fallback;
+    IntegerSet unrendered;
+    bool fellBack;
 
     class TriviaDecoder
         : public Decoder
@@ -134,10 +143,45 @@ public:
         bool isDone( Message * ) const;
     };
 
+    class RenderedDecoder
+        : public Decoder
+    {
+    public:
+        RenderedDecoder( FetcherData * fd ): Decoder( fd ) {}
+        void decode( Message *, List<Row> * );
+        void setDone( Message * );
+        bool isDone( Message * ) const;
+    };
+
     Connection * throttler;
 };
 
 
+static const char * addressQuery =
+    "select af.message, "
+    "af.part, af.position, af.field, af.number, "
+    "a.name, a.localpart::text, a.domain::text "
+    "from address_fields af "
+    "join addresses a on (af.address=a.id) "
+    "where af.message=any($1) "
+    "order by af.message, af.part, af.field, af.number";
+
+static const char * headerQuery =
+    "select hf.message, hf.part, hf.position, "
+    "fn.name, hf.value from header_fields hf "
+    "join field_names fn on (hf.field=fn.id) "
+    "where hf.message=any($1) "
+    "order by hf.message, hf.part";
+
+static const char * bodyQuery =
+    "select pn.message, pn.part, bp.text, bp.data, "
+    "bp.bytes as rawbytes, pn.bytes, pn.lines "
+    "from part_numbers pn "
+    "left join bodyparts bp on (pn.bodypart=bp.id) "
+    "where pn.message=any($1) "
+    "order by pn.message, pn.part";
+
+
 /*! \class Fetcher fetcher.h
 
     The Fetcher class retrieves Message data for some/all messages in
@@ -258,6 +302,14 @@ void Fetcher::execute()
 
 void Fetcher::start()
 {
+    if ( d->rendered && ( d->body || d->partnumbers ) ) {
+        // the caller needs the bodyparts anyway, so rendering from
+        // them is cheaper than fetching both
+        d->rendered = 0;
+        fetch( Addresses );
+        fetch( OtherHeader );
+    }
+
     EStringList what;
     what.append( new EString( "Data type(s): " ) );
     uint n = 0;
@@ -282,6 +334,10 @@ void Fetcher::start()
         n++;
         what.append( "bytes/lines" );
     }
+    if ( d->rendered ) {
+        n++;
+        what.append( "rendered" );
+    }
 
     if ( n < 1 || d->messages.isEmpty() ) {
         // nothing to do.
@@ -328,6 +384,8 @@ void Fetcher::waitForEnd()
         decoders.append( d->trivia );
     if ( d->partnumbers )
         decoders.append( d->partnumbers );
+    if ( d->rendered )
+        decoders.append( d->rendered );
 
     List<FetcherData::Decoder>::Iterator i( decoders );
     while ( i ) {
@@ -335,6 +393,18 @@ void Fetcher::waitForEnd()
             return;
         ++i;
     }
+    i = d->fallback.first();
+    while ( i ) {
+        if ( i->q && !i->q->done() )
+            return;
+        ++i;
+    }
+
+    if ( d->rendered && !d->fellBack ) {
+        d->fellBack = true;
+        if ( fallBack() )
+            return;
+    }
 
     Map< List<Message> >::Iterator bi( d->batch );
     while ( bi ) {
@@ -349,9 +419,19 @@ void Fetcher::waitForEnd()
                 di->setDone( m );
                 ++di;
             }
+            if ( d->unrendered.contains( m->databaseId() ) ) {
+                di = d->fallback.first();
+                while ( di ) {
+                    di->setDone( m );
+                    ++di;
+                }
+            }
         }
     }
 
+    if ( !d->unrendered.isEmpty() )
+        storeRendered();
+
     if ( d->messages.isEmpty() ) {
         d->state = Done;
         if ( d->transaction )
@@ -440,6 +520,10 @@ void Fetcher::prepareBatch()
     }
     d->lastBatchStarted = now;
 
+    d->fellBack = false;
+    d->fallback.clear();
+    d->unrendered.clear();
+
     // Find out which messages we're going to fetch, and fill in the
     // batch array so we can tie responses to the Message objects.
     d->uniqueDatabaseIds = true;
@@ -496,6 +580,10 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
                 if ( m->hasTrivia() )
                     need = false;
                 break;
+            case Rendered:
+                if ( m->hasRfc822() )
+                    need = false;
+                break;
             }
             if ( need && m->databaseId() )
                 l.add( m->databaseId() );
@@ -540,40 +628,32 @@ void Fetcher::makeQueries()
         d->trivia->q = q;
     }
 
+    if ( d->rendered ) {
+        q = new Query( "select message, downgraded, data "
+                       "from rendered_messages where message=any($1) "
+                       "order by message",
+                       d->rendered );
+        bindIds( q, 1, Rendered );
+        submit( q );
+        d->rendered->q = q;
+    }
+
     if ( d->addresses ) {
-        q = new Query( "select af.message, "
-                       "af.part, af.position, af.field, af.number, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from address_fields af "
-                       "join addresses a on (af.address=a.id) "
-                       "where af.message=any($1) "
-                       "order by af.message, af.part, af.field, af.number",
-                       d->addresses );
+        q = new Query( addressQuery, d->addresses );
         bindIds( q, 1, Addresses );
         submit( q );
         d->addresses->q = q;
     }
 
     if ( d->otherheader ) {
-        q = new Query( "select hf.message, hf.part, hf.position, "
-                       "fn.name, hf.value from header_fields hf "
-                       "join field_names fn on (hf.field=fn.id) "
-                       "where hf.message=any($1) "
-                       "order by hf.message, hf.part",
-                       d->otherheader );
+        q = new Query( headerQuery, d->otherheader );
         bindIds( q, 1, OtherHeader );
         submit( q );
         d->otherheader->q = q;
     }
 
     if ( d->body ) {
-        q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
-                       "bp.bytes as rawbytes, pn.bytes, pn.lines "
-                       "from part_numbers pn "
-                       "left join bodyparts bp on (pn.bodypart=bp.id) "
-                       "where pn.message=any($1) "
-                       "order by pn.message, pn.part",
-                       d->body );
+        q = new Query( bodyQuery, d->body );
         bindIds( q, 1, Body );
         submit( q );
         d->body->q = q;
@@ -588,11 +668,16 @@ void FetcherData::Decoder::execute()
 {
     Scope x( log() );
     int mid = 0;
-    if ( !mr.isEmpty() )
-        mid = mr.firstElement()->getInt( "message" );
+    int message = -1;
+    if ( !mr.isEmpty() ) {
+        message = mr.firstElement()->column( "message" );
+        mid = mr.firstElement()->getInt( message );
+    }
     while ( q->hasResults() ) {
         Row * r = q->nextRow();
-        int id = r->getInt( "message" );
+        if ( message < 0 )
+            message = r->column( "message" );
+        int id = r->getInt( message );
         if ( mid != id ) {
             process();
             mid = id;
@@ -627,14 +712,20 @@ void FetcherData::Decoder::process()
 
 void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
 {
+    Row * first = rows->firstElement();
+    int partColumn = first->column( "part" );
+    int nameColumn = first->column( "name" );
+    int valueColumn = first->column( "value" );
+    int positionColumn = first->column( "position" );
+
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
         ++i;
 
-        EString part = r->getEString( "part" );
-        EString name = r->getEString( "name" );
-        UString value = r->getUString( "value" );
+        EString part = r->getEString( partColumn );
+        EString name = r->getEString( nameColumn );
+        UString value = r->getUString( valueColumn );
 
         Header * h = m->header();
         if ( part.endsWith( ".rfc822" ) ) {
@@ -654,7 +745,7 @@ void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
             h = m->bodypart( part, true )->header();
         }
         HeaderField * f = HeaderField::assemble( name, value );
-        f->setPosition( r->getInt( "position" ) );
+        f->setPosition( r->getInt( positionColumn ) );
         h->add( f );
     }
 }
@@ -675,16 +766,25 @@ bool FetcherData::HeaderDecoder::isDone( Message * m ) const
 
 void FetcherData::AddressDecoder::decode( Message * m, List<Row> * rows )
 {
+    Row * first = rows->firstElement();
+    int partColumn = first->column( "part" );
+    int positionColumn = first->column( "position" );
+    int fieldColumn = first->column( "field" );
+    int nameColumn = first->column( "name" );
+    int localpartColumn = first->column( "localpart" );
+    int domainColumn = first->column( "domain" );
+
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
         ++i;
 
-        EString part = r->getEString( "part" );
-        uint position = r->getInt( "position" );
+        EString part = r->getEString( partColumn );
+        uint position = r->getInt( positionColumn );
 
         // XXX: use something for mapping
-        HeaderField::Type field = (HeaderField::Type)r->getInt( "field" );
+        HeaderField::Type field =
+            (HeaderField::Type)r->getInt( fieldColumn );
 
         Header * h = m->header();
         if ( part.endsWith( ".rfc822" ) ) {
@@ -716,9 +816,9 @@ void FetcherData::AddressDecoder::decode( Message * m, List<Row> * rows )
         // pointer to the same address, at least within the same
         // fetch. hm.
         Utf8Codec u;
-        Address * a = new Address( r->getUString( "name" ),
-                                   r->getUString( "localpart" ),
-                                   r->getUString( "domain" ) );
+        Address * a = new Address( r->getUString( nameColumn ),
+                                   r->getUString( localpartColumn ),
+                                   r->getUString( domainColumn ) );
         f->addresses()->append( a );
     }
 }
@@ -740,23 +840,29 @@ void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
 {
     PartNumberDecoder::decode( m, rows );
 
+    Row * first = rows->firstElement();
+    int partColumn = first->column( "part" );
+    int dataColumn = first->column( "data" );
+    int textColumn = first->column( "text" );
+    int rawbytesColumn = first->column( "rawbytes" );
+
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
         ++i;
 
-        EString part = r->getEString( "part" );
+        EString part = r->getEString( partColumn );
 
         if ( !part.endsWith( ".rfc822" ) ) {
             Bodypart * bp = m->bodypart( part, true );
 
-            if ( !r->isNull( "data" ) )
-                bp->setData( r->getEString( "data" ) );
-            else if ( !r->isNull( "text" ) )
-                bp->setText( r->getUString( "text" ) );
+            if ( !r->isNull( dataColumn ) )
+                bp->setData( r->getEString( dataColumn ) );
+            else if ( !r->isNull( textColumn ) )
+                bp->setText( r->getUString( textColumn ) );
 
-            if ( !r->isNull( "rawbytes" ) )
-                bp->setNumBytes( r->getInt( "rawbytes" ) );
+            if ( !r->isNull( rawbytesColumn ) )
+                bp->setNumBytes( r->getInt( rawbytesColumn ) );
         }
     }
 }
@@ -777,12 +883,17 @@ bool FetcherData::BodyDecoder::isDone( Message * m ) const
 
 void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
 {
+    Row * first = rows->firstElement();
+    int partColumn = first->column( "part" );
+    int bytesColumn = first->column( "bytes" );
+    int linesColumn = first->column( "lines" );
+
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
         ++i;
 
-        EString part = r->getEString( "part" );
+        EString part = r->getEString( partColumn );
 
         if ( part.endsWith( ".rfc822" ) ) {
             Bodypart *bp = m->bodypart( part.mid( 0, part.length()-7 ),
@@ -800,10 +911,10 @@ void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
         }
         else {
             Bodypart * bp = m->bodypart( part, true );
-            if ( !r->isNull( "bytes" ) )
-                bp->setNumEncodedBytes( r->getInt( "bytes" ) );
-            if ( !r->isNull( "lines" ) )
-                bp->setNumEncodedLines( r->getInt( "lines" ) );
+            if ( !r->isNull( bytesColumn ) )
+                bp->setNumEncodedBytes( r->getInt( bytesColumn ) );
+            if ( !r->isNull( linesColumn ) )
+                bp->setNumEncodedLines( r->getInt( linesColumn ) );
         }
     }
 }
@@ -846,7 +957,210 @@ bool FetcherData::TriviaDecoder::isDone( Message * m ) const
 }
 
 
-/*! Instructs this Fetcher to fetch data of type \a t. */
+/*! Returns \a s compressed using zlib, for storage in
+    rendered_messages.
+*/
+
+static EString deflated( const EString & s )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    if ( ::deflateInit( &zs, Z_DEFAULT_COMPRESSION ) != Z_OK )
+        return "";
+
+    EString r;
+    uint bound = ::deflateBound( &zs, s.length() );
+    r.setLength( bound );
+    zs.next_in = (Bytef*)s.data();
+    zs.avail_in = s.length();
+    zs.next_out = (Bytef*)r.data();
+    zs.avail_out = bound;
+    int e = ::deflate( &zs, Z_FINISH );
+    uint n = bound - zs.avail_out;
+    ::deflateEnd( &zs );
+    if ( e != Z_STREAM_END )
+        return "";
+    r.truncate( n );
+    return r;
+}
+
+
+/*! Returns \a s decompressed, or an empty string if \a s isn't
+    something deflated() returned.
+*/
+
+static EString inflated( const EString & s )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    if ( ::inflateInit( &zs ) != Z_OK )
+        return "";
+
+    EString r;
+    char buffer[32768];
+    zs.next_in = (Bytef*)s.data();
+    zs.avail_in = s.length();
+    int e = Z_OK;
+    while ( e == Z_OK ) {
+        zs.next_out = (Bytef*)buffer;
+        zs.avail_out = sizeof( buffer );
+        e = ::inflate( &zs, Z_NO_FLUSH );
+        if ( e == Z_OK || e == Z_STREAM_END )
+            r.append( buffer, sizeof( buffer ) - zs.avail_out );
+    }
+    ::inflateEnd( &zs );
+    if ( e != Z_STREAM_END )
+        return "";
+    return r;
+}
+
+
+void FetcherData::RenderedDecoder::decode( Message * m, List<Row> * rows )
+{
+    List<Row>::Iterator i( rows );
+    while ( i ) {
+        Row * r = i;
+        ++i;
+
+        EString text = inflated( r->getEString( "data" ) );
+        if ( !text.isEmpty() )
+            m->setRfc822( text, r->getBoolean( "downgraded" ) );
+    }
+}
+
+
+void FetcherData::RenderedDecoder::setDone( Message * )
+{
+    // hasRfc822() is true if and only if a row was found
+}
+
+
+bool FetcherData::RenderedDecoder::isDone( Message * m ) const
+{
+    return m->hasRfc822();
+}
+
+
+/*! Looks for messages in the current batch for which no rendered text
+    was found, and issues the queries needed to render them. Returns
+    true if any queries were issued, and false if no messages need
+    rendering.
+*/
+
+bool Fetcher::fallBack()
+{
+    Map< List<Message> >::Iterator bi( d->batch );
+    while ( bi ) {
+        List<Message>::Iterator li( *bi );
+        ++bi;
+        while ( li ) {
+            Message * m = li;
+            ++li;
+            if ( !m->hasRfc822() && m->databaseId() )
+                d->unrendered.add( m->databaseId() );
+        }
+    }
+    if ( d->unrendered.isEmpty() )
+        return false;
+
+    log( "Rendering " + fn( d->unrendered.count() ) + " messages",
+         Log::Debug );
+
+    Query * q;
+    FetcherData::Decoder * decoder;
+    if ( !d->addresses ) {
+        decoder = new FetcherData::AddressDecoder( d );
+        q = new Query( addressQuery, decoder );
+        q->bind( 1, d->unrendered );
+        decoder->q = q;
+        d->fallback.append( decoder );
+        submit( q );
+    }
+    if ( !d->otherheader ) {
+        decoder = new FetcherData::HeaderDecoder( d );
+        q = new Query( headerQuery, decoder );
+        q->bind( 1, d->unrendered );
+        decoder->q = q;
+        d->fallback.append( decoder );
+        submit( q );
+    }
+    decoder = new FetcherData::BodyDecoder( d );
+    q = new Query( bodyQuery, decoder );
+    q->bind( 1, d->unrendered );
+    decoder->q = q;
+    d->fallback.append( decoder );
+    submit( q );
+
+    if ( d->transaction )
+        d->transaction->execute();
+    return true;
+}
+
+
+/*! Renders each message fallBack() fetched, stores the result in
+    rendered_messages and gives it to all Message objects for the same
+    message.
+
+    The rows are inserted outside any transaction, since another
+    process may insert the same rows at the same time, and the
+    resulting error must not affect our owner.
+*/
+
+void Fetcher::storeRendered()
+{
+    Map< List<Message> >::Iterator bi( d->batch );
+    while ( bi ) {
+        List<Message> * l = bi;
+        ++bi;
+        Message * m = l->firstElement();
+        if ( !m || !d->unrendered.contains( m->databaseId() ) ||
+             !m->hasHeaders() || !m->hasAddresses() || !m->hasBodies() )
+            continue;
+
+        EString text = m->rfc822( false );
+        EString downgraded = m->rfc822( true );
+        bool differs = downgraded != text;
+
+        uint n = 0;
+        while ( n < 2 ) {
+            bool down = n == 1;
+            n++;
+            if ( down && !differs )
+                continue;
+            EString data = deflated( down ? downgraded : text );
+            if ( data.isEmpty() )
+                continue;
+            Query * q = new Query( "insert into rendered_messages "
+                                   "(message, downgraded, data) "
+                                   "select $1, $2, $3 where not exists "
+                                   "(select message from rendered_messages "
+                                   "where message=$1 and downgraded=$2)",
+                                   0 );
+            q->bind( 1, m->databaseId() );
+            q->bind( 2, down );
+            q->bind( 3, data );
+            q->execute();
+        }
+
+        List<Message>::Iterator li( l );
+        while ( li ) {
+            li->setRfc822( text, false );
+            if ( differs )
+                li->setRfc822( downgraded, true );
+            ++li;
+        }
+    }
+}
+
+
+/*! Instructs this Fetcher to fetch data of type \a t.
+
+    Rendered means that the caller needs Message::rfc822() and nothing
+    else. If store-rendered-messages is enabled, the Fetcher reads the
+    stored text of each message, and fetches and renders (and stores)
+    only messages that have none. If not, Rendered is the same as
+    Addresses, OtherHeader and Body.
+*/
 
 void Fetcher::fetch( Type t )
 {
@@ -873,6 +1187,16 @@ void Fetcher::fetch( Type t )
         if ( !d->partnumbers )
             d->partnumbers = new FetcherData::PartNumberDecoder( d );
         break;
+    case Rendered:
+        if ( !Configuration::toggle( Configuration::StoreRenderedMessages ) ) {
+            fetch( Addresses );
+            fetch( OtherHeader );
+            fetch( Body );
+        }
+        else if ( !d->rendered ) {
+            d->rendered = new FetcherData::RenderedDecoder( d );
+        }
+        break;
     }
 }
 
@@ -899,6 +1223,9 @@ bool Fetcher::fetching( Type t ) const
     case PartNumbers:
         return d->partnumbers != 0;
         break;
+    case Rendered:
+        return d->rendered != 0;
+        break;
     }
     return false; // not reached
 }
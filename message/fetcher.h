@@ -29,7 +29,8 @@ public:
         OtherHeader,
         Body,
         PartNumbers,
-        Trivia
+        Trivia,
+        Rendered
     };
 
     void addMessage( Message * );
@@ -52,6 +53,8 @@ private:
     void prepareBatch();
     void makeQueries();
     void waitForEnd();
+    bool fallBack();
+    void storeRendered();
     void submit( Query * );
     void bindIds( Query *, uint, Type );
 };
@@ -393,8 +393,15 @@ void Injector::execute()
             insertDeliveries();
             insertThreadIndexes();
             next();
-            if ( !d->mailboxes.isEmpty() )
-                Mailbox::refreshMailboxes( d->transaction );
+            if ( !d->mailboxes.isEmpty() ) {
+                IntegerSet ids;
+                Map<InjectorData::Mailbox>::Iterator mi( d->mailboxes );
+                while ( mi ) {
+                    ids.add( mi->mailbox->id() );
+                    ++mi;
+                }
+                Mailbox::refreshMailboxes( d->transaction, ids );
+            }
             d->transaction->commit();
             break;
 
@@ -1537,6 +1544,10 @@ void Injector::insertMessages()
                    "from stdin with binary", 0 );
     Query * qd =
         new Query( "copy date_fields (message,value) from stdin", 0 );
+    Query * qs =
+        new Query( "copy sort_keys (message,subject,from_address,"
+                   "from_display,to_address,to_display,cc_address,sent) "
+                   "from stdin with binary", 0 );
 
     Query * qm =
         new Query( "copy mailbox_messages "
@@ -1568,6 +1579,7 @@ void Injector::insertMessages()
 
         addPartNumber( qp, mid, "" );
         addHeader( qh, qa, qd, mid, "", m->header() );
+        addSortKeys( qs, mid, m->header() );
 
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
@@ -1649,6 +1661,7 @@ void Injector::insertMessages()
     d->transaction->enqueue( qh );
     d->transaction->enqueue( qa );
     d->transaction->enqueue( qd );
+    d->transaction->enqueue( qs );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
@@ -1744,6 +1757,46 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
 }
 
 
+/*! Adds a sort_keys row for the message with id \a mid, whose
+    top-level header is \a h, to the query \a q.
+*/
+
+void Injector::addSortKeys( Query * q, uint mid, Header * h )
+{
+    UString subject;
+    HeaderField * s = h->field( HeaderField::Subject );
+    if ( s )
+        subject = s->value();
+
+    Address * from = 0;
+    Address * to = 0;
+    Address * cc = 0;
+    List<Address> * l = h->addresses( HeaderField::From );
+    if ( l )
+        from = l->firstElement();
+    l = h->addresses( HeaderField::To );
+    if ( l )
+        to = l->firstElement();
+    l = h->addresses( HeaderField::Cc );
+    if ( l )
+        cc = l->firstElement();
+
+    q->bind( 1, mid );
+    q->bind( 2, Message::baseSubject( subject ) );
+    q->bind( 3, Message::sortKey( from, false ) );
+    q->bind( 4, Message::sortKey( from, true ) );
+    q->bind( 5, Message::sortKey( to, false ) );
+    q->bind( 6, Message::sortKey( to, true ) );
+    q->bind( 7, Message::sortKey( cc, false ) );
+    Date * date = h->date();
+    if ( date && date->valid() )
+        q->bind( 8, date->unixTime() );
+    else
+        q->bindNull( 8 );
+    q->submitLine();
+}
+
+
 /*! Adds a mailbox_messages row for the message \a m in mailbox \a mb to
     the query \a q. */
 
@@ -88,6 +88,7 @@ private:
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
     void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
+    void addSortKeys( Query *, uint, Header * );
     void addMailbox( Query *, Injectee *, Mailbox * );
     uint addFlags( Query *, Injectee *, Mailbox * );
     uint addAnnotations( Query *, Injectee *, Mailbox * );
@@ -28,7 +28,8 @@ public:
         : databaseId( 0 ), threadId( 0 ),
           wrapped( false ), rfc822Size( 0 ), internalDate( 0 ),
           hasHeaders( false ), hasAddresses( false ), hasBodies( false ),
-          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false )
+          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false ),
+          hasRendered( false ), hasDowngraded( false )
     {}
 
     EString error;
@@ -46,7 +47,12 @@ public:
     bool hasTrivia : 1;
     bool hasBytesAndLines : 1;
     bool hasPGPsignedPart : 1;
+    bool hasRendered : 1;
+    bool hasDowngraded : 1;
     EString rawSignedMessageBody;
+
+    EString rendered;
+    EString downgraded;
 };
 
 
@@ -296,6 +302,11 @@ EString Message::error() const
 
 EString Message::rfc822( bool avoidUtf8 ) const
 {
+    if ( avoidUtf8 && d->hasDowngraded )
+        return d->downgraded;
+    if ( d->hasRendered )
+        return d->rendered;
+
     EString r;
     if ( d->rfc822Size )
         r.reserve( d->rfc822Size );
@@ -310,6 +321,51 @@ EString Message::rfc822( bool avoidUtf8 ) const
 }
 
 
+/*! Records that \a text is what rfc822( \a avoidUtf8 ) returns for
+    this message, so that rfc822() can return it without looking at
+    the header and bodyparts, which need not be present.
+
+    If only the variant with \a avoidUtf8 false is set, rfc822()
+    returns that in both cases, so the downgraded variant need only be
+    set if it differs.
+*/
+
+void Message::setRfc822( const EString & text, bool avoidUtf8 )
+{
+    if ( avoidUtf8 ) {
+        d->downgraded = text;
+        d->hasDowngraded = true;
+    }
+    else {
+        d->rendered = text;
+        d->hasRendered = true;
+    }
+}
+
+
+/*! Returns true if setRfc822() has been called, ie. if rfc822() can
+    work without the header and bodyparts.
+*/
+
+bool Message::hasRfc822() const
+{
+    return d->hasRendered;
+}
+
+
+/*! Returns true if this message needs unicode to be represented
+    faithfully. If only the rendered text is known (see setRfc822()),
+    this is deduced from whether the downgraded text differs.
+*/
+
+bool Message::needsUnicode() const
+{
+    if ( d->hasRendered && !d->hasBodies )
+        return d->hasDowngraded;
+    return Multipart::needsUnicode();
+}
+
+
 /*! Returns the text representation of the body of this message. */
 
 EString Message::body( bool avoidUtf8 ) const
@@ -719,6 +775,30 @@ UString Message::baseSubject( const UString & subject )
 }
 
 
+/*! Returns the key SORT uses for \a a: the mailbox (localpart) of \a
+    a, or if \a display is true, the display name or the address if
+    there's no display name (RFC 5957). The key is case-folded like
+    baseSubject(). Returns an empty string if \a a is null.
+*/
+
+UString Message::sortKey( Address * a, bool display )
+{
+    if ( !a )
+        return UString();
+    UString r;
+    if ( display )
+        r = a->uname();
+    if ( r.isEmpty() ) {
+        r = a->localpart();
+        if ( display && !a->domain().isEmpty() ) {
+            r.append( '@' );
+            r.append( a->domain() );
+        }
+    }
+    return r.simplified().titlecased();
+}
+
+
 /*! Returns true. */
 
 bool Message::isMessage() const
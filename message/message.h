@@ -29,6 +29,10 @@ public:
     EString rfc822( bool ) const;
     EString body( bool ) const;
 
+    void setRfc822( const EString &, bool );
+    bool hasRfc822() const;
+    bool needsUnicode() const;
+
     void setWrapped( bool ) const;
     bool isWrapped() const;
 
@@ -66,6 +70,7 @@ public:
     void setRawSignedMessageBody( const EString & );
 
     static UString baseSubject( const UString & );
+    static UString sortKey( class Address *, bool );
 
     static EString acceptableBoundary( const EString & );
 
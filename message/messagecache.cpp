@@ -2,32 +2,122 @@
 
 #include "messagecache.h"
 
+#include "configuration.h"
+#include "eventloop.h"
+#include "estring.h"
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
+#include "graph.h"
+#include "log.h"
 #include "map.h"
 
-#include <time.h> // time(0)
+#include <sys/types.h>
+#include <sys/mman.h> // mmap
+#include <signal.h> // kill
+#include <unistd.h> // getpid
+#include <string.h> // memcpy
+#include <errno.h>
 
 
 static class MessageCache * c = 0;
 
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+static GraphableCounter * sharedHits = 0;
+static GraphableCounter * sharedMisses = 0;
+
+
+class MessageCacheEntry
+    : public Garbage
+{
+public:
+    MessageCacheEntry()
+        : Garbage(), older( 0 ), newer( 0 ), message( 0 ),
+          mailbox( 0 ), uid( 0 ) {}
+
+    MessageCacheEntry * older;
+    MessageCacheEntry * newer;
+    Message * message;
+    uint mailbox;
+    uint uid;
+};
+
 
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData(): Garbage(), newest( 0 ), oldest( 0 ) {}
+
+    Map< Map<MessageCacheEntry> > m;
+    MessageCacheEntry * newest;
+    MessageCacheEntry * oldest;
+
+    void link( MessageCacheEntry * );
+    void unlink( MessageCacheEntry * );
+    void remove( MessageCacheEntry * );
 };
 
 
+/*! Makes \a e the newest entry in the LRU list. */
+
+void MessageCacheData::link( MessageCacheEntry * e )
+{
+    e->older = newest;
+    e->newer = 0;
+    if ( newest )
+        newest->newer = e;
+    newest = e;
+    if ( !oldest )
+        oldest = e;
+}
+
+
+/*! Removes \a e from the LRU list, but not from the map. */
+
+void MessageCacheData::unlink( MessageCacheEntry * e )
+{
+    if ( e->older )
+        e->older->newer = e->newer;
+    else
+        oldest = e->newer;
+    if ( e->newer )
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+    e->older = 0;
+    e->newer = 0;
+}
+
+
+/*! Removes \a e from the cache entirely. */
+
+void MessageCacheData::remove( MessageCacheEntry * e )
+{
+    unlink( e );
+    Map<MessageCacheEntry> * mbcache = m.find( e->mailbox );
+    if ( !mbcache )
+        return;
+    mbcache->remove( e->uid );
+    if ( mbcache->isEmpty() )
+        m.remove( e->mailbox );
+}
+
+
 /*! \class MessageCache messagecache.h
 
-  The MessageCache class caches messages until the Allocator decides
-  to clear out old Garbage. As a special feature, it can also cache
-  messages a few seconds longer, although that should be used
-  sparingly.
+  The MessageCache class caches messages across garbage collections,
+  up to a certain size. Each time the Allocator frees memory, the
+  least recently used messages are discarded until the remainder fits
+  within the message-cache-size limit (and within a quarter of the
+  process's memory-limit). If the Allocator is short of memory, the
+  entire cache is discarded.
+
+  In addition to Message objects, which are private to each process,
+  the MessageCache can keep rendered message text in a memory segment
+  shared by all Archiveopteryx processes; see setup(), findText() and
+  insertText().
 */
 
 
@@ -36,7 +126,7 @@ public:
 */
 
 MessageCache::MessageCache()
-    : Cache( 1 ), d( new MessageCacheData )
+    : Cache( 0 ), d( new MessageCacheData )
 {
     // nothing
 }
@@ -53,12 +143,23 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
         return;
     if ( !c )
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+    Map<MessageCacheEntry> * mbcache = c->d->m.find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
+        mbcache = new Map<MessageCacheEntry>;
         c->d->m.insert( mb->id(), mbcache );
     }
-    mbcache->insert( uid, m );
+    MessageCacheEntry * e = mbcache->find( uid );
+    if ( e ) {
+        c->d->unlink( e );
+    }
+    else {
+        e = new MessageCacheEntry;
+        e->mailbox = mb->id();
+        e->uid = uid;
+        mbcache->insert( uid, e );
+    }
+    e->message = m;
+    c->d->link( e );
 }
 
 
@@ -68,18 +169,77 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
 
 class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
-    if ( !c )
+    if ( !hits ) {
+        hits = new GraphableCounter( "message-cache-hits" );
+        misses = new GraphableCounter( "message-cache-misses" );
+    }
+    MessageCacheEntry * e = 0;
+    if ( c ) {
+        Map<MessageCacheEntry> * mbcache = c->d->m.find( mailbox->id() );
+        if ( mbcache )
+            e = mbcache->find( uid );
+    }
+    if ( !e ) {
+        misses->tick();
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
-    if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+    }
+    hits->tick();
+    c->d->unlink( e );
+    c->d->link( e );
+    return e->message;
 }
 
 
+/*! Discards the entire contents of the cache. */
+
 void MessageCache::clear()
 {
     d->m.clear();
+    d->newest = 0;
+    d->oldest = 0;
+}
+
+
+/*! Returns a rough estimate of how much memory \a m uses. */
+
+static uint approximateSize( Message * m )
+{
+    uint s = 1024;
+    if ( m->hasBodies() )
+        s += 3 * m->rfc822Size();
+    else if ( m->hasHeaders() )
+        s += 4096;
+    if ( m->hasRfc822() )
+        s += m->rfc822Size();
+    return s;
+}
+
+
+/*! Discards the least recently used messages until the remainder
+    fits within the configured size limit.
+*/
+
+void MessageCache::shrink()
+{
+    uint limit = Configuration::scalar( Configuration::MessageCacheSize )
+                 * 1024 * 1024;
+    if ( EventLoop::global() ) {
+        uint quarter = EventLoop::global()->memoryUsage() / 4;
+        if ( quarter && quarter < limit )
+            limit = quarter;
+    }
+
+    uint used = 0;
+    MessageCacheEntry * e = d->newest;
+    while ( e && used < limit ) {
+        used += approximateSize( e->message );
+        e = e->older;
+    }
+    while ( e ) {
+        MessageCacheEntry * older = e->older;
+        d->remove( e );
+        e = older;
+    }
 }
 
 
@@ -96,3 +256,213 @@ class Message * MessageCache::provide( class Mailbox * mailbox, uint uid )
     insert( mailbox, uid, m );
     return m;
 }
+
+
+// The shared tier is a ring buffer in an anonymous shared mapping,
+// created before the server forks. Records are appended at head,
+// which only ever grows; a record at position p is intact as long as
+// head <= p + capacity. A direct-mapped index points at the most
+// recent record for each key. A record that's found in the older half
+// of the ring is copied to the head again, which approximates LRU.
+//
+// One lock protects the whole segment. Nobody waits for it: if it's
+// busy, we behave as though the cache were empty. The lock holds the
+// pid of its owner, so that a lock held by a process that died can be
+// taken over.
+
+struct SharedIndexSlot {
+    uint mailbox;
+    uint uid;
+    uint flags;
+    uint length;
+    unsigned long long position;
+};
+
+struct SharedRecordHeader {
+    uint mailbox;
+    uint uid;
+    uint flags;
+    uint length;
+};
+
+struct SharedHeader {
+    volatile int lock;
+    uint slots;
+    unsigned long long capacity;
+    unsigned long long head;
+};
+
+static SharedHeader * shared = 0;
+static SharedIndexSlot * sharedIndex = 0;
+static char * sharedRing = 0;
+
+
+static bool lockShared()
+{
+    int self = getpid();
+    uint i = 0;
+    while ( i < 64 ) {
+        if ( __sync_bool_compare_and_swap( &shared->lock, 0, self ) )
+            return true;
+        i++;
+    }
+    int owner = shared->lock;
+    if ( owner && owner != self &&
+         ::kill( owner, 0 ) < 0 && errno == ESRCH &&
+         __sync_bool_compare_and_swap( &shared->lock, owner, self ) )
+        return true;
+    return false;
+}
+
+
+static void unlockShared()
+{
+    __sync_lock_release( &shared->lock );
+}
+
+
+static SharedIndexSlot * sharedSlot( uint mailbox, uint uid, uint flags )
+{
+    uint h = mailbox * 2654435761u ^ uid * 40503u ^ flags;
+    return sharedIndex + ( h % shared->slots );
+}
+
+
+// Appends a record at the head of the ring and points the index at
+// it. Must be called with the lock held, and \a length must be at most
+// capacity/8.
+
+static void appendShared( uint mailbox, uint uid, uint flags,
+                          const char * data, uint length )
+{
+    unsigned long long cap = shared->capacity;
+    uint size = sizeof( SharedRecordHeader ) + length;
+    size = ( size + 7 ) & ~7;
+    if ( shared->head % cap + size > cap )
+        shared->head += cap - shared->head % cap;
+    unsigned long long p = shared->head;
+    char * r = sharedRing + p % cap;
+    SharedRecordHeader h;
+    h.mailbox = mailbox;
+    h.uid = uid;
+    h.flags = flags;
+    h.length = length;
+    memcpy( r, &h, sizeof( h ) );
+    memcpy( r + sizeof( h ), data, length );
+    shared->head = p + size;
+
+    SharedIndexSlot * s = sharedSlot( mailbox, uid, flags );
+    s->mailbox = mailbox;
+    s->uid = uid;
+    s->flags = flags;
+    s->length = length;
+    s->position = p;
+}
+
+
+/*! Creates the memory segment used by findText() and insertText(), if
+    shared-message-cache-size is nonzero. Must be called before the
+    server forks, so that all processes share the same segment.
+*/
+
+void MessageCache::setup()
+{
+    uint mb = Configuration::scalar( Configuration::SharedMessageCacheSize );
+    if ( !mb || shared )
+        return;
+
+    unsigned long long cap = mb * 1024ULL * 1024ULL;
+    uint slots = cap / 4096;
+    if ( slots < 64 )
+        slots = 64;
+    unsigned long long total = sizeof( SharedHeader ) +
+                               slots * sizeof( SharedIndexSlot ) + cap;
+    void * m = ::mmap( 0, total, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( m == MAP_FAILED ) {
+        log( "Could not allocate the shared message cache (" +
+             fn( mb ) + "MB); messages will not be shared",
+             Log::Error );
+        return;
+    }
+    shared = (SharedHeader *)m;
+    shared->lock = 0;
+    shared->slots = slots;
+    shared->capacity = cap;
+    shared->head = 0;
+    sharedIndex = (SharedIndexSlot *)( shared + 1 );
+    sharedRing = (char *)( sharedIndex + slots );
+}
+
+
+/*! Stores \a text as the rendered form of the message with \a uid in
+    \a mailbox, such that findText() in any process will find it. \a
+    avoidUtf8 is the argument which was passed to Message::rfc822().
+
+    Does nothing unless setup() has created the shared segment, or if
+    \a text is too large to be worth caching.
+*/
+
+void MessageCache::insertText( class Mailbox * mailbox, uint uid,
+                               bool avoidUtf8, const EString & text )
+{
+    if ( !shared || text.length() > shared->capacity / 8 )
+        return;
+    if ( !lockShared() )
+        return;
+    appendShared( mailbox->id(), uid, avoidUtf8 ? 1 : 0,
+                  text.data(), text.length() );
+    unlockShared();
+}
+
+
+/*! Looks for the rendered text of the message with \a uid in \a
+    mailbox in the shared cache. If it's there, stores it in \a text
+    and returns true. If not, returns false and leaves \a text alone.
+    \a avoidUtf8 must match the value passed to insertText().
+*/
+
+bool MessageCache::findText( class Mailbox * mailbox, uint uid,
+                             bool avoidUtf8, EString * text )
+{
+    if ( !shared )
+        return false;
+    if ( !sharedHits ) {
+        sharedHits = new GraphableCounter( "shared-message-cache-hits" );
+        sharedMisses = new GraphableCounter( "shared-message-cache-misses" );
+    }
+    if ( !lockShared() ) {
+        sharedMisses->tick();
+        return false;
+    }
+
+    uint mb = mailbox->id();
+    uint flags = avoidUtf8 ? 1 : 0;
+    SharedIndexSlot * s = sharedSlot( mb, uid, flags );
+    bool found = false;
+    if ( s->mailbox == mb && s->uid == uid && s->flags == flags &&
+         s->position + shared->capacity >= shared->head &&
+         s->length <= shared->capacity / 8 ) {
+        unsigned long long p = s->position;
+        const char * r = sharedRing + p % shared->capacity;
+        SharedRecordHeader h;
+        memcpy( &h, r, sizeof( h ) );
+        if ( h.mailbox == mb && h.uid == uid && h.flags == flags &&
+             h.length == s->length ) {
+            found = true;
+            EString t;
+            t.reserve( h.length );
+            t.append( r + sizeof( h ), h.length );
+            *text = t;
+            if ( shared->head - p > shared->capacity / 2 )
+                appendShared( mb, uid, flags, t.data(), t.length() );
+        }
+    }
+    unlockShared();
+
+    if ( found )
+        sharedHits->tick();
+    else
+        sharedMisses->tick();
+    return found;
+}
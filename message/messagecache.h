@@ -6,6 +6,9 @@
 #include "cache.h"
 
 
+class EString;
+
+
 class MessageCache
     : public Cache
 {
@@ -13,11 +16,17 @@ private:
     MessageCache();
 
 public:
+    static void setup();
+
     static void insert( class Mailbox *, uint, class Message * );
     static class Message * find( class Mailbox *, uint );
     static class Message * provide( class Mailbox *, uint );
 
+    static void insertText( class Mailbox *, uint, bool, const EString & );
+    static bool findText( class Mailbox *, uint, bool, EString * );
+
     void clear();
+    void shrink();
 
 private:
     class MessageCacheData * d;
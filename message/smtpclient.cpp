@@ -14,6 +14,7 @@
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
+#include "allocator.h"
 // time
 #include <time.h>
 
@@ -28,13 +29,14 @@ public:
           wbt( 0 ), wbs( 0 ),
           enhancedstatuscodes( false ),
           unicode( false ),
-          size( false )
+          size( false ), pipelining( false ),
+          ahead( 0 ), ignore( 0 )
     {}
 
     enum State { Invalid,
                  Connected, Banner, Hello,
                  MailFrom, RcptTo, Data, Body,
-                 Error, Rset, Quit };
+                 Error, Rset, Idle, Quit };
     State state;
 
     EString sent;
@@ -52,6 +54,9 @@ public:
     bool enhancedstatuscodes;
     bool unicode;
     bool size;
+    bool pipelining;
+    uint ahead;
+    uint ignore;
     Timer * closeTimer;
     class TimerCloser
         : public EventHandler
@@ -72,8 +77,18 @@ public:
 
     Archiveopteryx uses it to send outgoing messages to a smarthost.
 
+    If the smarthost supports PIPELINING (RFC 2920), SmtpClient sends
+    MAIL FROM, all the RCPT TO commands and DATA in one go, and then
+    processes the responses one by one as if it had sent the commands
+    one by one.
+
+    The clients are kept in a pool, so that provide() can find an
+    idle one without looking at every connection.
 */
 
+
+static List<SmtpClient> * clients = 0;
+
 /*! Constructs an SMTP client which will immediately connect to \a
     address and introduce itself, and then wait politely for something
     to do.
@@ -89,6 +104,23 @@ SmtpClient::SmtpClient( const Endpoint & address )
     setTimeoutAfter( 4 );
     log( "Connecting to " + address.string() );
     d->timerCloser = new SmtpClientData::TimerCloser( this );
+    if ( !::clients ) {
+        ::clients = new List<SmtpClient>;
+        Allocator::addEternal( ::clients, "SMTP client pool" );
+    }
+    ::clients->append( this );
+}
+
+
+/*! Closes the connection and removes this client from the pool, so
+    that provide() won't consider it again.
+*/
+
+void SmtpClient::close()
+{
+    if ( ::clients )
+        ::clients->remove( this );
+    Connection::close();
 }
 
 
@@ -145,6 +177,8 @@ void SmtpClient::react( Event e )
 
     case Error:
     case Close:
+        if ( ::clients )
+            ::clients->remove( this );
         if ( state() == Connecting ) {
             d->error = "Connection refused by SMTP/LMTP server";
             finish( "4.4.1" );
@@ -187,6 +221,16 @@ void SmtpClient::parse()
             // nonnumeric response
             d->error = "Server sent garbage: " + *s;
         }
+        else if ( d->ignore && (*s)[3] == ' ' ) {
+            // a response to a pipelined command we no longer care
+            // about. if it's a 354, we have to end the (empty) body.
+            d->ignore--;
+            if ( response/100 == 3 ) {
+                log( "Sending empty body", Log::Debug );
+                enqueue( ".\r\n" );
+                d->ignore++;
+            }
+        }
         else if ( (*s)[3] == '-' ) {
             if ( d->state == SmtpClientData::Hello ) {
                 recordExtension( *s );
@@ -248,11 +292,15 @@ void SmtpClient::parse()
 }
 
 
-/*! Sends a single SMTP command. */
+/*! Sends a single SMTP command, or if the server supports
+    pipelining, a whole MAIL FROM/RCPT TO/DATA group.
+*/
 
 void SmtpClient::sendCommand()
 {
     EString send;
+    EString group;
+    uint ahead = 0;
 
     switch( d->state ) {
     case SmtpClientData::Invalid:
@@ -290,6 +338,23 @@ void SmtpClient::sendCommand()
             send.append( fn( d->dotted.length() ) );
         }
 
+        if ( d->pipelining ) {
+            List<Recipient>::Iterator i( d->dsn->recipients() );
+            while ( i ) {
+                if ( i->action() == Recipient::Unknown ) {
+                    group.append( "rcpt to:<" );
+                    group.append( i->finalRecipient()->lpdomain() );
+                    group.append( ">\r\n" );
+                    ahead++;
+                }
+                ++i;
+            }
+            if ( ahead ) {
+                group.append( "data\r\n" );
+                ahead++;
+            }
+        }
+
         d->state = SmtpClientData::MailFrom;
         break;
 
@@ -339,6 +404,9 @@ void SmtpClient::sendCommand()
         break;
 
     case SmtpClientData::Rset:
+        // the server has answered our rset, so now we can take on
+        // another message
+        d->state = SmtpClientData::Idle;
         finish( "4.5.0" );
         delete d->closeTimer;
         if ( idleClient() == this )
@@ -347,6 +415,9 @@ void SmtpClient::sendCommand()
             d->closeTimer = new Timer( d->timerCloser, 15 );
         return;
 
+    case SmtpClientData::Idle:
+        break;
+
     case SmtpClientData::Error:
         finish( "4.5.0" );
         send = "rset";
@@ -361,8 +432,24 @@ void SmtpClient::sendCommand()
     if ( send.isEmpty() )
         return;
 
+    if ( d->ahead ) {
+        if ( send.startsWith( "rcpt to:" ) || send == "data" ) {
+            // we sent this along with mail from
+            d->ahead--;
+            d->sent = send;
+            return;
+        }
+        // we're not following the script, so the responses to the
+        // rest of the group are of no interest
+        d->ignore += d->ahead;
+        d->ahead = 0;
+    }
+
     log( "Sending: " + send, Log::Debug );
-    enqueue( send + "\r\n" );
+    if ( ahead )
+        log( "Pipelining " + fn( ahead ) + " more commands", Log::Debug );
+    enqueue( send + "\r\n" + group );
+    d->ahead = ahead;
     d->sent = send;
     setTimeoutAfter( 300 );
 }
@@ -548,7 +635,7 @@ bool SmtpClient::ready() const
     if ( d->state == SmtpClientData::Invalid ||
          d->state == SmtpClientData::Connected ||
          d->state == SmtpClientData::Hello ||
-         d->state == SmtpClientData::Rset )
+         d->state == SmtpClientData::Idle )
         return true;
     return false;
 }
@@ -586,11 +673,13 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
 
     d->dsn = dsn;
     d->dotted.truncate();
+    d->accepted.clear();
+    d->rcptTo = List<Recipient>::Iterator();
     d->owner = user;
     d->sentMail = false;
     delete d->closeTimer;
     d->closeTimer = 0;
-    if ( d->state == SmtpClientData::Rset )
+    if ( d->state == SmtpClientData::Idle )
         d->state = SmtpClientData::Hello;
     sendCommand();
 }
@@ -640,6 +729,9 @@ void SmtpClient::recordExtension( const EString & line )
     else if ( w == "smtputf8" ) {
         d->unicode = true;
     }
+    else if ( w == "pipelining" ) {
+        d->pipelining = true;
+    }
     else if ( w == "size" ) {
         d->size = true;
         ::observedSize = l.section( " ", 2 ).number( 0 );
@@ -654,7 +746,7 @@ void SmtpClient::recordExtension( const EString & line )
 
 void SmtpClient::logout( uint t )
 {
-    if ( d->state != SmtpClientData::Rset )
+    if ( d->state != SmtpClientData::Idle )
         return;
     if ( t ) {
         delete d->closeTimer;
@@ -726,14 +818,11 @@ DSN * SmtpClient::sending() const
 
 SmtpClient * SmtpClient::idleClient()
 {
-    List<Connection>::Iterator c( EventLoop::global()->connections() );
+    List<SmtpClient>::Iterator c( ::clients );
     while ( c ) {
-        if ( c->type() == Connection::SmtpClient ) {
-            Connection * tmp = c;
-            SmtpClient * sc = (SmtpClient*)tmp;
-            if ( sc->d->state == SmtpClientData::Rset )
-                return sc;
-        }
+        if ( c->d->state == SmtpClientData::Idle &&
+             c->state() == Connected )
+            return c;
         ++c;
     }
     return 0;
@@ -21,6 +21,7 @@ public:
     SmtpClient( const Endpoint & );
 
     void react( Event );
+    void close();
 
     static SmtpClient * provide();
 
@@ -197,7 +197,9 @@ void POP::setState( State s )
                         q->bind( 1, ms+1 );
                         q->bind( 2, mailbox->id() );
                         t->enqueue( q );
-                        Mailbox::refreshMailboxes( t );
+                        IntegerSet ids;
+                        ids.add( mailbox->id() );
+                        Mailbox::refreshMailboxes( t, ids );
                     }
                     iq = 0;
                     t->commit();
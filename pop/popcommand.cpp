@@ -29,7 +29,8 @@ public:
           m( 0 ), r( 0 ),
           user( 0 ), mailbox( 0 ), permissions( 0 ),
           session( 0 ), sentFetch( false ), started( false ),
-          message( 0 ), n( 0 ), findIds( 0 ), map( 0 )
+          message( 0 ), n( 0 ), uid( 0 ), cached( false ),
+          findIds( 0 ), map( 0 )
     {}
 
     POP * pop;
@@ -49,6 +50,9 @@ public:
     bool started;
     Message * message;
     int n;
+    uint uid;
+    EString text;
+    bool cached;
 
     Query * findIds;
     Map<Message> * map;
@@ -649,17 +653,18 @@ bool PopCommand::retr( bool lines )
         }
 
         d->started = true;
-        Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
-            f->fetch( Fetcher::Body );
-        if ( !d->message->hasHeaders() )
-            f->fetch( Fetcher::OtherHeader );
-        if ( !d->message->hasAddresses() )
-            f->fetch( Fetcher::Addresses );
-        f->execute();
+        d->uid = s->uid( msn );
+        d->cached = MessageCache::findText( s->mailbox(), d->uid,
+                                            true, &d->text );
+        if ( !d->cached && !d->message->hasRfc822() ) {
+            Fetcher * f = new Fetcher( d->message, this );
+            f->fetch( Fetcher::Rendered );
+            f->execute();
+        }
     }
 
-    if ( !( d->message->hasBodies() &&
+    if ( !d->cached && !d->message->hasRfc822() &&
+         !( d->message->hasBodies() &&
             d->message->hasHeaders() &&
             d->message->hasAddresses() ) )
         return false;
@@ -672,8 +677,14 @@ bool PopCommand::retr( bool lines )
         return true;
     }
 
+    if ( !d->cached ) {
+        d->text = d->message->rfc822( true ); // XXX always downgrades
+        MessageCache::insertText( s->mailbox(), d->uid,
+                                  true, d->text );
+    }
+
     Buffer * b = new Buffer;
-    b->append( d->message->rfc822( true ) ); // XXX always downgrades
+    b->append( d->text );
 
     int ln = d->n;
     bool header = true;
@@ -710,7 +721,11 @@ bool PopCommand::retr( bool lines )
 
     d->pop->enqueue( ".\r\n" );
 
-    if( !lines )
+    if( !lines && !d->message->hasHeaders() )
+        log( "Retrieved "
+         + fn( lnhead ) + ":" + fn( lnbody ) + "/" + fn( msize ),
+         Log::Significant );
+    else if( !lines )
         log( "Retrieved "
          + fn( lnhead ) + ":" + fn( lnbody ) + "/" + fn( msize )
          + " " + d->message->header()->messageId().forlog(),
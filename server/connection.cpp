@@ -2,7 +2,7 @@
 
 #include "connection.h"
 
-#include "tlsthread.h"
+#include "tlsengine.h"
 
 #include "log.h"
 #include "file.h"
@@ -45,7 +45,7 @@ public:
     {}
 
     Buffer *r, *w;
-    TlsThread * tls;
+    TlsEngine * tls;
     Log *l;
     Session * session;
     int fd;
@@ -171,7 +171,7 @@ void Connection::setState( Connection::State st )
              internal ? Log::Debug : Log::Info );
     }
     d->state = st;
-
+    touch();
 }
 
 
@@ -421,6 +421,7 @@ uint Connection::timeout() const
 void Connection::setTimeout( uint tm )
 {
     d->timeout = tm;
+    touch();
 }
 
 
@@ -430,6 +431,7 @@ void Connection::setTimeout( uint tm )
 void Connection::setTimeoutAfter( uint n )
 {
     d->timeout = n + (uint)time(0);
+    touch();
 }
 
 
@@ -441,6 +443,7 @@ void Connection::extendTimeout( uint n )
 {
     if ( d->timeout != 0 )
         d->timeout += n;
+    touch();
 }
 
 
@@ -475,14 +478,29 @@ Buffer *Connection::readBuffer() const
 }
 
 
-/*! Returns a pointer to the connection's write buffer. */
+/*! Returns a pointer to the connection's write buffer. Since the
+    caller is likely to append something, the EventLoop is told to
+    look at this Connection soon.
+*/
 
 Buffer *Connection::writeBuffer() const
 {
+    touch();
     return d->w;
 }
 
 
+/*! Tells the EventLoop that this Connection may need attention soon,
+    even if nothing happens on its socket. See EventLoop::touch().
+*/
+
+void Connection::touch() const
+{
+    if ( d->state != Invalid && EventLoop::global() )
+        EventLoop::global()->touch( (Connection*)this );
+}
+
+
 static union {
     struct sockaddr_in in;
     struct sockaddr_in6 in6;
@@ -531,7 +549,7 @@ void Connection::close()
 {
     if ( valid() && d->fd >= 0 )
         ::close( d->fd );
-    if ( d->tls )
+    if ( d->tls && !d->tls->broken() )
         d->tls->close();
     d->r->close();
     d->w->close();
@@ -541,12 +559,17 @@ void Connection::close()
 }
 
 
-/*! Reads waiting input from the connected socket. Does nothing in
-    case the Connection isn't valid(). */
+/*! Reads waiting input from the connected socket, decrypting it if
+    TLS is in use. Does nothing in case the Connection isn't valid(). */
 
 void Connection::read()
 {
-    if ( valid() )
+    if ( !valid() )
+        return;
+
+    if ( d->tls )
+        d->tls->read( d->fd, d->r );
+    else
         d->r->read( d->fd );
 }
 
@@ -559,7 +582,10 @@ void Connection::write()
     if ( !valid() )
         return;
 
-    d->w->write( d->fd );
+    if ( d->tls )
+        d->tls->write( d->w, d->fd );
+    else
+        d->w->write( d->fd );
     uint wbs = d->w->size();
     if ( wbs && !d->wbs ) {
         d->wbt = time( 0 );
@@ -586,6 +612,8 @@ void Connection::write()
 
 bool Connection::canWrite()
 {
+    if ( d->tls )
+        return d->tls->canWrite( d->w );
     return d->w->size() > 0;
 }
 
@@ -615,7 +643,9 @@ void Connection::enqueue( const EString &s )
 */
 
 
-/*! Starts TLS negotiation on this connection. */
+/*! Starts TLS negotiation on this connection. Anything already in
+    the writeBuffer() is sent in cleartext first, if possible.
+*/
 
 void Connection::startTls()
 {
@@ -627,40 +657,15 @@ void Connection::startTls()
     log( "Negotiating TLS for client " + peer().string(),
          Log::Debug );
 
-    int sv[2];
-    int r = ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
-    if ( r < 0 ) {
-        log( "Cannot create more FDs", Log::Error );
-        // there's nothing much to do, we just have to close the
-        // connection and hope the situation passes.
-        close();
-        return;
-    }
-
-    TlsThread * t = new TlsThread();
+    TlsEngine * t = new TlsEngine();
     if ( t->broken() ) {
-        log( "Cannot create more threads", Log::Error );
+        log( "Cannot start TLS", Log::Error );
         close();
-        ::close( sv[0] );
-        ::close( sv[1] );
-        EventLoop::shutdown();
         return;
     }
 
-    int flags = fcntl( sv[0], F_GETFL, 0 );
-    if ( flags < 0 )
-        die( FD );
-    flags = flags | O_NDELAY;
-    if ( fcntl( sv[0], F_SETFL, flags ) < 0 )
-        die( FD );
-    if ( fcntl( sv[1], F_SETFL, flags ) < 0 )
-        die( FD );
-
-    t->setClientFD( d->fd );
-    t->setServerFD( sv[0] );
-    d->fd = sv[1];
-
     d->tls = t;
+    touch();
 }
 
 
@@ -669,6 +674,7 @@ void Connection::startTls()
 void Connection::stopTls()
 {
     d->tls->shutdown();
+    touch();
 }
 
 /*! Returns true if stopTls() has been called, and false if not. */
@@ -678,6 +684,14 @@ bool Connection::isTlsShuttingDown() const
     return d->tls && d->tls->isShuttingDown();
 }
 
+/*! Returns true if TLS is in use and the peer has closed the TLS
+    session (or broken it), so that no more data can be read. */
+
+bool Connection::isTlsClosed() const
+{
+    return d->tls && d->tls->closed();
+}
+
 /*! Returns true if TLS has been or is being negotiated for this
     connection, and false if not.
 */
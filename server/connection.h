@@ -66,6 +66,7 @@ public:
     void stopTls();
     bool hasTls() const;
     bool isTlsShuttingDown() const;
+    bool isTlsClosed() const;
 
     virtual void close();
     virtual void read();
@@ -107,6 +108,7 @@ public:
 protected:
     void substitute( Connection *, Event );
     void init( int );
+    void touch() const;
 
 private:
     class ConnectionData *d;
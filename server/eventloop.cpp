@@ -12,6 +12,7 @@
 #include "graph.h"
 #include "event.h"
 #include "list.h"
+#include "map.h"
 #include "log.h"
 
 // time
@@ -32,6 +33,12 @@
 // memset (for FD_* under OpenBSD)
 #include <string.h>
 
+#if defined(__linux__)
+// epoll_create1, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+#define USE_EPOLL 1
+#endif
+
 
 static bool freeMemorySoon;
 
@@ -45,7 +52,8 @@ class LoopData
 public:
     LoopData()
         : log( new Log ), startup( false ),
-          stop( false ), limit( 16 * 1024 * 1024 )
+          stop( false ), limit( 16 * 1024 * 1024 ),
+          epfd( -1 ), nextTimeout( 0 ), touched( new List<Connection> )
     {}
 
     Log *log;
@@ -55,6 +63,21 @@ public:
     List< Timer > timers;
     uint limit;
 
+    class Watch
+        : public Garbage
+    {
+    public:
+        Watch( Connection * conn ): c( conn ), events( 0 ) {}
+        Connection * c;
+        uint events;
+    };
+
+    int epfd;
+    uint nextTimeout;
+    Map< Watch > watched;
+    List< Connection > * touched;
+    Map< Connection > touchedFds;
+
     class Stopper
         : public EventHandler
     {
@@ -139,6 +162,7 @@ void EventLoop::addConnection( Connection * c )
 
     d->connections.prepend( c );
     setConnectionCounts();
+    touch( c );
 }
 
 
@@ -153,6 +177,7 @@ void EventLoop::removeConnection( Connection * c )
     if ( d->connections.remove( c ) == 0 )
         return;
     setConnectionCounts();
+    unwatch( c );
 
     // if this is a server, with external connections, and we just
     // closed the last external connection, then we shut down
@@ -190,7 +215,13 @@ static GraphableNumber * sizeinram = 0;
 static const uint gcDelay = 30;
 
 
-/*! Starts the EventLoop and runs it until stop() is called. */
+/*! Starts the EventLoop and runs it until stop() is called.
+
+    On Linux, the loop uses epoll and only dispatches events to
+    Connections whose sockets are ready, which have been touch()ed, or
+    whose timeout has passed. Elsewhere, or if epoll isn't available,
+    it uses select() and looks at every Connection in each iteration.
+*/
 
 void EventLoop::start()
 {
@@ -200,6 +231,23 @@ void EventLoop::start()
 
     log( "Starting event loop", Log::Debug );
 
+#if defined(USE_EPOLL)
+    if ( d->epfd < 0 ) {
+        d->epfd = ::epoll_create1( EPOLL_CLOEXEC );
+        if ( d->epfd < 0 ) {
+            log( "Cannot use epoll (error " + fn( errno ) + "), "
+                 "falling back to select()", Log::Info );
+        }
+        else {
+            List< Connection >::Iterator it( d->connections );
+            while ( it ) {
+                touch( it );
+                ++it;
+            }
+        }
+    }
+#endif
+
     while ( !d->stop && !Log::disastersYet() ) {
         if ( !haveLoggedStartup && !inStartup() ) {
             if ( !Server::name().isEmpty() )
@@ -208,114 +256,13 @@ void EventLoop::start()
             haveLoggedStartup = true;
         }
 
-        Connection * c;
-
-        uint timeout = gcDelay;
-        int maxfd = -1;
-
-        fd_set r, w;
-        FD_ZERO( &r );
-        FD_ZERO( &w );
-
-        // Figure out what events each connection wants.
-
-        List< Connection >::Iterator it( d->connections );
-        while ( it ) {
-            c = it;
-            ++it;
+        if ( d->epfd >= 0 )
+            epollEvents();
+        else
+            selectEvents();
 
-            int fd = c->fd();
-            if ( fd < 0 ) {
-                removeConnection( c );
-            }
-            else if ( c->type() == Connection::Listener && inStartup() ) {
-                // we don't accept new connections until we've
-                // completed startup
-            }
-            else {
-                if ( fd > maxfd )
-                    maxfd = fd;
-                FD_SET( fd, &r );
-                if ( c->canWrite() ||
-                     c->state() == Connection::Connecting ||
-                     c->state() == Connection::Closing )
-                    FD_SET( fd, &w );
-                if ( c->timeout() > 0 && c->timeout() < timeout )
-                    timeout = c->timeout();
-            }
-        }
-
-        // Figure out whether any timers need attention soon
-
-        List< Timer >::Iterator t( d->timers );
-        while ( t ) {
-            if ( t->active() && t->timeout() < timeout )
-                timeout = t->timeout();
-            ++t;
-        }
-
-        // Look for interesting input
-
-        struct timeval tv;
-        tv.tv_sec = timeout - time( 0 );
-        tv.tv_usec = 0;
-
-        if ( tv.tv_sec < 0 )
-            tv.tv_sec = 0;
-        if ( tv.tv_sec > 60 )
-            tv.tv_sec = 60;
-
-        // we never ask the OS to sleep shorter than .2 seconds
-        if ( tv.tv_sec < 1 )
-            tv.tv_usec = 200000;
-
-        if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
-            // r and w are undefined. we clear them, and dispatch()
-            // won't jump to conclusions
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-        }
         time_t now = time( 0 );
 
-        // Graph our size before processing events
-        if ( !sizeinram )
-            sizeinram = new GraphableNumber( "memory-used" );
-        sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
-
-        // Any interesting timers?
-
-        if ( !d->timers.isEmpty() ) {
-            uint now = time( 0 );
-            t = d->timers.first();
-            while ( t ) {
-                Timer * tmp = t;
-                ++t;
-                if ( tmp->active() && tmp->timeout() <= now )
-                    tmp->execute();
-            }
-        }
-
-        // Figure out what each connection cares about.
-
-        it = d->connections.first();
-        while ( it ) {
-            c = it;
-            ++it;
-            int fd = c->fd();
-            if ( fd >= 0 ) {
-                dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
-                FD_CLR( fd, &r );
-                FD_CLR( fd, &w );
-            }
-            else {
-                removeConnection( c );
-            }
-        }
-
-        // Graph our size after processing all the events too
-
-        sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
-
         // Collect garbage if someone asks for it, or if we've passed
         // the memory usage goal. This has to be at the end of the
         // scope, since anything referenced by local variables might
@@ -378,8 +325,398 @@ void EventLoop::start()
 }
 
 
+/*! This private helper waits for events using select(), then
+    dispatches them to every Connection. It's used where epoll isn't
+    available.
+*/
+
+void EventLoop::selectEvents()
+{
+    Connection * c;
+
+    uint timeout = gcDelay;
+    int maxfd = -1;
+
+    fd_set r, w;
+    FD_ZERO( &r );
+    FD_ZERO( &w );
+
+    // Figure out what events each connection wants.
+
+    List< Connection >::Iterator it( d->connections );
+    while ( it ) {
+        c = it;
+        ++it;
+
+        int fd = c->fd();
+        if ( fd < 0 ) {
+            removeConnection( c );
+        }
+        else if ( c->type() == Connection::Listener && inStartup() ) {
+            // we don't accept new connections until we've
+            // completed startup
+        }
+        else {
+            if ( fd > maxfd )
+                maxfd = fd;
+            FD_SET( fd, &r );
+            if ( c->canWrite() ||
+                 c->state() == Connection::Connecting ||
+                 c->state() == Connection::Closing )
+                FD_SET( fd, &w );
+            if ( c->timeout() > 0 && c->timeout() < timeout )
+                timeout = c->timeout();
+        }
+    }
+
+    // Figure out whether any timers need attention soon
+
+    timeout = timerTimeout( timeout );
+
+    // Look for interesting input
+
+    struct timeval tv;
+    tv.tv_sec = timeout - time( 0 );
+    tv.tv_usec = 0;
+
+    if ( tv.tv_sec < 0 )
+        tv.tv_sec = 0;
+    if ( tv.tv_sec > 60 )
+        tv.tv_sec = 60;
+
+    // we never ask the OS to sleep shorter than .2 seconds
+    if ( tv.tv_sec < 1 )
+        tv.tv_usec = 200000;
+
+    if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
+        // r and w are undefined. we clear them, and dispatch()
+        // won't jump to conclusions
+        FD_ZERO( &r );
+        FD_ZERO( &w );
+    }
+    time_t now = time( 0 );
+
+    // Graph our size before processing events
+    if ( !sizeinram )
+        sizeinram = new GraphableNumber( "memory-used" );
+    sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+
+    // Any interesting timers?
+
+    runTimers();
+
+    // Figure out what each connection cares about.
+
+    it = d->connections.first();
+    while ( it ) {
+        c = it;
+        ++it;
+        int fd = c->fd();
+        if ( fd >= 0 ) {
+            dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
+            FD_CLR( fd, &r );
+            FD_CLR( fd, &w );
+        }
+        else {
+            removeConnection( c );
+        }
+    }
+
+    // Graph our size after processing all the events too
+
+    sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+}
+
+
+/*! This private helper waits for events using epoll, then dispatches
+    them to the Connections that need attention: Those whose sockets
+    are ready, those that have been touch()ed since the last
+    iteration, and those whose timeout has passed.
+
+    Each Connection's socket is registered once, and its registration
+    is modified only when the events it wants change, so the cost of
+    each iteration does not depend on the number of idle Connections.
+*/
+
+void EventLoop::epollEvents()
+{
+#if defined(USE_EPOLL)
+    uint now = time( 0 );
+
+    // Unless something was touched while we were busy, we can sleep
+    // until the next connection or timer timeout.
+
+    uint timeout = now + gcDelay;
+    if ( d->nextTimeout && d->nextTimeout < timeout )
+        timeout = d->nextTimeout;
+    timeout = timerTimeout( timeout );
+
+    int ms = 0;
+    if ( d->touched->isEmpty() ) {
+        if ( timeout > now )
+            ms = 1000 * ( timeout - now );
+        if ( ms > 60000 )
+            ms = 60000;
+        // we never ask the OS to sleep shorter than .2 seconds
+        if ( ms < 200 )
+            ms = 200;
+    }
+
+    const int maxEvents = 256;
+    struct epoll_event events[maxEvents];
+    int n = ::epoll_wait( d->epfd, events, maxEvents, ms );
+    if ( n < 0 )
+        n = 0;
+    now = time( 0 );
+
+    // Graph our size before processing events
+    if ( !sizeinram )
+        sizeinram = new GraphableNumber( "memory-used" );
+    sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+
+    // Any interesting timers?
+
+    runTimers();
+
+    // Dispatch whatever epoll told us about. If a connection changed
+    // its fd (e.g. when TLS was started), its old registration may
+    // still report events; we drop those.
+
+    int i = 0;
+    while ( i < n ) {
+        int fd = events[i].data.fd;
+        uint e = events[i].events;
+        i++;
+        LoopData::Watch * w = d->watched.find( fd );
+        if ( !w || !w->c || w->c->fd() != fd ) {
+            ::epoll_ctl( d->epfd, EPOLL_CTL_DEL, fd, 0 );
+            d->watched.remove( fd );
+        }
+        else {
+            Connection * c = w->c;
+            bool error = ( e & ( EPOLLERR | EPOLLHUP ) ) != 0;
+            dispatch( c, error || ( e & EPOLLIN ), error || ( e & EPOLLOUT ),
+                      now );
+            watch( c );
+        }
+    }
+
+    // Connections that have been touched may have output to send,
+    // pending events or new timeouts. Anything touched while we do
+    // this is handled in the next iteration, without sleeping.
+
+    if ( !d->touched->isEmpty() ) {
+        List< Connection > * l = d->touched;
+        d->touched = new List< Connection >;
+        d->touchedFds.clear();
+        List< Connection >::Iterator it( l );
+        while ( it ) {
+            Connection * c = it;
+            ++it;
+            if ( c->fd() >= 0 && d->connections.find( c ) ) {
+                dispatch( c, false, false, now );
+                watch( c );
+            }
+        }
+    }
+
+    // If a connection's timeout may have passed, we look at all of
+    // them and dispatch Timeout to those that need it. While we're
+    // at it, we find out when the next one is due.
+
+    if ( !d->nextTimeout || now >= d->nextTimeout ) {
+        d->nextTimeout = now + 60;
+        List< Connection >::Iterator it( d->connections );
+        while ( it ) {
+            Connection * c = it;
+            ++it;
+            uint t = c->timeout();
+            if ( !t ) {
+                // nothing to do
+            }
+            else if ( t <= now ) {
+                dispatch( c, false, false, now );
+                watch( c );
+            }
+            else if ( t < d->nextTimeout ) {
+                d->nextTimeout = t;
+            }
+        }
+    }
+
+    // Graph our size after processing all the events too
+
+    sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+#endif
+}
+
+
+/*! Returns the earlier of \a timeout and the time when the next
+    active Timer is due.
+*/
+
+uint EventLoop::timerTimeout( uint timeout ) const
+{
+    List< Timer >::Iterator t( d->timers );
+    while ( t ) {
+        if ( t->active() && t->timeout() < timeout )
+            timeout = t->timeout();
+        ++t;
+    }
+    return timeout;
+}
+
+
+/*! Executes each active Timer whose timeout has passed. */
+
+void EventLoop::runTimers()
+{
+    if ( d->timers.isEmpty() )
+        return;
+
+    uint now = time( 0 );
+    List< Timer >::Iterator t( d->timers );
+    while ( t ) {
+        Timer * tmp = t;
+        ++t;
+        if ( tmp->active() && tmp->timeout() <= now )
+            tmp->execute();
+    }
+}
+
+
+/*! Records that \a c may need attention during the next iteration of
+    the event loop even if its socket is idle, e.g. because something
+    has been added to its writeBuffer(), because its state has changed
+    or because it has a new timeout.
+
+    Connection calls this as needed. When the loop uses select(), it
+    looks at all Connections anyway, and this function only notes the
+    timeout.
+*/
+
+void EventLoop::touch( Connection * c )
+{
+    uint t = c->timeout();
+    if ( t && ( !d->nextTimeout || t < d->nextTimeout ) )
+        d->nextTimeout = t;
+
+    if ( d->epfd < 0 )
+        return;
+
+    int fd = c->fd();
+    if ( fd < 0 || d->touchedFds.find( fd ) == c )
+        return;
+    d->touchedFds.insert( fd, c );
+    d->touched->append( c );
+}
+
+
+/*! This private helper makes sure the epoll set watches \a c's socket
+    for the events \a c currently wants.
+*/
+
+void EventLoop::watch( Connection * c )
+{
+    int fd = c->fd();
+    if ( d->epfd < 0 || fd < 0 || !d->connections.find( c ) )
+        return;
+
+#if defined(USE_EPOLL)
+    uint events = EPOLLIN;
+    if ( c->type() == Connection::Listener && inStartup() )
+        events = 0;
+    if ( c->canWrite() || c->state() == Connection::Connecting )
+        events |= EPOLLOUT;
+
+    LoopData::Watch * w = d->watched.find( fd );
+    if ( w && w->c == c && w->events == events )
+        return;
+
+    struct epoll_event e;
+    memset( &e, 0, sizeof( e ) );
+    e.events = events;
+    e.data.fd = fd;
+    int op = EPOLL_CTL_MOD;
+    if ( !w ) {
+        op = EPOLL_CTL_ADD;
+        w = new LoopData::Watch( c );
+        d->watched.insert( fd, w );
+    }
+    w->c = c;
+    w->events = events;
+    if ( ::epoll_ctl( d->epfd, op, fd, &e ) < 0 ) {
+        // the fd may have been closed and reused since we last saw
+        // it, so the kernel may disagree about whether it's there
+        op = ( op == EPOLL_CTL_ADD ) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        ::epoll_ctl( d->epfd, op, fd, &e );
+    }
+#endif
+}
+
+
+/*! This private helper forgets \a c's epoll registration, if any. */
+
+void EventLoop::unwatch( Connection * c )
+{
+    int fd = c->fd();
+    if ( d->epfd < 0 || fd < 0 )
+        return; // if c is closed, the kernel has forgotten it already
+
+    LoopData::Watch * w = d->watched.find( fd );
+    if ( !w || w->c != c )
+        return;
+    d->watched.remove( fd );
+#if defined(USE_EPOLL)
+    ::epoll_ctl( d->epfd, EPOLL_CTL_DEL, fd, 0 );
+#endif
+}
+
+
+static GraphableCounter * minorCollections = 0;
+static GraphableCounter * fullCollections = 0;
+static GraphableCounter * pauses[5];
+
+
+/*! Records the time taken by the last garbage collection: The pauses
+    are counted in buckets of 1ms, 10ms, 100ms, 1s and longer, so that
+    the statistics show how long the event loop stalls.
+*/
+
+static void recordPause()
+{
+    if ( !minorCollections ) {
+        minorCollections = new GraphableCounter( "gc-minor-collections" );
+        fullCollections = new GraphableCounter( "gc-full-collections" );
+        pauses[0] = new GraphableCounter( "gc-pauses-under-1ms" );
+        pauses[1] = new GraphableCounter( "gc-pauses-under-10ms" );
+        pauses[2] = new GraphableCounter( "gc-pauses-under-100ms" );
+        pauses[3] = new GraphableCounter( "gc-pauses-under-1s" );
+        pauses[4] = new GraphableCounter( "gc-pauses-over-1s" );
+    }
+
+    if ( Allocator::lastCollectionWasFull() )
+        fullCollections->tick();
+    else
+        minorCollections->tick();
+
+    uint us = Allocator::lastPause();
+    uint b = 0;
+    uint limit = 1000;
+    while ( b < 4 && us >= limit ) {
+        b++;
+        limit = limit * 10;
+    }
+    pauses[b]->tick();
+}
+
+
 /*! Calls Allocator::free() and does any necessary pre- and
     postprocessing.
+
+    If generational collection is enabled, this asks for a full
+    collection only when memory usage exceeds the limit, since only a
+    full collection can tell which Connection uses the most memory.
 */
 
 void EventLoop::freeMemory()
@@ -392,7 +729,9 @@ void EventLoop::freeMemory()
             x.append( c );
         ++i;
     }
-    Garbage * biggest = Allocator::free( &x );
+    bool full = Allocator::inUse() + Allocator::allocated() > d->limit;
+    Garbage * biggest = Allocator::free( &x, full );
+    recordPause();
     // x now points to free memory
     i = d->connections.first();
     Connection * victim = 0;
@@ -494,6 +833,9 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
             c->read();
             c->react( Connection::Read );
 
+            if ( c->isTlsClosed() )
+                gone = true;
+
             if ( gone ) {
                 if ( c->valid() )
                      c->setState( Connection::Closing );
@@ -628,6 +970,12 @@ bool EventLoop::inStartup() const
 void EventLoop::setStartup( bool p )
 {
     d->startup = p;
+    List< Connection >::Iterator it( d->connections );
+    while ( it ) {
+        if ( it->type() == Connection::Listener )
+            touch( it );
+        ++it;
+    }
 }
 
 
@@ -50,8 +50,17 @@ public:
 
     virtual void freeMemory();
 
+    void touch( Connection * );
+
 private:
     class LoopData *d;
+
+    void selectEvents();
+    void epollEvents();
+    uint timerTimeout( uint ) const;
+    void runTimers();
+    void watch( Connection * );
+    void unwatch( Connection * );
 };
 
 
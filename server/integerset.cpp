@@ -3,116 +3,488 @@
 #include "integerset.h"
 
 #include "estringlist.h"
+#include "allocator.h"
 #include "map.h"
 
+// memcpy, memmove, memset
+#include <string.h>
+
 
 static inline uint bitsSet( uint b )
 {
-    uint r = 0;
-    while ( b ) {
-        switch ( b & 15 ) {
-        case 0:
-            r += 0;
-            break;
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-            r += 1;
-            break;
-        case 3:
-        case 5:
-        case 6:
-        case 9:
-        case 10:
-        case 12:
-            r += 2;
-            break;
-        case 7:
-        case 11:
-        case 13:
-        case 14:
-            r += 3;
-            break;
-        case 15:
-            r += 4;
-            break;
-        }
-        b >>= 4;
+    return __builtin_popcount( b );
+}
+
+
+// returns the position of the n'th set bit in b, counting from 1
+static inline uint nthBitSet( uint b, uint n )
+{
+    while ( n > 1 ) {
+        b &= b - 1;
+        n--;
     }
-    return r;
-};
+    return __builtin_ctz( b );
+}
 
 
 static const uint BlockSize = 8192;
 static const uint BitsPerUint = 8 * sizeof(uint);
 static const uint ArraySize = (BlockSize + BitsPerUint - 1) / BitsPerUint;
+static const uint WordsPerRank = 16;
+static const uint RankSize = (ArraySize + WordsPerRank - 1) / WordsPerRank;
+
+// a bitmap uses ArraySize uints. an array or a list of runs may use
+// at most as many ushorts, and a bitmap turns into something else
+// when it's less than a quarter full.
+static const uint MaxShorts = ArraySize * 2;
+static const uint BitmapLimit = MaxShorts / 4;
+
+// scratch space for combining blocks. a block holds at most
+// BlockSize/2 runs, ie. BlockSize ushorts.
+static ushort left[BlockSize];
+static ushort right[BlockSize];
+static ushort result[BlockSize];
+
+
+enum Operation { Union, Difference, Intersection };
+
+
+static uint combine( Operation, const ushort *, uint, const ushort *, uint,
+                     ushort * );
 
 
 class SetData
     : public Garbage
 {
 public:
-    SetData() {}
+    SetData(): blocks( 0 ), before( 0 ), n( 0 ), total( 0 ), indexed( false ) {}
 
     class Block
         : public Garbage
     {
     public:
+        // a Block stores up to BlockSize numbers in one of three
+        // ways, whichever needs least memory: as a sorted array, as
+        // a sorted list of runs (first, last), or as a bitmap.
+        enum Kind { Array, Runs, Bitmap };
+
         Block( uint s )
-            : Garbage(), start( s ), count( 0 ) {
+            : Garbage(), data( 0 ), bits( 0 ),
+              start( s ), count( 0 ), size( 0 ), capacity( 0 ),
+              kind( Array ), ranked( false ) {
             setFirstNonPointer( &start );
-            uint i = 0;
-            while ( i < ArraySize )
-                contents[i++] = 0;
         }
         Block( const Block & other )
-            : Garbage(), start( other.start ), count( other.count ) {
+            : Garbage(), data( 0 ), bits( 0 ),
+              start( other.start ), count( other.count ),
+              size( other.size ), capacity( other.size ),
+              kind( other.kind ), ranked( false ) {
             setFirstNonPointer( &start );
-            uint i = 0;
-            while ( i < ArraySize ) {
-                contents[i] = other.contents[i];
-                ++i;
+            if ( other.bits ) {
+                bits = (uint*)Allocator::alloc( ArraySize * sizeof( uint ),
+                                                0 );
+                memcpy( bits, other.bits, ArraySize * sizeof( uint ) );
+            }
+            if ( size ) {
+                data = (ushort*)Allocator::alloc( size * sizeof( ushort ),
+                                                  0 );
+                memcpy( data, other.data, size * sizeof( ushort ) );
             }
         }
 
+        // sorted values if kind is Array, pairs of first and last
+        // value if Runs
+        ushort * data;
+        // the bitmap if kind is Bitmap
+        uint * bits;
+
         uint start;
         uint count;
-        uint contents[ArraySize];
+        uint size;
+        uint capacity;
+        Kind kind;
+        bool ranked;
+        // ranks[i] is the number of bits set before word i*WordsPerRank
+        ushort ranks[RankSize];
+
+        bool has( uint o ) const {
+            if ( kind == Bitmap )
+                return bits[o/BitsPerUint] & ( 1 << o%BitsPerUint );
+            uint step = kind == Runs ? 2 : 1;
+            uint lo = 0;
+            uint hi = size / step;
+            while ( lo < hi ) {
+                uint m = ( lo + hi ) / 2;
+                if ( data[m*step+step-1] < o )
+                    lo = m + 1;
+                else
+                    hi = m;
+            }
+            return lo < size / step && data[lo*step] <= o;
+        }
 
-        inline void insert( uint n ) {
-            if ( n < start )
-                return;
-            uint i = n - start;
-            if ( i >= BlockSize )
+        // writes the runs in this block to r and returns the number
+        // of ushorts written
+        uint runs( ushort * r ) const {
+            uint n = 0;
+            if ( kind == Runs ) {
+                memcpy( r, data, size * sizeof( ushort ) );
+                n = size;
+            }
+            else if ( kind == Array ) {
+                uint i = 0;
+                while ( i < size ) {
+                    if ( n && r[n-1] + 1 == data[i] ) {
+                        r[n-1] = data[i];
+                    }
+                    else {
+                        r[n++] = data[i];
+                        r[n++] = data[i];
+                    }
+                    i++;
+                }
+            }
+            else {
+                bool in = false;
+                uint w = 0;
+                while ( w < ArraySize ) {
+                    uint x = bits[w];
+                    if ( ( !x && !in ) || ( x == 0xffffffff && in ) ) {
+                        w++;
+                        continue;
+                    }
+                    uint j = 0;
+                    while ( j < BitsPerUint ) {
+                        bool set = x & ( 1 << j );
+                        if ( set && !in )
+                            r[n++] = w * BitsPerUint + j;
+                        else if ( !set && in )
+                            r[n++] = w * BitsPerUint + j - 1;
+                        in = set;
+                        j++;
+                    }
+                    w++;
+                }
+                if ( in )
+                    r[n++] = BlockSize - 1;
+            }
+            return n;
+        }
+
+        // makes this block contain the n/2 runs in r, using whichever
+        // representation is smallest
+        void setRuns( const ushort * r, uint n ) {
+            uint c = 0;
+            uint i = 0;
+            while ( i < n ) {
+                c += r[i+1] - r[i] + 1;
+                i += 2;
+            }
+            count = c;
+            ranked = false;
+            if ( n <= c && n <= MaxShorts ) {
+                kind = Runs;
+                bits = 0;
+                reserve( n );
+                memcpy( data, r, n * sizeof( ushort ) );
+                size = n;
+            }
+            else if ( c <= MaxShorts ) {
+                kind = Array;
+                bits = 0;
+                reserve( c );
+                size = 0;
+                i = 0;
+                while ( i < n ) {
+                    uint v = r[i];
+                    while ( v <= r[i+1] )
+                        data[size++] = v++;
+                    i += 2;
+                }
+            }
+            else {
+                kind = Bitmap;
+                data = 0;
+                size = 0;
+                capacity = 0;
+                bits = (uint*)Allocator::alloc( ArraySize * sizeof( uint ),
+                                                0 );
+                memset( bits, 0, ArraySize * sizeof( uint ) );
+                count = 0;
+                i = 0;
+                while ( i < n ) {
+                    setBits( r[i], r[i+1], true );
+                    i += 2;
+                }
+            }
+        }
+
+        // makes sure data can hold at least n ushorts
+        void reserve( uint n ) {
+            if ( data && capacity >= n )
                 return;
+            uint c = 4;
+            while ( c < n )
+                c *= 2;
+            ushort * d = (ushort*)Allocator::alloc( c * sizeof( ushort ), 0 );
+            if ( data && size )
+                memcpy( d, data, size * sizeof( ushort ) );
+            data = d;
+            capacity = c;
+        }
+
+        void setBits( uint f, uint l, bool set ) {
+            while ( f <= l ) {
+                uint w = f / BitsPerUint;
+                uint j = f % BitsPerUint;
+                uint m = 0xffffffff << j;
+                uint e = w * BitsPerUint + BitsPerUint - 1;
+                if ( l < e ) {
+                    m &= 0xffffffff >> ( e - l );
+                    e = l;
+                }
+                if ( set ) {
+                    count += bitsSet( m & ~bits[w] );
+                    bits[w] |= m;
+                }
+                else {
+                    count -= bitsSet( m & bits[w] );
+                    bits[w] &= ~m;
+                }
+                f = e + 1;
+            }
+            ranked = false;
+        }
 
-            if ( !(contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) )
+        // adds [f,l] to this block
+        void add( uint f, uint l ) {
+            if ( kind == Bitmap ) {
+                setBits( f, l, true );
+                return;
+            }
+            // the common cases are appending to the end of an array
+            // (unless that makes three in a row, which is a run)...
+            if ( kind == Array && f == l && size < MaxShorts &&
+                 ( !size || data[size-1] < f ) &&
+                 !( size >= 2 && (uint)data[size-2] + 2 == f ) ) {
+                reserve( size + 1 );
+                data[size++] = f;
                 count++;
-            contents[i/BitsPerUint] |= 1 << ( i % BitsPerUint );
+                return;
+            }
+            // ... and extending the last run, or adding a new one
+            // when runs still are no bigger than an array would be
+            if ( kind == Runs && size && (uint)data[size-1] + 1 >= f &&
+                 data[size-2] <= f ) {
+                if ( l > data[size-1] ) {
+                    count += l - data[size-1];
+                    data[size-1] = l;
+                }
+                return;
+            }
+            if ( kind == Runs && size + 2 <= MaxShorts &&
+                 size + 2 <= count + l - f + 1 &&
+                 ( !size || (uint)data[size-1] + 1 < f ) ) {
+                reserve( size + 2 );
+                data[size++] = f;
+                data[size++] = l;
+                count += l - f + 1;
+                return;
+            }
+            uint n = runs( left );
+            right[0] = f;
+            right[1] = l;
+            setRuns( result, combine( Union, left, n, right, 2, result ) );
         }
 
-        void recount() {
-            count = 0;
-            uint i = 0;
-            while ( i < ArraySize )
-                count += bitsSet( contents[i++] );
+        // removes [f,l] from this block
+        void remove( uint f, uint l ) {
+            if ( kind == Bitmap ) {
+                setBits( f, l, false );
+                if ( count < BitmapLimit )
+                    setRuns( left, runs( left ) );
+                return;
+            }
+            uint n = runs( left );
+            right[0] = f;
+            right[1] = l;
+            setRuns( result, combine( Difference, left, n, right, 2, result ) );
+        }
+
+        uint last() const {
+            if ( kind != Bitmap )
+                return data[size-1];
+            uint i = ArraySize - 1;
+            while ( i && !bits[i] )
+                i--;
+            return i * BitsPerUint + BitsPerUint - 1 - __builtin_clz( bits[i] );
         }
 
-        void merge( Block * other ) {
-            count = 0;
+        void recount() {
+            uint c = 0;
             uint i = 0;
             while ( i < ArraySize ) {
-                contents[i] |= other->contents[i];
-                ++i;
+                if ( i % WordsPerRank == 0 )
+                    ranks[i/WordsPerRank] = c;
+                c += bitsSet( bits[i++] );
+            }
+            ranked = true;
+        }
+
+        // returns the number of values up to and including offset o
+        uint rank( uint o ) {
+            if ( kind == Array ) {
+                uint lo = 0;
+                uint hi = size;
+                while ( lo < hi ) {
+                    uint m = ( lo + hi ) / 2;
+                    if ( data[m] <= o )
+                        lo = m + 1;
+                    else
+                        hi = m;
+                }
+                return lo;
+            }
+            if ( kind == Runs ) {
+                uint r = 0;
+                uint i = 0;
+                while ( i < size && data[i] <= o ) {
+                    if ( data[i+1] < o )
+                        r += data[i+1] - data[i] + 1;
+                    else
+                        r += o - data[i] + 1;
+                    i += 2;
+                }
+                return r;
+            }
+            if ( !ranked )
+                recount();
+            uint w = o / BitsPerUint;
+            uint r = ranks[w/WordsPerRank];
+            uint i = w - w % WordsPerRank;
+            while ( i < w )
+                r += bitsSet( bits[i++] );
+            return r + bitsSet( bits[w] &
+                                ~( 0xfffffffe << ( o % BitsPerUint ) ) );
+        }
+
+        // returns the offset of the r'th value, counting from 1
+        uint select( uint r ) {
+            if ( kind == Array )
+                return data[r-1];
+            if ( kind == Runs ) {
+                uint i = 0;
+                while ( r > (uint)( data[i+1] - data[i] + 1 ) ) {
+                    r -= data[i+1] - data[i] + 1;
+                    i += 2;
+                }
+                return data[i] + r - 1;
+            }
+            if ( !ranked )
+                recount();
+            uint c = RankSize - 1;
+            while ( c && ranks[c] >= r )
+                c--;
+            r -= ranks[c];
+            uint w = c * WordsPerRank;
+            uint bs = bitsSet( bits[w] );
+            while ( bs < r ) {
+                r -= bs;
+                w++;
+                bs = bitsSet( bits[w] );
             }
+            return w * BitsPerUint + nthBitSet( bits[w], r );
         }
     };
 
     Map<Block> b;
+
+    // the blocks in order, and the number of values before each,
+    // valid if indexed is true
+    Block ** blocks;
+    uint * before;
+    uint n;
+    uint total;
+    bool indexed;
 };
 
 
+/*! Combines the runs in \a a (\a an ushorts) and \a b (\a bn
+    ushorts) using \a op, writes the resulting runs to \a r and
+    returns the number of ushorts written.
+*/
+
+static uint combine( Operation op,
+                     const ushort * a, uint an,
+                     const ushort * b, uint bn,
+                     ushort * r )
+{
+    uint n = 0;
+    uint i = 0;
+    uint j = 0;
+    if ( op == Union ) {
+        while ( i < an || j < bn ) {
+            uint f, l;
+            if ( j >= bn || ( i < an && a[i] <= b[j] ) ) {
+                f = a[i];
+                l = a[i+1];
+                i += 2;
+            }
+            else {
+                f = b[j];
+                l = b[j+1];
+                j += 2;
+            }
+            if ( n && f <= (uint)r[n-1] + 1 ) {
+                if ( l > r[n-1] )
+                    r[n-1] = l;
+            }
+            else {
+                r[n++] = f;
+                r[n++] = l;
+            }
+        }
+    }
+    else if ( op == Intersection ) {
+        while ( i < an && j < bn ) {
+            uint f = a[i] > b[j] ? a[i] : b[j];
+            uint l = a[i+1] < b[j+1] ? a[i+1] : b[j+1];
+            if ( f <= l ) {
+                r[n++] = f;
+                r[n++] = l;
+            }
+            if ( a[i+1] < b[j+1] )
+                i += 2;
+            else
+                j += 2;
+        }
+    }
+    else {
+        while ( i < an ) {
+            uint f = a[i];
+            uint l = a[i+1];
+            while ( j < bn && b[j+1] < f )
+                j += 2;
+            uint k = j;
+            while ( f <= l && k < bn && b[k] <= l ) {
+                if ( b[k] > f ) {
+                    r[n++] = f;
+                    r[n++] = b[k] - 1;
+                }
+                f = b[k+1] + 1;
+                k += 2;
+            }
+            if ( f <= l ) {
+                r[n++] = f;
+                r[n++] = l;
+            }
+            i += 2;
+        }
+    }
+    return n;
+}
+
+
 /*! \class IntegerSet integerset.h
     This class contains a set of integers.
 
@@ -120,6 +492,11 @@ public:
     members to the set, find its members by value() or index() (sorted
     by size, with 1 first), look for the largest contained number, and
     produce an SQL "where" clause matching its contents.
+
+    The numbers are kept in blocks of 8192. Each block is stored as a
+    sorted array, as a list of runs or as a bitmap, whichever is
+    smallest, so that both long ranges of UIDs and a few scattered
+    UIDs are cheap.
 */
 
 
@@ -177,25 +554,22 @@ void IntegerSet::add( uint n1, uint n2 )
         return;
     }
 
+    d->indexed = false;
     uint n = n1;
-    uint s = n - (n%BlockSize);
-    SetData::Block * b = d->b.find( s );
-    if ( !b ) {
-        b = new SetData::Block( s );
-        d->b.insert( s, b );
-    }
-    b->insert( n );
-    while ( n < n2 ) {
-        ++n;
-        if ( s != n - (n%BlockSize) ) {
-            s = n - (n%BlockSize);
-            b = d->b.find( s );
-            if ( !b ) {
-                b = new SetData::Block( s );
-                d->b.insert( s, b );
-            }
+    while ( n <= n2 ) {
+        uint s = n - (n%BlockSize);
+        SetData::Block * b = d->b.find( s );
+        if ( !b ) {
+            b = new SetData::Block( s );
+            d->b.insert( s, b );
         }
-        b->insert( n );
+        uint l = s + BlockSize - 1;
+        if ( l > n2 )
+            l = n2;
+        b->add( n - s, l - s );
+        if ( l == UINT_MAX )
+            return;
+        n = l + 1;
     }
 }
 
@@ -208,14 +582,29 @@ void IntegerSet::add( const IntegerSet & set )
         *this = set;
         return;
     }
+    d->indexed = false;
     Map<SetData::Block>::Iterator i( set.d->b );
     while( i ) {
         SetData::Block * b = d->b.find( i->start );
-        if ( b )
-            b->merge( i );
-        else
+        if ( !b ) {
             d->b.insert( i->start, new SetData::Block( *i ) );
-
+        }
+        else if ( b->kind == SetData::Block::Bitmap &&
+                  i->kind == SetData::Block::Bitmap ) {
+            uint w = 0;
+            b->count = 0;
+            while ( w < ArraySize ) {
+                b->bits[w] |= i->bits[w];
+                b->count += bitsSet( b->bits[w] );
+                w++;
+            }
+            b->ranked = false;
+        }
+        else {
+            uint n = b->runs( left );
+            uint m = i->runs( right );
+            b->setRuns( result, combine( Union, left, n, right, m, result ) );
+        }
         ++i;
     }
 }
@@ -240,14 +629,7 @@ uint IntegerSet::largest() const
     SetData::Block * b = d->b.last();
     if ( !b )
         return 0;
-    uint i = ArraySize - 1;
-    while ( i && !b->contents[i] )
-        i--;
-    uint x = b->contents[i];
-    uint j = BitsPerUint-1;
-    while ( !(x & 1 << j) )
-        j--;
-    return b->start + i * BitsPerUint + j;
+    return b->start + b->last();
 }
 
 
@@ -255,14 +637,8 @@ uint IntegerSet::largest() const
 
 uint IntegerSet::count() const
 {
-    recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        c += i->count;
-        ++i;
-    }
-    return c;
+    buildIndex();
+    return d->total;
 }
 
 
@@ -285,31 +661,22 @@ uint IntegerSet::value( uint index ) const
 {
     if ( !index )
         return 0;
-    recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i && c + i->count < index ) {
-        c += i->count;
-        ++i;
-    }
-    if ( !i )
+    buildIndex();
+    if ( index > d->total )
         return 0;
 
-    uint bs = bitsSet( i->contents[0] );
-    uint n = 0;
-    while ( c + bs < index ) {
-        c += bs;
-        n++;
-        bs = bitsSet( i->contents[n] );
-    }
-    uint j = 0;
-    while ( c < index && j < BitsPerUint ) {
-        if ( i->contents[n] & ( 1 << j ) )
-            c++;
-        if ( c < index )
-            j++;
+    // find the last block with fewer than index values before it
+    uint lo = 0;
+    uint hi = d->n;
+    while ( hi - lo > 1 ) {
+        uint m = ( lo + hi ) / 2;
+        if ( d->before[m] < index )
+            lo = m;
+        else
+            hi = m;
     }
-    return i->start + n*BitsPerUint + j;
+    SetData::Block * b = d->blocks[lo];
+    return b->start + b->select( index - d->before[lo] );
 }
 
 
@@ -322,29 +689,22 @@ uint IntegerSet::value( uint index ) const
 
 uint IntegerSet::index( uint value ) const
 {
-    recount();
-    uint i = 0;
-    Map<SetData::Block>::Iterator b( d->b );
-    while ( b && b->start + BlockSize - 1 < value ) {
-        i += b->count;
-        ++b;
-    }
-    if ( !b )
-        return 0;
-
-    if ( b->start > value )
-        return 0;
-
-    uint vi = (value-b->start)/BitsPerUint;
-    if ( !(b->contents[vi] & 1 << (value%BitsPerUint)) )
+    if ( !contains( value ) )
         return 0;
-    uint n = 0;
-    while ( n < vi ) {
-        i += bitsSet( b->contents[n] );
-        n++;
+    buildIndex();
+
+    // find the block containing value
+    uint lo = 0;
+    uint hi = d->n;
+    while ( hi - lo > 1 ) {
+        uint m = ( lo + hi ) / 2;
+        if ( d->blocks[m]->start <= value )
+            lo = m;
+        else
+            hi = m;
     }
-    i += bitsSet ( b->contents[vi] & ~( 0xfffffffe << (value%BitsPerUint) ) );
-    return i;
+    SetData::Block * b = d->blocks[lo];
+    return d->before[lo] + b->rank( value - b->start );
 }
 
 
@@ -353,12 +713,9 @@ uint IntegerSet::index( uint value ) const
 bool IntegerSet::contains( uint value ) const
 {
     SetData::Block * b = d->b.find( value - (value%BlockSize) );
-    if ( !b )
+    if ( !b || !b->count )
         return false;
-    uint n = value%BlockSize;
-    if ( b->contents[n/BitsPerUint] & ( 1 << n%BitsPerUint ) )
-        return true;
-    return false;
+    return b->has( value % BlockSize );
 }
 
 
@@ -367,26 +724,7 @@ bool IntegerSet::contains( uint value ) const
 
 void IntegerSet::remove( uint value )
 {
-    SetData::Block * b = d->b.find( value - (value%BlockSize) );
-    if ( !b )
-        return;
-
-    uint i = value - b->start;
-    if ( i >= BlockSize )
-        return;
-
-    if ( ! ( (b->contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) ) )
-        return;
-
-    b->contents[i/BitsPerUint] &= ~(1 << ( i % BitsPerUint ) );
-    if ( b->count ) {
-        b->count--;
-        if ( !b->count )
-            d->b.remove( b->start );
-    }
-    else {
-        recount();
-    }
+    remove( value, value );
 }
 
 
@@ -394,9 +732,28 @@ void IntegerSet::remove( uint value )
 
 void IntegerSet::remove( uint v1, uint v2 )
 {
-    IntegerSet r;
-    r.add( v1, v2 );
-    remove( r );
+    if ( v2 < v1 ) {
+        remove( v2, v1 );
+        return;
+    }
+
+    uint n = v1;
+    while ( n <= v2 ) {
+        uint s = n - (n%BlockSize);
+        uint l = s + BlockSize - 1;
+        if ( l > v2 )
+            l = v2;
+        SetData::Block * b = d->b.find( s );
+        if ( b ) {
+            b->remove( n - s, l - s );
+            d->indexed = false;
+            if ( !b->count )
+                d->b.remove( s );
+        }
+        if ( l == UINT_MAX )
+            return;
+        n = l + 1;
+    }
 }
 
 
@@ -412,20 +769,17 @@ void IntegerSet::remove( const IntegerSet & other )
         if ( mine )
             while ( hers && hers->start < mine->start )
                 ++hers;
-        if ( mine && hers ) {
-            uint i = 0;
-            uint u = 0;
-            uint s = mine->start;
-            while ( i < ArraySize ) {
-                mine->contents[i] &= ~ hers->contents[i];
-                u |= mine->contents[i];
-                i++;
-            }
-            mine->count = 0;
+        if ( mine && hers && mine->start == hers->start ) {
+            SetData::Block * b = mine;
+            uint n = b->runs( left );
+            uint m = hers->runs( right );
+            b->setRuns( result,
+                        combine( Difference, left, n, right, m, result ) );
+            d->indexed = false;
             ++mine;
             ++hers;
-            if ( !u )
-                d->b.remove( s );
+            if ( !b->count )
+                d->b.remove( b->start );
         }
     }
 }
@@ -445,17 +799,15 @@ IntegerSet IntegerSet::intersection( const IntegerSet & other ) const
         if ( mine )
             while ( hers && hers->start < mine->start )
                 ++hers;
-        if ( mine && hers ) {
-            SetData::Block * b = new SetData::Block( mine->start );
-            uint u = 0;
-            uint i = 0;
-            while ( i < ArraySize ) {
-                b->contents[i] = mine->contents[i] & hers->contents[i];
-                u |= b->contents[i];
-                i++;
-            }
-            if ( u )
+        if ( mine && hers && mine->start == hers->start ) {
+            uint n = mine->runs( left );
+            uint m = hers->runs( right );
+            uint k = combine( Intersection, left, n, right, m, result );
+            if ( k ) {
+                SetData::Block * b = new SetData::Block( mine->start );
+                b->setRuns( result, k );
                 r.d->b.insert( b->start, b );
+            }
             ++mine;
             ++hers;
         }
@@ -503,32 +855,24 @@ EString IntegerSet::set() const
 
     Map<SetData::Block>::Iterator it( d->b );
     while ( it ) {
-        uint v = it->start;
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !e ) {
-                            s = v + j;
-                            e = s;
-                        }
-                        else if ( e + 1 < v + j ) {
-                            addRange( r, s, e );
-                            s = v + j;
-                            e = s;
-                        }
-                        else {
-                            e = v + j;
-                        }
-                    }
-                    j++;
-                }
+        uint n = it->runs( left );
+        uint i = 0;
+        while ( i < n ) {
+            uint f = it->start + left[i];
+            uint l = it->start + left[i+1];
+            if ( !e ) {
+                s = f;
+                e = l;
+            }
+            else if ( e + 1 < f ) {
+                addRange( r, s, e );
+                s = f;
+                e = l;
             }
-            n++;
-            v += BitsPerUint;
+            else {
+                e = l;
+            }
+            i += 2;
         }
         ++it;
     }
@@ -549,21 +893,18 @@ EString IntegerSet::csl() const
 
     Map<SetData::Block>::Iterator it( d->b );
     while ( it ) {
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !r.isEmpty() )
-                            r.append( ',' );
-                        r.appendNumber( it->start + n * BitsPerUint + j );
-                    }
-                    j++;
-                }
+        uint n = it->runs( left );
+        uint i = 0;
+        while ( i < n ) {
+            uint v = it->start + left[i];
+            uint l = it->start + left[i+1];
+            while ( v <= l ) {
+                if ( !r.isEmpty() )
+                    r.append( ',' );
+                r.appendNumber( v );
+                v++;
             }
-            n++;
+            i += 2;
         }
         ++it;
     }
@@ -571,9 +912,7 @@ EString IntegerSet::csl() const
 }
 
 
-/*! This private helper ensures that all blocks have an accurate count
-    of set bits, and that no blocks are empty.
-*/
+/*! This private helper ensures that no blocks are empty. */
 
 void IntegerSet::recount() const
 {
@@ -581,14 +920,50 @@ void IntegerSet::recount() const
     while ( i ) {
         SetData::Block * b = i;
         ++i;
-        if ( !b->count )
-            b->recount();
-        if ( !b->count )
+        if ( !b->count ) {
             d->b.remove( b->start );
+            d->indexed = false;
+        }
     }
 }
 
 
+/*! This private helper makes sure that the set has an index of its
+    blocks, recording how many values precede each block, so that
+    value() and index() can find the right block by binary search
+    instead of counting from the start. Any change to the set
+    invalidates the index.
+*/
+
+void IntegerSet::buildIndex() const
+{
+    if ( d->indexed )
+        return;
+    recount();
+
+    uint n = d->b.count();
+    if ( n > d->n || !d->blocks ) {
+        d->blocks = (SetData::Block **)
+                    Allocator::alloc( ( n + 1 ) * sizeof( SetData::Block * ) );
+        d->before = (uint *)Allocator::alloc( ( n + 1 ) * sizeof( uint ), 0 );
+    }
+
+    uint c = 0;
+    uint i = 0;
+    Map<SetData::Block>::Iterator b( d->b );
+    while ( b ) {
+        d->blocks[i] = b;
+        d->before[i] = c;
+        c += b->count;
+        ++i;
+        ++b;
+    }
+    d->n = i;
+    d->total = c;
+    d->indexed = true;
+}
+
+
 /*! Returns true if this set contains all values in \a other, and
     false if not.
 */
@@ -598,20 +973,22 @@ bool IntegerSet::contains( const IntegerSet & other ) const
     Map<SetData::Block>::Iterator m( d->b );
     Map<SetData::Block>::Iterator h( other.d->b );
     while ( h ) {
+        if ( !h->count ) {
+            ++h;
+            continue;
+        }
         while ( m && m->start < h->start )
             ++m;
         if ( !m )
             return false;
         if ( h->start < m->start )
             return false;
-        if ( h->count && m->count && h->count > m->count )
+        if ( h->count > m->count )
+            return false;
+        uint n = h->runs( left );
+        uint k = m->runs( right );
+        if ( combine( Difference, left, n, right, k, result ) )
             return false;
-        uint i = 0;
-        while ( i < ArraySize ) {
-            if ( ( m->contents[i] & h->contents[i] ) != h->contents[i] )
-                return false;
-            i++;
-        }
         ++h;
     }
     return true;
@@ -43,6 +43,7 @@ public:
 private:
     class SetData * d;
     void recount() const;
+    void buildIndex() const;
 };
 
 
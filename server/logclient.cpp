@@ -20,23 +20,32 @@
 #include <syslog.h>
 
 
-/* This static function returns a nicely-formatted timestamp. */
+/* This static function appends a nicely-formatted timestamp to \a t.
+   localtime() and the formatting are only redone when the second
+   changes, since most log lines share theirs with the previous one.
+*/
 
-static EString time()
+static void appendTime( EString & t )
 {
     struct timeval tv;
-    struct timezone tz;
-    if ( ::gettimeofday( &tv, &tz ) < 0 )
-        return "";
-    struct tm * t = localtime( (const time_t *)&tv.tv_sec );
-
-    // yuck.
-    char result[512];
-    snprintf( result, 511, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
-              t->tm_year + 1900, t->tm_mon+1, t->tm_mday,
-              t->tm_hour, t->tm_min, t->tm_sec,
-              (int)tv.tv_usec/1000 );
-    return result;
+    if ( ::gettimeofday( &tv, 0 ) < 0 )
+        return;
+
+    static time_t second = 0;
+    static char prefix[64];
+    if ( tv.tv_sec != second ) {
+        struct tm * l = localtime( (const time_t *)&tv.tv_sec );
+        snprintf( prefix, 63, "%04d-%02d-%02d %02d:%02d:%02d.",
+                  l->tm_year + 1900, l->tm_mon+1, l->tm_mday,
+                  l->tm_hour, l->tm_min, l->tm_sec );
+        second = tv.tv_sec;
+    }
+
+    uint ms = tv.tv_usec / 1000;
+    t.append( prefix );
+    t.append( (char)( '0' + ms / 100 ) );
+    t.append( (char)( '0' + ms / 10 % 10 ) );
+    t.append( (char)( '0' + ms % 10 ) );
 }
 
 
@@ -143,7 +152,7 @@ void LogClient::send( const EString &id, Log::Severity s, const EString & m )
     t.append( " x/" );
     t.append( Log::severity( s ) );
     t.append( " " );
-    t.append( time() );
+    appendTime( t );
     t.append( " " );
     t.append( m.simplified() );
     t.append( "\r\n" );
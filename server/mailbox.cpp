@@ -81,7 +81,7 @@ public:
     Query * q;
     bool done;
 
-    MailboxReader( EventHandler * ev, int64 );
+    MailboxReader( EventHandler * ev, const IntegerSet & );
     void execute();
 };
 
@@ -89,7 +89,11 @@ public:
 static List<MailboxReader> * readers = 0;
 
 
-MailboxReader::MailboxReader( EventHandler * ev, int64 c )
+/*! Reads the mailboxes in \a ids, or the entire mailboxes table if
+    \a ids is empty, and notifies \a ev when done.
+*/
+
+MailboxReader::MailboxReader( EventHandler * ev, const IntegerSet & ids )
     : owner( ev ), q( 0 ), done( false )
 {
     if ( !::readers ) {
@@ -97,13 +101,14 @@ MailboxReader::MailboxReader( EventHandler * ev, int64 c )
         Allocator::addEternal( ::readers, "active mailbox readers" );
     }
     ::readers->append( this );
-    q = new Query( "select m.id, m.name, m.deleted, m.owner, "
-                   "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag "
-                   //"m.change " // better: m.change
-                   "from mailboxes m ",
-                   //"where change>=$1"
-                   this );
-    c = c; //query->bind( 1, c );
+    EString s( "select m.id, m.name, m.deleted, m.owner, "
+               "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag "
+               "from mailboxes m" );
+    if ( !ids.isEmpty() )
+        s.append( " where m.id=any($1)" );
+    q = new Query( s, this );
+    if ( !ids.isEmpty() )
+        q->bind( 1, ids );
     if ( !::mailboxes )
         Mailbox::setup();
 }
@@ -170,13 +175,27 @@ class MailboxesWatcher
     : public EventHandler
 {
 public:
-    MailboxesWatcher(): EventHandler(), t( 0 ), m( 0 ) {
-        (void)new DatabaseSignal( "mailboxes_updated", this );
+    MailboxesWatcher()
+        : EventHandler(), t( 0 ), m( 0 ),
+          payloads( new EStringList ), all( false ) {
+        (void)new DatabaseSignal( "mailboxes_updated", this, payloads );
     }
     void execute() {
         if ( EventLoop::global()->inShutdown() )
             return;
 
+        // the trigger on mailboxes sends the id of each changed row;
+        // a plain notify means we have to reread everything.
+        while ( !payloads->isEmpty() ) {
+            EString * p = payloads->shift();
+            bool ok = false;
+            uint id = p->number( &ok );
+            if ( ok && id )
+                ids.add( id );
+            else
+                all = true;
+        }
+
         if ( !t ) {
             // use a timer to run only one mailboxreader per 2-3
             // seconds.
@@ -193,12 +212,21 @@ public:
         else {
             // time's out, time to work
             t = 0;
-            m = new MailboxReader( 0, 0 );
+            if ( !all && ids.isEmpty() )
+                return;
+            if ( all )
+                ids.clear();
+            m = new MailboxReader( 0, ids );
             m->q->execute();
+            ids.clear();
+            all = false;
         }
     }
     Timer * t;
     MailboxReader * m;
+    EStringList * payloads;
+    IntegerSet ids;
+    bool all;
 };
 
 
@@ -219,7 +247,7 @@ public:
             ::mailboxesByName->clear();
             ::wiped = true;
             (void)Mailbox::root();
-            mr = new MailboxReader( this, 0 );
+            mr = new MailboxReader( this, IntegerSet() );
             mr->q->execute();
         }
 
@@ -251,7 +279,7 @@ void Mailbox::setup( EventHandler * owner )
     (void)root();
 
     Scope x( new Log );
-    (new MailboxReader( owner, 0 ))->q->execute();
+    (new MailboxReader( owner, IntegerSet() ))->q->execute();
 
     (void)new MailboxesWatcher;
     if ( !Configuration::toggle( Configuration::Security ) )
@@ -641,8 +669,6 @@ Query * Mailbox::create( Transaction * t, User * owner )
         m = m->parent();
     }
 
-    t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
-
     return q;
 }
 
@@ -667,8 +693,6 @@ Query * Mailbox::remove( Transaction * t )
     q->bind( 1, id() );
     t->enqueue( q );
 
-    t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
-
     return q;
 }
 
@@ -678,12 +702,27 @@ Query * Mailbox::remove( Transaction * t )
 */
 
 void Mailbox::refreshMailboxes( class Transaction * t )
+{
+    refreshMailboxes( t, IntegerSet() );
+}
+
+
+/*! \overload
+
+    If \a ids is nonempty, only those mailboxes are reread, so callers
+    that know which mailboxes \a t changed should pass their ids.
+    Otherwise the entire table is reread. Other servers learn of the
+    changes from the trigger on mailboxes, which notifies them when
+    \a t is committed.
+*/
+
+void Mailbox::refreshMailboxes( class Transaction * t,
+                                const IntegerSet & ids )
 {
     Scope x( new Log );
-    MailboxReader * mr = new MailboxReader( 0, 0 );
+    MailboxReader * mr = new MailboxReader( 0, ids );
     Transaction * s = t->subTransaction( mr );
     s->enqueue( mr->q );
-    s->enqueue( new Query( "notify mailboxes_updated", 0 ) );
     s->execute();
 }
 
@@ -71,6 +71,7 @@ public:
     Query * create( class Transaction *, class User * );
     Query * remove( class Transaction * );
     static void refreshMailboxes( class Transaction * );
+    static void refreshMailboxes( class Transaction *, const IntegerSet & );
 
     void abortSessions();
     List<class Session> * sessions() const;
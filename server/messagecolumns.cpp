@@ -0,0 +1,321 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "messagecolumns.h"
+
+#include "allocator.h"
+
+#include <string.h> // memcpy, memmove
+
+
+class MessageColumnsData
+    : public Garbage
+{
+public:
+    MessageColumnsData()
+        : n( 0 ), capacity( 0 ),
+          uid( 0 ), modseq( 0 ), idate( 0 ), size( 0 ),
+          slots( 0 ), flags( 0 )
+    {}
+
+    uint n;
+    uint capacity;
+    uint * uid;
+    int64 * modseq;
+    uint * idate;
+    uint * size;
+
+    IntegerSet uids;
+
+    uint slots;
+    IntegerSet ** flags;
+};
+
+
+/*! \class MessageColumns messagecolumns.h
+
+    The MessageColumns class keeps the metadata of the messages in a
+    Session in RAM, one array per column, sorted by UID. The columns
+    are the UID, modseq, internaldate and RFC822 size, and for each
+    flag, the set of messages that have it.
+
+    The SessionInitialiser fills it in when the Session is created and
+    keeps it current along with the rest of the Session. Search uses
+    it to evaluate most flag, size, date, UID and modseq searches by
+    scanning the arrays instead of asking the database.
+*/
+
+
+/*! Constructs an empty MessageColumns object, or if \a other is
+    non-null, a copy of \a other.
+*/
+
+MessageColumns::MessageColumns( const MessageColumns * other )
+    : Garbage(), d( new MessageColumnsData )
+{
+    if ( !other || !other->d->n )
+        return;
+
+    reserve( other->d->n );
+    d->n = other->d->n;
+    memcpy( d->uid, other->d->uid, d->n * sizeof( uint ) );
+    memcpy( d->modseq, other->d->modseq, d->n * sizeof( int64 ) );
+    memcpy( d->idate, other->d->idate, d->n * sizeof( uint ) );
+    memcpy( d->size, other->d->size, d->n * sizeof( uint ) );
+    d->uids = other->d->uids;
+
+    uint i = 0;
+    while ( i < other->d->slots ) {
+        if ( other->d->flags[i] ) {
+            setFlag( 0, i );
+            *d->flags[i] = *other->d->flags[i];
+        }
+        i++;
+    }
+}
+
+
+/*! Records that the message \a uid has modseq \a modseq, internaldate
+    \a idate and RFC822 size \a size. If \a uid is already present, it
+    is updated and loses all its flags, so the caller must call
+    setFlag() for each flag it has now.
+*/
+
+void MessageColumns::set( uint uid, int64 modseq, uint idate, uint size )
+{
+    uint p = d->n;
+    if ( d->n && uid <= d->uid[d->n-1] ) {
+        p = position( uid );
+        if ( d->uid[p] == uid ) {
+            d->modseq[p] = modseq;
+            d->idate[p] = idate;
+            d->size[p] = size;
+            uint i = 0;
+            while ( i < d->slots ) {
+                if ( d->flags[i] )
+                    d->flags[i]->remove( uid );
+                i++;
+            }
+            return;
+        }
+    }
+
+    reserve( 1 );
+    if ( p < d->n ) {
+        uint m = d->n - p;
+        memmove( d->uid + p + 1, d->uid + p, m * sizeof( uint ) );
+        memmove( d->modseq + p + 1, d->modseq + p, m * sizeof( int64 ) );
+        memmove( d->idate + p + 1, d->idate + p, m * sizeof( uint ) );
+        memmove( d->size + p + 1, d->size + p, m * sizeof( uint ) );
+    }
+    d->uid[p] = uid;
+    d->modseq[p] = modseq;
+    d->idate[p] = idate;
+    d->size[p] = size;
+    d->n++;
+    d->uids.add( uid );
+}
+
+
+/*! Records that the message \a uid has the flag whose id is \a
+    flag. If \a uid is 0, this function only makes room for \a flag.
+*/
+
+void MessageColumns::setFlag( uint uid, uint flag )
+{
+    if ( flag >= d->slots ) {
+        uint slots = d->slots * 2;
+        if ( slots <= flag )
+            slots = flag + 16;
+        IntegerSet ** flags
+            = (IntegerSet**)Allocator::alloc( slots * sizeof( IntegerSet* ) );
+        uint i = 0;
+        while ( i < slots ) {
+            flags[i] = i < d->slots ? d->flags[i] : 0;
+            i++;
+        }
+        d->flags = flags;
+        d->slots = slots;
+    }
+    if ( !d->flags[flag] )
+        d->flags[flag] = new IntegerSet;
+    if ( uid )
+        d->flags[flag]->add( uid );
+}
+
+
+/*! Removes the messages in \a uids, which have been expunged. */
+
+void MessageColumns::remove( const IntegerSet & uids )
+{
+    IntegerSet gone( d->uids.intersection( uids ) );
+    if ( gone.isEmpty() )
+        return;
+
+    uint i = 0;
+    uint j = 0;
+    while ( i < d->n ) {
+        if ( !gone.contains( d->uid[i] ) ) {
+            d->uid[j] = d->uid[i];
+            d->modseq[j] = d->modseq[i];
+            d->idate[j] = d->idate[i];
+            d->size[j] = d->size[i];
+            j++;
+        }
+        i++;
+    }
+    d->n = j;
+    d->uids.remove( gone );
+
+    i = 0;
+    while ( i < d->slots ) {
+        if ( d->flags[i] )
+            d->flags[i]->remove( gone );
+        i++;
+    }
+}
+
+
+/*! Returns the number of messages recorded. */
+
+uint MessageColumns::count() const
+{
+    return d->n;
+}
+
+
+/*! Returns the UIDs of all the messages recorded. */
+
+const IntegerSet & MessageColumns::uids() const
+{
+    return d->uids;
+}
+
+
+/*! Returns the modseq of \a uid, or 0 if \a uid isn't known. */
+
+int64 MessageColumns::modseq( uint uid ) const
+{
+    if ( !d->uids.contains( uid ) )
+        return 0;
+    return d->modseq[position( uid )];
+}
+
+
+/*! Returns the UIDs of the messages that have the flag whose id is
+    \a flag.
+*/
+
+IntegerSet MessageColumns::flagged( uint flag ) const
+{
+    if ( flag < d->slots && d->flags[flag] )
+        return *d->flags[flag];
+    return IntegerSet();
+}
+
+
+// Returns the uid[i] for which column[i] is between min and max
+// inclusive. Runs of consecutive UIDs are added in one call.
+
+template<class T>
+static IntegerSet scan( const uint * uid, const T * column, uint n,
+                        T min, T max )
+{
+    IntegerSet r;
+    uint i = 0;
+    while ( i < n ) {
+        while ( i < n && ( column[i] < min || column[i] > max ) )
+            i++;
+        if ( i >= n )
+            break;
+        uint first = uid[i];
+        uint last = first;
+        i++;
+        while ( i < n && uid[i] == last + 1 &&
+                column[i] >= min && column[i] <= max ) {
+            last = uid[i];
+            i++;
+        }
+        r.add( first, last );
+    }
+    return r;
+}
+
+
+/*! Returns the UIDs of the messages whose modseq is at least \a min
+    and at most \a max.
+*/
+
+IntegerSet MessageColumns::modseqs( int64 min, int64 max ) const
+{
+    return scan( d->uid, d->modseq, d->n, min, max );
+}
+
+
+/*! Returns the UIDs of the messages whose internaldate is at least \a
+    min and at most \a max.
+*/
+
+IntegerSet MessageColumns::internalDates( uint min, uint max ) const
+{
+    return scan( d->uid, d->idate, d->n, min, max );
+}
+
+
+/*! Returns the UIDs of the messages whose RFC822 size is at least \a
+    min and at most \a max.
+*/
+
+IntegerSet MessageColumns::sizes( uint min, uint max ) const
+{
+    return scan( d->uid, d->size, d->n, min, max );
+}
+
+
+/*! Returns the position of the first message whose UID is at least \a
+    uid, or count() if there is none.
+*/
+
+uint MessageColumns::position( uint uid ) const
+{
+    uint b = 0;
+    uint e = d->n;
+    while ( b < e ) {
+        uint m = ( b + e ) / 2;
+        if ( d->uid[m] < uid )
+            b = m + 1;
+        else
+            e = m;
+    }
+    return b;
+}
+
+
+/*! Makes sure there's room for at least \a more messages. */
+
+void MessageColumns::reserve( uint more )
+{
+    if ( d->n + more <= d->capacity )
+        return;
+
+    uint c = d->capacity * 2;
+    if ( c < d->n + more )
+        c = d->n + more;
+    if ( c < 64 )
+        c = 64;
+
+    uint * uid = (uint*)Allocator::alloc( c * sizeof( uint ), 0 );
+    int64 * modseq = (int64*)Allocator::alloc( c * sizeof( int64 ), 0 );
+    uint * idate = (uint*)Allocator::alloc( c * sizeof( uint ), 0 );
+    uint * size = (uint*)Allocator::alloc( c * sizeof( uint ), 0 );
+    if ( d->n ) {
+        memcpy( uid, d->uid, d->n * sizeof( uint ) );
+        memcpy( modseq, d->modseq, d->n * sizeof( int64 ) );
+        memcpy( idate, d->idate, d->n * sizeof( uint ) );
+        memcpy( size, d->size, d->n * sizeof( uint ) );
+    }
+    d->uid = uid;
+    d->modseq = modseq;
+    d->idate = idate;
+    d->size = size;
+    d->capacity = c;
+}
@@ -0,0 +1,38 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MESSAGECOLUMNS_H
+#define MESSAGECOLUMNS_H
+
+#include "global.h"
+#include "integerset.h"
+
+
+class MessageColumns
+    : public Garbage
+{
+public:
+    MessageColumns( const MessageColumns * = 0 );
+
+    void set( uint, int64, uint, uint );
+    void setFlag( uint, uint );
+    void remove( const IntegerSet & );
+
+    uint count() const;
+    const IntegerSet & uids() const;
+
+    int64 modseq( uint ) const;
+
+    IntegerSet flagged( uint ) const;
+    IntegerSet modseqs( int64, int64 ) const;
+    IntegerSet internalDates( uint, uint ) const;
+    IntegerSet sizes( uint, uint ) const;
+
+private:
+    class MessageColumnsData * d;
+
+    uint position( uint ) const;
+    void reserve( uint );
+};
+
+
+#endif
@@ -13,16 +13,19 @@
 #include "allocator.h"
 #include "estringlist.h"
 #include "configuration.h"
+#include "messagecolumns.h"
 #include "transaction.h"
 #include "annotation.h"
 #include "dbsignal.h"
 #include "field.h"
 #include "user.h"
 
+#include <limits.h> // LLONG_MAX
 #include <time.h> // whereAge() calls time()
 
 
 static bool tsearchAvailable = false;
+static bool headerTsearchAvailable = false;
 static bool retunerCreated = false;
 
 static EString * tsconfig;
@@ -34,33 +37,45 @@ class TuningDetector
 public:
     TuningDetector(): q( 0 ) {
         ::tsearchAvailable = false;
+        ::headerTsearchAvailable = false;
         q = new Query(
-            "select indexdef from pg_indexes where "
-            "indexdef ilike '% USING gin (to_tsvector%'"
-            "and tablename='bodyparts' and schemaname=$1",
+            "select tablename::text, indexdef from pg_indexes where "
+            "indexdef ilike '% USING gin (to_tsvector%' "
+            "and tablename in ('bodyparts','header_fields') "
+            "and schemaname=$1",
             this
         );
         q->bind( 1, Configuration::text( Configuration::DbSchema ) );
         q->execute();
     }
     void execute() {
-        if ( !q->done() )
-            return;
-        ::tsearchAvailable = q->hasResults();
-        Row * r = q->nextRow();
-        if ( r ) {
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
             EString def( r->getEString( "indexdef" ) );
+            bool body = r->getEString( "tablename" ) == "bodyparts";
 
-            uint n = 12 + def.find( "to_tsvector(" );
-            def = def.mid( n, def.length()-n-1 ).section( ",", 1 );
+            // an index on only some header fields (such as the old
+            // hf_subject) doesn't help whereHeaderField() in general.
+            if ( !body && def.contains( "field = " ) )
+                continue;
 
-            if ( def[0] == '\'' && def.endsWith( "::regconfig" ) ) {
+            uint n = 12 + def.find( "to_tsvector(" );
+            def = def.mid( n ).section( ")", 1 ).section( ",", 1 );
+
+            // both indices must use the same configuration, since
+            // matchTsvector() only knows one.
+            if ( def[0] != '\'' || !def.endsWith( "::regconfig" ) ||
+                 ( tsconfig && *tsconfig != def &&
+                   ( ::tsearchAvailable || ::headerTsearchAvailable ) ) )
+                continue;
+            if ( !tsconfig || *tsconfig != def ) {
                 tsconfig = new EString( def );
                 Allocator::addEternal( tsconfig, "tsearch configuration" );
             }
-            else {
-                ::tsearchAvailable = false;
-            }
+            if ( body )
+                ::tsearchAvailable = true;
+            else
+                ::headerTsearchAvailable = true;
         }
     }
     Query * q;
@@ -771,6 +786,24 @@ EString Selector::where()
     return "";
 }
 
+
+// Sets *first and *last to the first and last second of the day
+// named by the IMAP date s. The local time zone is ignored.
+
+static void dayRange( const EString & s, uint * first, uint * last )
+{
+    uint day = s.mid( 0, 2 ).number( 0 );
+    EString month = s.mid( 3, 3 );
+    uint year = s.mid( 7 ).number( 0 );
+    Date d1;
+    d1.setDate( year, month, day, 0, 0, 0, 0 );
+    Date d2;
+    d2.setDate( year, month, day, 23, 59, 59, 0 );
+    *first = d1.unixTime();
+    *last = d2.unixTime();
+}
+
+
 /*! This implements the INTERNALDATE part of where().
 */
 
@@ -778,31 +811,26 @@ EString Selector::whereInternalDate()
 {
     root()->d->needMessages = true;
 
-    uint day = d->s8.mid( 0, 2 ).number( 0 );
-    EString month = d->s8.mid( 3, 3 );
-    uint year = d->s8.mid( 7 ).number( 0 );
-    // XXX: local time zone is ignored here
-    Date d1;
-    d1.setDate( year, month, day, 0, 0, 0, 0 );
-    Date d2;
-    d2.setDate( year, month, day, 23, 59, 59, 0 );
+    uint first = 0;
+    uint last = 0;
+    dayRange( d->s8, &first, &last );
 
     if ( d->a == OnDate ) {
         uint n1 = placeHolder();
-        root()->d->query->bind( n1, d1.unixTime() );
+        root()->d->query->bind( n1, first );
         uint n2 = placeHolder();
-        root()->d->query->bind( n2, d2.unixTime() );
+        root()->d->query->bind( n2, last );
         return "(" + m() + ".idate>=$" + fn( n1 ) +
             " and " + m() + ".idate<=$" + fn( n2 ) + ")";
     }
     else if ( d->a == SinceDate ) {
         uint n1 = placeHolder();
-        root()->d->query->bind( n1, d1.unixTime() );
+        root()->d->query->bind( n1, first );
         return m() +".idate>=$" + fn( n1 );
     }
     else if ( d->a == BeforeDate ) {
         uint n2 = placeHolder();
-        root()->d->query->bind( n2, d2.unixTime() );
+        root()->d->query->bind( n2, last );
         return m() + ".idate<=$" + fn( n2 );
     }
 
@@ -875,6 +903,9 @@ static EString q( const UString & orig )
 }
 
 
+// The condition repeats the expression and predicate of the b_text
+// and hf_text indices exactly, so that the planner can use them.
+
 static EString matchTsvector( const EString & col, uint n )
 {
     EString s( "octet_length(" );
@@ -883,7 +914,9 @@ static EString matchTsvector( const EString & col, uint n )
     s.append( *tsconfig );
     s.append( ", " );
     s.append( col );
-    s.append( ") @@ plainto_tsquery($" );
+    s.append( ") @@ plainto_tsquery(" );
+    s.append( *tsconfig );
+    s.append( ", $" );
     s.appendNumber( n );
     s.append( ")" );
     return s;
@@ -938,8 +971,7 @@ EString Selector::whereHeaderField()
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and hf" + jn + ".value=$" + fn( like ) );
     }
-    else if ( t == HeaderField::Subject &&
-              ::tsearchAvailable && sensibleWords( d->s16 ) ) {
+    else if ( ::headerTsearchAvailable && sensibleWords( d->s16 ) ) {
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and (" + matchTsvector( "hf" + jn + ".value", like ) + " "
                   "and hf" + jn + ".value ilike " + matchAny( like ) + ")" );
@@ -2062,6 +2094,127 @@ Selector::MatchResult Selector::match( Session * s, uint uid )
 }
 
 
+/*! Evaluates this condition for all the messages in \a s at once,
+    using the Session's MessageColumns, and stores the matching UIDs
+    in \a result. Returns true if this works, and false if the
+    condition needs something only the database has, in which case
+    \a result is left empty.
+
+    Also returns false if \a s isn't Session::initialised(), ie. if
+    the Mailbox has seen new messages or modseqs that \a s hasn't
+    caught up with yet, since the columns lag the database then.
+*/
+
+bool Selector::evaluate( Session * s, IntegerSet & result )
+{
+    result.clear();
+    if ( !s->initialised() )
+        return false;
+    MessageColumns * c = s->columns();
+    if ( !c )
+        return false;
+    IntegerSet all( s->messages().intersection( c->uids() ) );
+    if ( evaluate( s, all, result ) )
+        return true;
+    result.clear();
+    return false;
+}
+
+
+/*! This private helper evaluates this condition for the messages in
+    \a all and stores the matching UIDs in \a result. Returns false if
+    that can't be done without the database.
+*/
+
+bool Selector::evaluate( Session * s, const IntegerSet & all,
+                         IntegerSet & result )
+{
+    MessageColumns * c = s->columns();
+
+    if ( d->a == And || d->a == Or ) {
+        result = d->a == And ? all : IntegerSet();
+        List< Selector >::Iterator i( d->children );
+        while ( i ) {
+            IntegerSet sub;
+            if ( !i->evaluate( s, all, sub ) )
+                return false;
+            if ( d->a == And )
+                result = result.intersection( sub );
+            else
+                result.add( sub );
+            ++i;
+        }
+        return true;
+    }
+    else if ( d->a == Not ) {
+        IntegerSet sub;
+        if ( !d->children->first()->evaluate( s, all, sub ) )
+            return false;
+        result = all;
+        result.remove( sub );
+        return true;
+    }
+    else if ( d->a == All ) {
+        result = all;
+        return true;
+    }
+    else if ( d->a == Contains && d->f == Uid ) {
+        result = all.intersection( d->s );
+        return true;
+    }
+    else if ( d->a == Contains && d->f == Flags ) {
+        if ( d->s8 == "\\recent" ) {
+            result = all.intersection( s->recent() );
+            return true;
+        }
+        uint fid = Flag::id( d->s8 );
+        if ( !fid )
+            return false;
+        result = all.intersection( c->flagged( fid ) );
+        return true;
+    }
+    else if ( d->f == Modseq && ( d->a == Larger || d->a == Smaller ) ) {
+        if ( d->a == Larger )
+            result = c->modseqs( d->n, LLONG_MAX );
+        else if ( d->n > 0 )
+            result = c->modseqs( 0, d->n - 1 );
+        result = all.intersection( result );
+        return true;
+    }
+    else if ( d->f == Rfc822Size && ( d->a == Larger || d->a == Smaller ) ) {
+        if ( d->a == Larger && d->n < UINT_MAX )
+            result = c->sizes( d->n + 1, UINT_MAX );
+        else if ( d->a == Smaller && d->n > 0 )
+            result = c->sizes( 0, d->n - 1 );
+        result = all.intersection( result );
+        return true;
+    }
+    else if ( d->f == InternalDate &&
+              ( d->a == OnDate || d->a == SinceDate || d->a == BeforeDate ) ) {
+        uint first = 0;
+        uint last = 0;
+        dayRange( d->s8, &first, &last );
+        if ( d->a == SinceDate )
+            last = UINT_MAX;
+        else if ( d->a == BeforeDate )
+            first = 0;
+        result = all.intersection( c->internalDates( first, last ) );
+        return true;
+    }
+    else if ( d->f == Age && ( d->a == Larger || d->a == Smaller ) ) {
+        uint t = (uint)::time( 0 ) - d->n;
+        if ( d->a == Larger )
+            result = c->internalDates( 0, t );
+        else
+            result = c->internalDates( t, UINT_MAX );
+        result = all.intersection( result );
+        return true;
+    }
+
+    return false;
+}
+
+
 /*! Returns true if this condition needs an updated Session to be
     correctly evaluated, and false if not.
 */
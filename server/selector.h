@@ -72,6 +72,7 @@ public:
         Punt // really "ThrowHandsUpInAirAndDespair"
     };
     MatchResult match( class Session *, uint );
+    bool evaluate( class Session *, IntegerSet & );
 
     EString string();
 
@@ -119,6 +120,8 @@ private:
     EString m();
 
     EString whereSet( const IntegerSet & );
+
+    bool evaluate( class Session *, const IntegerSet &, IntegerSet & );
 };
 
 
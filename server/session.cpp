@@ -3,6 +3,7 @@
 #include "session.h"
 
 #include "transaction.h"
+#include "messagecolumns.h"
 #include "integerset.h"
 #include "allocator.h"
 #include "selector.h"
@@ -24,7 +25,7 @@ public:
         : readOnly( true ),
           mailbox( 0 ),
           uidnext( 1 ), nextModSeq( 1 ),
-          permissions( 0 )
+          permissions( 0 ), columns( 0 )
     {}
 
     bool readOnly;
@@ -36,6 +37,7 @@ public:
     int64 nextModSeq;
     Permissions * permissions;
     IntegerSet unannounced;
+    MessageColumns * columns;
 };
 
 
@@ -65,6 +67,7 @@ Session::Session( Mailbox * m, bool readOnly )
         d->msns.add( other->d->unannounced );
         d->msns.remove( other->d->expunges );
     }
+    d->columns = new MessageColumns( other ? other->d->columns : 0 );
     (void)new SessionInitialiser( m, 0, this );
 }
 
@@ -270,6 +273,7 @@ void Session::addRecent( uint start, uint num )
 void Session::expunge( const IntegerSet & uids )
 {
     d->expunges.add( uids );
+    d->columns->remove( uids );
 }
 
 
@@ -299,7 +303,7 @@ class SessionInitialiserData
 public:
     SessionInitialiserData()
         : mailbox( 0 ),
-          t( 0 ), recent( 0 ), messages( 0 ), expunges( 0 ),
+          t( 0 ), recent( 0 ), messages( 0 ), flags( 0 ), expunges( 0 ),
           also( 0 ),
           oldUidnext( 0 ), newUidnext( 0 ),
           state( NoTransaction ),
@@ -312,6 +316,7 @@ public:
     Transaction * t;
     Query * recent;
     Query * messages;
+    Query * flags;
     Query * expunges;
 
     Session * also;
@@ -387,8 +392,9 @@ void SessionInitialiser::execute()
             break;
         case SessionInitialiserData::ReceivingChanges:
             recordMailboxChanges();
+            recordFlags();
             recordExpunges();
-            if ( d->messages->done() &&
+            if ( d->messages->done() && d->flags->done() &&
                  ( !d->expunges || d->expunges->done() ) )
                 d->state = SessionInitialiserData::Updated;
             break;
@@ -557,22 +563,40 @@ void SessionInitialiser::findMailboxChanges()
     bool initialising = false;
     if ( d->oldUidnext <= 1 )
         initialising = true;
-    EString msgs = "select mm.uid, mm.modseq from mailbox_messages mm "
-                  "where mm.mailbox=$1 and mm.uid<$2";
+    EString msgs = "select mm.uid, mm.modseq, mm.seen, mm.deleted, "
+                   "m.idate, m.rfc822size "
+                   "from mailbox_messages mm "
+                   "join messages m on (mm.message=m.id) "
+                   "where mm.mailbox=$1 and mm.uid<$2";
+    EString flags = "select f.uid, f.flag from flags f ";
+    if ( !initialising )
+        flags.append( "join mailbox_messages mm "
+                      "on (f.mailbox=mm.mailbox and f.uid=mm.uid) " );
+    flags.append( "where f.mailbox=$1 and f.uid<$2" );
 
     // if we know we'll see one new modseq and at least one new
     // message, we could skip the test on mm.modseq.
-    if ( !initialising )
+    if ( !initialising ) {
         msgs.append( " and (mm.uid>=$3 or mm.modseq>=$4)" );
+        flags.append( " and (mm.uid>=$3 or mm.modseq>=$4)" );
+    }
 
     d->messages = new Query( msgs, this );
-    d->messages->bind( 1, d->mailbox->id() );
-    d->messages->bind( 2, d->newUidnext );
-    if ( !initialising ) {
-        d->messages->bind( 3, d->oldUidnext );
-        d->messages->bind( 4, d->oldModSeq );
+    d->flags = new Query( flags, this );
+    List<Query> queries;
+    queries.append( d->messages );
+    queries.append( d->flags );
+    List<Query>::Iterator q( queries );
+    while ( q ) {
+        q->bind( 1, d->mailbox->id() );
+        q->bind( 2, d->newUidnext );
+        if ( !initialising ) {
+            q->bind( 3, d->oldUidnext );
+            q->bind( 4, d->oldModSeq );
+        }
+        submit( q );
+        ++q;
     }
-    submit( d->messages );
 
     if ( initialising )
         return;
@@ -595,7 +619,35 @@ void SessionInitialiser::recordMailboxChanges()
     Row * r = 0;
     while ( (r=d->messages->nextRow()) != 0 ) {
         uint uid = r->getInt( "uid" );
-        addToSessions( uid, r->getBigint( "modseq" ) );
+        uint size = 0;
+        if ( !r->isNull( "rfc822size" ) )
+            size = r->getInt( "rfc822size" );
+        addToSessions( uid, r->getBigint( "modseq" ), r->getInt( "idate" ),
+                       size, r->getBoolean( "seen" ),
+                       r->getBoolean( "deleted" ) );
+    }
+}
+
+
+/*! Records the flags of the new and changed messages in each
+    Session's MessageColumns. This has to wait until
+    recordMailboxChanges() has seen all the messages, since that
+    clears the flags of each changed message.
+*/
+
+void SessionInitialiser::recordFlags()
+{
+    if ( !d->messages->done() )
+        return;
+    Row * r = 0;
+    while ( (r=d->flags->nextRow()) != 0 ) {
+        uint uid = r->getInt( "uid" );
+        uint flag = r->getInt( "flag" );
+        List<Session>::Iterator i( d->sessions );
+        while ( i ) {
+            i->d->columns->setFlag( uid, flag );
+            ++i;
+        }
     }
 }
 
@@ -647,17 +699,28 @@ void SessionInitialiser::emitUpdates()
 
 
 /*! Adds \a uid with modseq \a ms to each session to be announced as
-    changed or new.
+    changed or new, and records its internaldate \a idate, its size \a
+    size and whether it's \a seen and \a deleted.
 */
 
-void SessionInitialiser::addToSessions( uint uid, int64 ms )
+void SessionInitialiser::addToSessions( uint uid, int64 ms,
+                                        uint idate, uint size,
+                                        bool seen, bool deleted )
 {
+    uint seenId = seen ? Flag::id( "\\seen" ) : 0;
+    uint deletedId = deleted ? Flag::id( "\\deleted" ) : 0;
     List<Session>::Iterator i( d->sessions );
     while ( i ) {
         Session * s = i;
         ++i;
         if ( uid >= s->uidnext() || !ms || ms >= s->nextModSeq() )
             s->addUnannounced( uid );
+        MessageColumns * c = s->d->columns;
+        c->set( uid, ms, idate, size );
+        if ( seenId )
+            c->setFlag( uid, seenId );
+        if ( deletedId )
+            c->setFlag( uid, deletedId );
     }
 }
 
@@ -724,6 +787,17 @@ void Session::earlydeletems( const IntegerSet & uids )
     d->msns.remove( uids );
 }
 
+/*! Returns the MessageColumns object which records the metadata of
+    the messages in this session. It is current whenever initialised()
+    returns true.
+*/
+
+MessageColumns * Session::columns() const
+{
+    return d->columns;
+}
+
+
 /*! Returns what setNextModSeq() set. The initial value is 0. */
 
 int64 Session::nextModSeq() const
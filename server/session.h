@@ -56,6 +56,8 @@ public:
     const IntegerSet & expunged() const;
     const IntegerSet & messages() const;
 
+    class MessageColumns * columns() const;
+
     void expunge( const IntegerSet & );
     virtual void clearExpunged( uint );
     virtual void earlydeletems( const IntegerSet & );
@@ -92,9 +94,10 @@ private:
     void findRecent();
     void findMailboxChanges();
     void recordMailboxChanges();
+    void recordFlags();
     void recordExpunges();
     void emitUpdates();
-    void addToSessions( uint, int64 );
+    void addToSessions( uint, int64, uint, uint, bool, bool );
     void submit( class Query * );
 };
 
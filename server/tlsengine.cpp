@@ -0,0 +1,686 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tlsengine.h"
+
+#include "file.h"
+#include "buffer.h"
+#include "estring.h"
+#include "configuration.h"
+#include "graph.h"
+#include "log.h"
+
+// read, write
+#include <unistd.h>
+// time
+#include <time.h>
+// memcmp, memcpy, memset
+#include <string.h>
+// mmap
+#include <sys/mman.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+
+static const int bs = 32768;
+
+
+class TlsEngineData
+    : public Garbage
+{
+public:
+    TlsEngineData()
+        : Garbage(),
+          ssl( 0 ), rbio( 0 ), wbio( 0 ),
+          broken( false ), closed( false ),
+          shutdown( false ), notified( false ), blocked( false ),
+          counted( false )
+        {}
+
+    SSL * ssl;
+
+    // where openssl reads encrypted data from the peer
+    BIO * rbio;
+    // where openssl writes encrypted data for the peer
+    BIO * wbio;
+
+    bool broken;
+    bool closed;
+    bool shutdown;
+    // true once close_notify has been queued
+    bool notified;
+    // true if SSL_write() needs more input from the peer first
+    bool blocked;
+    // true once the handshake has been counted as resumed or full
+    bool counted;
+};
+
+
+static SSL_CTX * ctx = 0;
+
+
+static GraphableCounter * resumedSessions = 0;
+static GraphableCounter * fullHandshakes = 0;
+static GraphableCounter * cacheHits = 0;
+static GraphableCounter * cacheMisses = 0;
+
+
+static void setupCounters()
+{
+    if ( resumedSessions )
+        return;
+    resumedSessions = new GraphableCounter( "tls-sessions-resumed" );
+    fullHandshakes = new GraphableCounter( "tls-full-handshakes" );
+    cacheHits = new GraphableCounter( "tls-session-cache-hits" );
+    cacheMisses = new GraphableCounter( "tls-session-cache-misses" );
+}
+
+
+// The session ticket keys are derived from a secret chosen by
+// setup(), which runs before the server forks, so every process
+// computes the same key for a given period and any process can
+// resume a session any other process started.
+
+static unsigned char ticketSecret[32];
+static uint ticketLifetime = 0;
+
+
+struct TicketKey {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+
+
+static void deriveKey( const char * label, uint period,
+                       unsigned char * out, uint length )
+{
+    unsigned char in[16];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdl = 0;
+    memset( in, 0, sizeof( in ) );
+    strncpy( (char *)in, label, 11 );
+    in[12] = ( period >> 24 ) & 0xff;
+    in[13] = ( period >> 16 ) & 0xff;
+    in[14] = ( period >> 8 ) & 0xff;
+    in[15] = period & 0xff;
+    ::HMAC( EVP_sha256(), ticketSecret, sizeof( ticketSecret ),
+            in, sizeof( in ), md, &mdl );
+    memcpy( out, md, length );
+}
+
+
+static void ticketKey( uint period, TicketKey * k )
+{
+    deriveKey( "name", period, k->name, sizeof( k->name ) );
+    deriveKey( "aes", period, k->aes, sizeof( k->aes ) );
+    deriveKey( "hmac", period, k->hmac, sizeof( k->hmac ) );
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketMac;
+
+static int setTicketMac( TicketMac * h, const TicketKey & k )
+{
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY,
+                                                   (void*)k.hmac,
+                                                   sizeof( k.hmac ) );
+    params[1] = OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST,
+                                                  (char*)"sha256", 0 );
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params( h, params );
+}
+#else
+typedef HMAC_CTX TicketMac;
+
+static int setTicketMac( TicketMac * h, const TicketKey & k )
+{
+    return HMAC_Init_ex( h, k.hmac, sizeof( k.hmac ), EVP_sha256(), 0 );
+}
+#endif
+
+
+/*! This OpenSSL callback encrypts new session tickets with the key
+    for the current period, and decrypts tickets made with the key
+    for the current or previous period. Tickets from the previous
+    period are accepted, but OpenSSL is asked to issue a new one.
+*/
+
+static int ticketCallback( SSL *, unsigned char * name, unsigned char * iv,
+                           EVP_CIPHER_CTX * c, TicketMac * h, int enc )
+{
+    uint period = (uint)::time( 0 ) / ticketLifetime;
+    TicketKey k;
+
+    if ( enc ) {
+        ticketKey( period, &k );
+        if ( RAND_bytes( iv, EVP_MAX_IV_LENGTH ) <= 0 )
+            return -1;
+        memcpy( name, k.name, sizeof( k.name ) );
+        if ( !EVP_EncryptInit_ex( c, EVP_aes_256_cbc(), 0, k.aes, iv ) ||
+             !setTicketMac( h, k ) )
+            return -1;
+        return 1;
+    }
+
+    uint age = 0;
+    while ( age < 2 ) {
+        ticketKey( period - age, &k );
+        if ( !memcmp( name, k.name, sizeof( k.name ) ) ) {
+            if ( !EVP_DecryptInit_ex( c, EVP_aes_256_cbc(), 0, k.aes, iv ) ||
+                 !setTicketMac( h, k ) )
+                return -1;
+            if ( age )
+                return 2;
+            return 1;
+        }
+        age++;
+    }
+    return 0;
+}
+
+
+// The optional shared session cache is a table of fixed-size slots
+// in an anonymous shared mapping, also created before the server
+// forks. A session lives in the slot picked by its ID; a newer
+// session simply overwrites an older one. Each slot has a spinlock,
+// but nothing ever waits for it: if a slot is busy, we act as
+// though it were empty.
+
+static const uint sessionDataSize = 2000;
+
+struct SessionSlot {
+    volatile int lock;
+    uint expires;
+    uint idLength;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    uint length;
+    unsigned char data[sessionDataSize];
+};
+
+static SessionSlot * slots = 0;
+static uint numSlots = 0;
+
+
+static SessionSlot * lockedSlot( const unsigned char * id, uint length )
+{
+    uint h = 5381;
+    uint i = 0;
+    while ( i < length )
+        h = h * 33 + id[i++];
+    SessionSlot * s = slots + ( h % numSlots );
+    if ( __sync_lock_test_and_set( &s->lock, 1 ) )
+        return 0;
+    return s;
+}
+
+
+static void unlock( SessionSlot * s )
+{
+    __sync_lock_release( &s->lock );
+}
+
+
+static int newSession( SSL *, SSL_SESSION * session )
+{
+    uint idl = 0;
+    const unsigned char * id = SSL_SESSION_get_id( session, &idl );
+    int l = i2d_SSL_SESSION( session, 0 );
+    if ( !idl || idl > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+         l <= 0 || (uint)l > sessionDataSize )
+        return 0;
+
+    SessionSlot * s = lockedSlot( id, idl );
+    if ( !s )
+        return 0;
+    unsigned char * p = s->data;
+    s->length = i2d_SSL_SESSION( session, &p );
+    s->idLength = idl;
+    memcpy( s->id, id, idl );
+    s->expires = SSL_SESSION_get_time( session ) +
+                 SSL_SESSION_get_timeout( session );
+    unlock( s );
+    return 0;
+}
+
+
+static SSL_SESSION * getSession( SSL *, const unsigned char * id,
+                                 int idl, int * copy )
+{
+    *copy = 0;
+    setupCounters();
+    if ( idl <= 0 || idl > SSL_MAX_SSL_SESSION_ID_LENGTH ) {
+        cacheMisses->tick();
+        return 0;
+    }
+
+    SSL_SESSION * session = 0;
+    SessionSlot * s = lockedSlot( id, idl );
+    if ( s ) {
+        if ( s->idLength == (uint)idl && !memcmp( s->id, id, idl ) &&
+             s->expires > (uint)::time( 0 ) ) {
+            const unsigned char * p = s->data;
+            session = d2i_SSL_SESSION( 0, &p, s->length );
+        }
+        unlock( s );
+    }
+
+    if ( session )
+        cacheHits->tick();
+    else
+        cacheMisses->tick();
+    return session;
+}
+
+
+static void removeSession( SSL_CTX *, SSL_SESSION * session )
+{
+    uint idl = 0;
+    const unsigned char * id = SSL_SESSION_get_id( session, &idl );
+    if ( !idl || idl > SSL_MAX_SSL_SESSION_ID_LENGTH )
+        return;
+    SessionSlot * s = lockedSlot( id, idl );
+    if ( !s )
+        return;
+    if ( s->idLength == idl && !memcmp( s->id, id, idl ) )
+        s->idLength = 0;
+    unlock( s );
+}
+
+
+/*! Sets up session resumption for the server context: Each process
+    keeps its own session cache, session tickets are issued using
+    keys that rotate every tls-session-lifetime seconds, and if
+    tls-session-cache-size is nonzero, sessions are also shared
+    between processes.
+*/
+
+static void setupSessions()
+{
+    ticketLifetime = Configuration::scalar( Configuration::TlsSessionLifetime );
+    if ( !ticketLifetime ) {
+        SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_OFF );
+        SSL_CTX_set_options( ctx, SSL_OP_NO_TICKET );
+        return;
+    }
+
+    static const unsigned char context[] = "archiveopteryx";
+    SSL_CTX_set_session_id_context( ctx, context, sizeof( context ) - 1 );
+    SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_SERVER );
+    SSL_CTX_set_timeout( ctx, ticketLifetime );
+
+    if ( RAND_bytes( ticketSecret, sizeof( ticketSecret ) ) > 0 ) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx, ticketCallback );
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb( ctx, ticketCallback );
+#endif
+    }
+    else {
+        log( "Could not generate a TLS session ticket key", Log::Error );
+        SSL_CTX_set_options( ctx, SSL_OP_NO_TICKET );
+    }
+
+    uint n = Configuration::scalar( Configuration::TlsSessionCacheSize );
+    if ( !n )
+        return;
+    void * m = ::mmap( 0, n * sizeof( SessionSlot ),
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( m == MAP_FAILED ) {
+        log( "Could not allocate the shared TLS session cache (" +
+             fn( n ) + " slots); sessions will not be shared",
+             Log::Error );
+        return;
+    }
+    slots = (SessionSlot *)m;
+    numSlots = n;
+    SSL_CTX_sess_set_new_cb( ctx, newSession );
+    SSL_CTX_sess_set_get_cb( ctx, getSession );
+    SSL_CTX_sess_set_remove_cb( ctx, removeSession );
+}
+
+
+/*! Perform any OpenSSL initialisation needed to enable us to create
+    TlsEngines later.
+*/
+
+void TlsEngine::setup()
+{
+    SSL_load_error_strings();
+    SSL_library_init();
+
+    ctx = ::SSL_CTX_new( SSLv23_server_method() );
+    long options = SSL_OP_ALL
+        // also try to pick the same ciphers suites more often
+        | SSL_OP_CIPHER_SERVER_PREFERENCE
+        // and don't use SSLv2, even if the client wants to
+        | SSL_OP_NO_SSLv2
+        // and not v3 either
+        | SSL_OP_NO_SSLv3
+        ;
+    SSL_CTX_set_options( ctx, options );
+
+    SSL_CTX_set_cipher_list( ctx, "kEDH:HIGH:!aNULL:!MD5" );
+
+    EString certFile( Configuration::text( Configuration::TlsCertFile ) );
+    if ( certFile.isEmpty() ) {
+        certFile = Configuration::compiledIn( Configuration::LibDir );
+        certFile.append( "/automatic-key.pem" );
+    }
+    certFile = File::chrooted( certFile );
+    EString keyFile( Configuration::text( Configuration::TlsKeyFile ) );
+    if ( keyFile.isEmpty() )
+        keyFile = certFile;
+    else
+        keyFile = File::chrooted( keyFile );
+    if ( !SSL_CTX_use_certificate_chain_file( ctx, certFile.cstr() ) ) {
+        EString reason = ERR_reason_error_string(ERR_peek_error());
+        log( "OpenSSL failed to read the certificate from " + keyFile +
+             ": " + reason,
+             Log::Disaster );
+    }
+    if ( !SSL_CTX_use_PrivateKey_file( ctx, keyFile.cstr(),
+                                       SSL_FILETYPE_PEM ) )
+        log( "OpenSSL needs the private key in this file: " + keyFile,
+             Log::Disaster );
+    // we go on anyway; the disaster will take down the server in
+    // a hurry.
+
+    // we don't ask for a client cert
+    SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
+
+    setupSessions();
+}
+
+
+/*! \class TlsEngine tlsengine.h
+    Handles TLS for a single Connection inside the EventLoop.
+
+    A TlsEngine sits between a Connection's socket and its read and
+    write Buffers. It holds an OpenSSL object whose input and output
+    are memory BIOs: read() moves encrypted bytes from the socket into
+    OpenSSL and decrypted bytes into the read Buffer, and write() does
+    the opposite. Since nothing ever blocks, the handshake simply
+    progresses whenever the EventLoop calls read() and write().
+*/
+
+
+/*! Constructs a TlsEngine. If \a asClient is supplied and true (the
+    default is false), the engine acts as client (and initiates a TLS
+    handshake). If not, it acts as a server (and expects the other end
+    to initiate the handshake).
+
+    Because TlsEngine is garbage collected, whoever uses it must call
+    close() to free the OpenSSL resources.
+*/
+
+TlsEngine::TlsEngine( bool asClient )
+    : d( new TlsEngineData )
+{
+    if ( !ctx )
+        setup();
+
+    d->ssl = ::SSL_new( ctx );
+    d->rbio = BIO_new( BIO_s_mem() );
+    d->wbio = BIO_new( BIO_s_mem() );
+    if ( !d->ssl || !d->rbio || !d->wbio ) {
+        log( "OpenSSL could not create a TLS session", Log::Error );
+        d->broken = true;
+        return;
+    }
+
+    // an empty read BIO means "try again later", not EOF
+    BIO_set_mem_eof_return( d->rbio, -1 );
+    ::SSL_set_bio( d->ssl, d->rbio, d->wbio );
+    SSL_set_mode( d->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+    if ( asClient )
+        SSL_set_connect_state( d->ssl );
+    else
+        SSL_set_accept_state( d->ssl );
+}
+
+
+/*! Reads as much encrypted data as possible from the nonblocking \a
+    fd, and appends whatever cleartext OpenSSL can decrypt to \a
+    cleartext. This also drives the handshake, which may leave data
+    for write() to send.
+*/
+
+void TlsEngine::read( int fd, Buffer * cleartext )
+{
+    if ( d->broken || d->closed )
+        return;
+
+    char buf[bs];
+
+    int n = ::read( fd, buf, bs );
+    while ( n > 0 ) {
+        BIO_write( d->rbio, buf, n );
+        d->blocked = false;
+        n = ::read( fd, buf, bs );
+    }
+
+    int r = SSL_read( d->ssl, buf, bs );
+    while ( r > 0 ) {
+        cleartext->append( buf, r );
+        r = SSL_read( d->ssl, buf, bs );
+    }
+    if ( sslErrorSeriousness( r ) )
+        d->closed = true;
+
+    if ( !d->counted && SSL_is_init_finished( d->ssl ) ) {
+        d->counted = true;
+        setupCounters();
+        if ( SSL_session_reused( d->ssl ) )
+            resumedSessions->tick();
+        else
+            fullHandshakes->tick();
+    }
+}
+
+
+/*! Encrypts as much of \a cleartext as possible, removing what's
+    been encrypted, and writes the result to the nonblocking \a fd.
+
+    Encryption stops while there is a good deal of data waiting for
+    \a fd, so that a slow peer doesn't make us hold two copies of
+    everything we send.
+*/
+
+void TlsEngine::write( Buffer * cleartext, int fd )
+{
+    if ( d->broken )
+        return;
+
+    bool progress = true;
+    while ( progress ) {
+        progress = false;
+        while ( cleartext->size() > 0 && !d->blocked && !d->closed &&
+                BIO_ctrl_pending( d->wbio ) < (uint)bs ) {
+            // a TLS record holds at most 16k cleartext
+            EString s = cleartext->string( 16384 );
+            int r = SSL_write( d->ssl, s.data(), s.length() );
+            if ( r > 0 ) {
+                cleartext->remove( r );
+            }
+            else {
+                int e = SSL_get_error( d->ssl, r );
+                if ( e == SSL_ERROR_WANT_READ )
+                    d->blocked = true;
+                else if ( sslErrorSeriousness( r ) )
+                    d->closed = true;
+                break;
+            }
+        }
+
+        if ( d->shutdown && !d->notified && cleartext->size() == 0 ) {
+            SSL_shutdown( d->ssl );
+            d->notified = true;
+        }
+
+        uint before = BIO_ctrl_pending( d->wbio );
+        flush( fd );
+        if ( BIO_ctrl_pending( d->wbio ) < before &&
+             cleartext->size() > 0 && !d->blocked && !d->closed )
+            progress = true;
+    }
+}
+
+
+/*! This private helper writes as much encrypted data as possible
+    from the write BIO to \a fd.
+*/
+
+void TlsEngine::flush( int fd )
+{
+    char * p = 0;
+    long n = BIO_get_mem_data( d->wbio, &p );
+    while ( n > 0 ) {
+        int w = ::write( fd, p, n );
+        if ( w <= 0 )
+            return;
+        if ( w == n ) {
+            (void)BIO_reset( d->wbio );
+        }
+        else {
+            char discard[bs];
+            int l = w;
+            while ( l > 0 ) {
+                int r = BIO_read( d->wbio, discard, l > bs ? bs : l );
+                if ( r <= 0 )
+                    return;
+                l -= r;
+            }
+        }
+        n = BIO_get_mem_data( d->wbio, &p );
+    }
+}
+
+
+/*! Returns true if write() would be able to send anything, given that
+    \a cleartext is waiting to be encrypted, and false if not. In
+    particular, returns false if encryption must wait until the peer
+    has sent more handshake data.
+*/
+
+bool TlsEngine::canWrite( const Buffer * cleartext ) const
+{
+    if ( d->broken )
+        return false;
+    if ( BIO_ctrl_pending( d->wbio ) > 0 )
+        return true;
+    return cleartext->size() > 0 && !d->blocked && !d->closed;
+}
+
+
+/*! Returns true if the openssl result status \a r is a serious error,
+    and false otherwise.
+*/
+
+bool TlsEngine::sslErrorSeriousness( int r ) {
+    int e = SSL_get_error( d->ssl, r  );
+    switch( e ) {
+    case SSL_ERROR_NONE:
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+    case SSL_ERROR_WANT_ACCEPT:
+    case SSL_ERROR_WANT_CONNECT:
+    case SSL_ERROR_WANT_X509_LOOKUP:
+        return false;
+        break;
+
+    case SSL_ERROR_ZERO_RETURN:
+        // not an error, client closed cleanly
+        return true;
+        break;
+
+    case SSL_ERROR_SSL:
+    case SSL_ERROR_SYSCALL:
+        ERR_clear_error();
+        return true;
+        break;
+    }
+    return true;
+}
+
+
+/*! Returns true if this TlsEngine is broken somehow, and false if
+    it's in working order.
+*/
+
+bool TlsEngine::broken() const
+{
+    return d->broken;
+}
+
+
+/*! Returns true if the TLS session can carry no more data from the
+    peer, either because the peer closed it or because of a protocol
+    error, and false if all is well.
+*/
+
+bool TlsEngine::closed() const
+{
+    return d->broken || d->closed;
+}
+
+
+/*! Initiates a very orderly shutdown: write() sends a close_notify
+    alert once all pending cleartext has been sent.
+*/
+
+void TlsEngine::shutdown()
+{
+    d->shutdown = true;
+}
+
+
+/*! Returns true if this TlsEngine has been told to shut down via
+    shutdown(), and false if not.
+*/
+
+bool TlsEngine::isShuttingDown() const
+{
+    return d->shutdown;
+}
+
+
+/*! Causes this TlsEngine object to stop doing anything, in a great
+    hurry and without any attempt at talking to the client, and frees
+    the OpenSSL resources it holds.
+*/
+
+void TlsEngine::close()
+{
+    d->broken = true;
+    if ( d->ssl ) {
+        // OpenSSL forgets the session unless it was shut down, but
+        // it already forgot it if a fatal error happened, so the
+        // session can be resumed however the peer left us.
+        if ( SSL_is_init_finished( d->ssl ) )
+            SSL_set_shutdown( d->ssl,
+                              SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN );
+        // SSL_free() frees the BIOs too
+        ::SSL_free( d->ssl );
+    }
+    else {
+        if ( d->rbio )
+            BIO_free( d->rbio );
+        if ( d->wbio )
+            BIO_free( d->wbio );
+    }
+    d->ssl = 0;
+    d->rbio = 0;
+    d->wbio = 0;
+}
@@ -1,36 +1,39 @@
 // Copyright 2009 The Archiveopteryx Developers <info@aox.org>
 
-#ifndef TLSTHREAD_H
-#define TLSTHREAD_H
+#ifndef TLSENGINE_H
+#define TLSENGINE_H
 
 #include "global.h"
 
 
-class TlsThread
+class Buffer;
+
+
+class TlsEngine
     : public Garbage
 {
 public:
-    TlsThread( bool = false );
-    ~TlsThread();
+    TlsEngine( bool = false );
 
     static void setup();
 
-    void setServerFD( int );
-    void setClientFD( int );
-
-    void start();
+    void read( int, Buffer * );
+    void write( Buffer *, int );
+    bool canWrite( const Buffer * ) const;
 
     bool broken() const;
+    bool closed() const;
 
     void shutdown();
     bool isShuttingDown() const;
 
-    bool sslErrorSeriousness( int );
-    
     void close();
 
 private:
-    class TlsThreadData * d;
+    class TlsEngineData * d;
+
+    bool sslErrorSeriousness( int );
+    void flush( int );
 };
 
 #endif
@@ -3,12 +3,16 @@
 #include "sieve.h"
 
 #include "md5.h"
+#include "map.h"
+#include "dict.h"
 #include "utf.h"
 #include "date.h"
 #include "html.h"
+#include "cache.h"
 #include "user.h"
 #include "codec.h"
 #include "query.h"
+#include "dbsignal.h"
 #include "scope.h"
 #include "address.h"
 #include "mailbox.h"
@@ -47,6 +51,41 @@ public:
           softError( false )
     {}
 
+    class Resolution
+        : public Garbage
+    {
+    public:
+        Resolution( Row * r )
+            : Garbage(), mailbox( 0 ), script( false ), scriptId( 0 ),
+              userId( 0 )
+        {
+            if ( !r->isNull( "mailbox" ) )
+                mailbox = r->getInt( "mailbox" );
+            if ( r->isNull( "script" ) )
+                return;
+            script = true;
+            scriptId = r->getInt( "scriptid" );
+            source = r->getEString( "script" ).crlf();
+            ns = r->getUString( "namespace" );
+            login = r->getUString( "login" );
+            userId = r->getInt( "userid" );
+            name = r->getUString( "name" );
+            localpart = r->getEString( "localpart" );
+            domain = r->getEString( "domain" );
+        }
+
+        uint mailbox;
+        bool script;
+        uint scriptId;
+        EString source;
+        UString ns;
+        UString login;
+        uint userId;
+        UString name;
+        EString localpart;
+        EString domain;
+    };
+
     class Recipient
         : public Garbage
     {
@@ -55,7 +94,8 @@ public:
             : d( data ), address( a ), mailbox( m ),
               done( false ), ok( true ),
               implicitKeep( true ), explicitKeep( false ),
-              sq( 0 ), script( new SieveScript ), user( 0 ), handler( 0 )
+              sq( 0 ), found( 0 ),
+              script( new SieveScript ), user( 0 ), handler( 0 )
         {
             d->recipients.append( this );
         }
@@ -71,6 +111,8 @@ public:
         List<SieveAction> actions;
         List<SieveCommand> pending;
         Query * sq;
+        EString key;
+        List<Resolution> * found;
         SieveScript * script;
         EString error;
         UString prefix;
@@ -99,9 +141,130 @@ public:
     bool softError;
 
     Recipient * recipient( Address * a );
+    void resolve( Recipient *, List<Resolution> * );
+};
+
+
+// Parsed scripts, keyed by scripts.id. A script is only used if its
+// source is what the database says it is now, so the cache can't
+// serve stale scripts; the scripts_updated notification merely lets
+// us forget replaced scripts promptly.
+
+class SieveScriptCache
+    : public Cache
+{
+public:
+    SieveScriptCache(): Cache( 10 ) {}
+
+    void clear() { c.clear(); }
+
+    SieveScript * find( uint id, const EString & source ) {
+        SieveScript * s = c.find( id );
+        if ( s && s->source() == source )
+            return s;
+        return 0;
+    }
+
+    Map<SieveScript> c;
 };
 
 
+static SieveScriptCache * scripts = 0;
+
+
+class SieveScriptForgetter
+    : public EventHandler
+{
+public:
+    SieveScriptForgetter(): EventHandler() {}
+    void execute() { if ( ::scripts ) ::scripts->clear(); }
+};
+
+
+// What addRecipient() found for each alias, including nothing. The
+// key is localpart@domain, titlecased, after subaddress stripping.
+// The database notifies us when aliases, users, scripts or the
+// deleted/owner columns of mailboxes change.
+
+class SieveRecipientCache
+    : public Cache
+{
+public:
+    SieveRecipientCache(): Cache( 10 ) {}
+
+    void clear() { c.clear(); }
+
+    Dict< List<SieveData::Resolution> > c;
+};
+
+
+static SieveRecipientCache * recipients = 0;
+
+
+class SieveRecipientForgetter
+    : public EventHandler
+{
+public:
+    SieveRecipientForgetter(): EventHandler() {}
+    void execute() { if ( ::recipients ) ::recipients->clear(); }
+};
+
+
+/*! Records what the aliases query found for \a r, \a l, in \a r and
+    if there's more than one row, in new Recipient objects for the
+    same address.
+*/
+
+void SieveData::resolve( Recipient * r, List<Resolution> * l )
+{
+    List<Resolution>::Iterator i( l );
+    for ( Recipient * in = r; i; in = new Recipient( r->address, 0, this ) ) {
+        Resolution * res = i;
+        ++i;
+        if ( res->mailbox )
+            in->mailbox = Mailbox::find( res->mailbox );
+        if ( !res->script )
+            continue;
+
+        in->prefix = res->ns + "/" + res->login + "/";
+        in->user = new User;
+        in->user->setLogin( res->login );
+        in->user->setId( res->userId );
+        in->user->setAddress( new Address( res->name, res->localpart,
+                                           res->domain ) );
+        if ( !::scripts ) {
+            ::scripts = new SieveScriptCache;
+            (void)new DatabaseSignal( "scripts_updated",
+                                      new SieveScriptForgetter );
+        }
+        SieveScript * cached = ::scripts->find( res->scriptId, res->source );
+        if ( cached ) {
+            in->script = cached;
+        }
+        else {
+            in->script->parse( res->source );
+            if ( in->script->parseErrors().isEmpty() )
+                ::scripts->c.insert( res->scriptId, in->script );
+        }
+        EString errors = in->script->parseErrors();
+        if ( !errors.isEmpty() ) {
+            ::log( "Note: Sieve script for " + in->user->login().utf8() +
+                   "had parse errors.", Log::Error );
+            EStringList::Iterator e( EStringList::split( '\n', errors ) );
+            while ( e ) {
+                ::log( "Sieve: " + *e, Log::Error );
+                ++e;
+            }
+        }
+        List<SieveCommand>::Iterator c( in->script->topLevelCommands() );
+        while ( c ) {
+            in->pending.append( c );
+            ++c;
+        }
+    }
+}
+
+
 SieveData::Recipient * SieveData::recipient( Address * a )
 {
     List<SieveData::Recipient>::Iterator it( recipients );
@@ -168,51 +331,17 @@ void Sieve::execute()
         bool wasReady = ready();
         List<SieveData::Recipient>::Iterator i( d->recipients );
         while ( i ) {
-            if ( i->sq && i->sq->hasResults() ) {
+            if ( i->sq ) {
                 Row * r;
-                SieveData::Recipient *in = i;
-                for ( in = i ;
-                      (r = i->sq->nextRow()) ;
-                      in = new SieveData::Recipient( i->address, 0, d) ) {
-                    if ( !r->isNull( "mailbox" ) )
-                        in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
-                    if ( !r->isNull( "script" ) ) {
-                        in->prefix = r->getUString( "namespace" ) + "/" +
-                                    r->getUString( "login" ) + "/";
-                        in->user = new User;
-                        in->user->setLogin( r->getUString( "login" ) );
-                        in->user->setId( r->getInt( "userid" ) );
-                        in->user->setAddress( new Address(
-                                                 r->getUString( "name" ),
-                                                 r->getEString( "localpart" ),
-                                                 r->getEString( "domain" ) ) );
-                        in->script->parse( r->getEString( "script" ).crlf() );
-                        EString errors = in->script->parseErrors();
-                        if ( !errors.isEmpty() ) {
-                            log( "Note: Sieve script for " +
-                                 in->user->login().utf8() +
-                                 "had parse errors.", Log::Error );
-                            EString prefix = "Sieve script for " +
-                                            in->user->login().utf8();
-                            EStringList::Iterator i(
-                                EStringList::split( '\n', errors ) );
-                            while ( i ) {
-                                log( "Sieve: " + *i, Log::Error );
-                                ++i;
-                            }
-                        }
-                        List<SieveCommand>::Iterator
-                            c(in->script->topLevelCommands());
-                        while ( c ) {
-                            in->pending.append( c );
-                            ++c;
-                        }
-                    }
+                while ( (r = i->sq->nextRow()) != 0 )
+                    i->found->append( new SieveData::Resolution( r ) );
+                if ( i->sq->done() ) {
+                    if ( !i->sq->failed() )
+                        ::recipients->c.insert( i->key, i->found );
+                    i->sq = 0;
+                    d->resolve( i, i->found );
                 }
-                i->sq = 0;
             }
-            if ( i->sq && i->sq->done() )
-                i->sq = 0;
             ++i;
         }
         if ( ready() && !wasReady ) {
@@ -471,6 +600,10 @@ void Sieve::addRecipient( Address * address, Mailbox * destination,
 
     If \a address is not a registered alias, Sieve will refuse mail to
     it.
+
+    The result is cached until the database says that aliases, users
+    or scripts have changed, so repeated lookups for the same address
+    (including nonexistent ones) don't need the database.
 */
 
 void Sieve::addRecipient( Address * address, EventHandler * user )
@@ -483,18 +616,6 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
 
     r->handler = user;
 
-    r->sq = new Query( "select al.mailbox, s.script, m.owner, "
-                       "n.name as namespace, u.id as userid, u.login, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from aliases al "
-                       "join addresses a on (al.address=a.id) "
-                       "join mailboxes m on (al.mailbox=m.id) "
-                       "left join scripts s on "
-                       " (s.owner=m.owner and s.active='t') "
-                       "left join users u on (s.owner=u.id) "
-                       "left join namespaces n on (u.parentspace=n.id) "
-                       "where m.deleted='f' and "
-                       "a.localpart=$1 and a.domain=$2", this );
     UString localpart( address->localpart() );
     if ( Configuration::toggle( Configuration::UseSubaddressing ) ) {
         EString sep( Configuration::text( Configuration::AddressSeparator ) );
@@ -516,6 +637,52 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
                 localpart = localpart.mid( 0, n );
         }
     }
+
+    if ( !::recipients ) {
+        ::recipients = new SieveRecipientCache;
+        SieveRecipientForgetter * f = new SieveRecipientForgetter;
+        (void)new DatabaseSignal( "aliases_updated", f );
+        (void)new DatabaseSignal( "scripts_updated", f );
+    }
+    // the database compares addresses case-insensitively, so we do
+    // too
+    UString k( localpart );
+    k.append( "@" );
+    k.append( address->domain() );
+    r->key = k.titlecased().utf8();
+    List<SieveData::Resolution> * l = ::recipients->c.find( r->key );
+    if ( l ) {
+        // a mailbox may have been deleted since
+        List<SieveData::Resolution>::Iterator i( l );
+        while ( i ) {
+            Mailbox * m = 0;
+            if ( i->mailbox )
+                m = Mailbox::find( i->mailbox );
+            if ( i->mailbox && ( !m || m->deleted() ) )
+                break;
+            ++i;
+        }
+        if ( !i ) {
+            d->resolve( r, l );
+            return;
+        }
+        ::recipients->c.remove( r->key );
+    }
+
+    r->found = new List<SieveData::Resolution>;
+    r->sq = new Query( "select al.mailbox, s.id as scriptid, "
+                       "s.script, m.owner, "
+                       "n.name as namespace, u.id as userid, u.login, "
+                       "a.name, a.localpart::text, a.domain::text "
+                       "from aliases al "
+                       "join addresses a on (al.address=a.id) "
+                       "join mailboxes m on (al.mailbox=m.id) "
+                       "left join scripts s on "
+                       " (s.owner=m.owner and s.active='t') "
+                       "left join users u on (s.owner=u.id) "
+                       "left join namespaces n on (u.parentspace=n.id) "
+                       "where m.deleted='f' and "
+                       "a.localpart=$1 and a.domain=$2", this );
     r->sq->bind( 1, localpart );
     r->sq->bind( 2, address->domain() );
     r->sq->execute();
@@ -1192,10 +1359,10 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
             return Undecidable;
         haystack = new UStringList;
         List<HeaderField>::Iterator hf( d->message->header()->fields() );
-        Utf8Codec c;
+        EStringList * names = t->headerNames();
         while ( hf ) {
             if ( hf->type() <= HeaderField::LastAddressField &&
-                 t->headers()->contains( c.toUnicode( hf->name() ) ) ) {
+                 names->contains( hf->name() ) ) {
                 AddressField * af = (AddressField*)((HeaderField*)hf);
                 List<Address>::Iterator a( af->addresses() );
                 while ( a ) {
@@ -1248,19 +1415,17 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
     {
         if ( !d->message )
             return Undecidable;
+        if ( !d->message->hasHeaders() ||
+             ( t->headersIncludeAddressFields() &&
+               !d->message->hasAddresses() ) )
+            return Undecidable;
+
         haystack = new UStringList;
-        UStringList::Iterator i( t->headers() );
+        EStringList::Iterator i( t->headerNames() );
         while ( i ) {
-            uint hft = HeaderField::fieldType( i->ascii() );
-
-            if ( ( hft > 0 && hft <= HeaderField::LastAddressField &&
-                   !d->message->hasAddresses() ) ||
-                 !d->message->hasHeaders() )
-                return Undecidable;
-
             List<HeaderField>::Iterator hf( d->message->header()->fields() );
             while ( hf ) {
-                if ( hf->name() == i->ascii() )
+                if ( hf->name() == *i )
                     haystack->append( hf->value() );
                 ++hf;
             }
@@ -1283,9 +1448,9 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
 
         Date dt;
         if ( t->headers() ) {
-            UString * hk = t->headers()->first();
+            EString * hk = t->headerNames()->first();
             List<HeaderField>::Iterator hf( d->message->header()->fields() );
-            while ( hf && hf->name() != hk->ascii() )
+            while ( hf && hf->name() != *hk )
                 ++hf;
             if ( hf )
                 dt.setRfc822( hf->rfc822( false ) );
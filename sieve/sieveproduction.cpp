@@ -1009,7 +1009,8 @@ public:
           bodyMatchType( SieveTest::Text ),
           headers( 0 ), envelopeParts( 0 ), keys( 0 ),
           contentTypes( 0 ),
-          sizeOver( false ), sizeLimit( 0 )
+          sizeOver( false ), sizeLimit( 0 ),
+          headerNames( 0 ), addressFields( false )
     {}
 
     EString identifier;
@@ -1030,6 +1031,9 @@ public:
     UString zone;
     bool sizeOver;
     uint sizeLimit;
+
+    EStringList * headerNames;
+    bool addressFields;
 };
 
 
@@ -1590,6 +1594,7 @@ void SieveTest::findComparator()
     UString a = arguments()->takeTaggedString( ":comparator" );
     if ( a.isEmpty() ) {
         require( "comparator-i;ascii-casemap" );
+        d->comparator = Collation::create( us( "i;ascii-casemap" ) );
         return;
     }
 
@@ -1770,6 +1775,42 @@ UStringList * SieveTest::headers() const
 }
 
 
+/*! Returns the same list as headers(), as header-cased EStrings, or a
+    null pointer if headers() returns one. The list is built the first
+    time it's needed, so that evaluating a script many times doesn't
+    convert the names many times.
+*/
+
+EStringList * SieveTest::headerNames() const
+{
+    if ( d->headerNames || !d->headers )
+        return d->headerNames;
+
+    d->headerNames = new EStringList;
+    UStringList::Iterator i( d->headers );
+    while ( i ) {
+        EString n( i->ascii() );
+        uint t = HeaderField::fieldType( n );
+        if ( t > 0 && t <= HeaderField::LastAddressField )
+            d->addressFields = true;
+        d->headerNames->append( n );
+        ++i;
+    }
+    return d->headerNames;
+}
+
+
+/*! Returns true if any of the headers() is an address field, and
+    false if not.
+*/
+
+bool SieveTest::headersIncludeAddressFields() const
+{
+    (void)headerNames();
+    return d->addressFields;
+}
+
+
 /*! Returns a list of the keys to be searched for, or a null pointer
     if none are known (which is the case e.g. if identifier() is
     "exists" or "true").
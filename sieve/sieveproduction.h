@@ -177,6 +177,8 @@ public:
     BodyMatchType bodyMatchType() const;
 
     UStringList * headers() const;
+    class EStringList * headerNames() const;
+    bool headersIncludeAddressFields() const;
     UStringList * keys() const;
     UStringList * envelopeParts() const;
     UStringList * contentTypes() const;
@@ -28,7 +28,7 @@ public:
         : messageId( 0 ), t( 0 ),
           qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), expired( false ),
           dsn( 0 ), injector( 0 ), update( 0 ), client( 0 ),
-          updatedDelivery( false )
+          updatedDelivery( false ), owner( 0 )
     {}
 
     uint messageId;
@@ -44,6 +44,7 @@ public:
     Query * update;
     SmtpClient * client;
     bool updatedDelivery;
+    EventHandler * owner;
 };
 
 
@@ -53,16 +54,18 @@ public:
 */
 
 /*! Creates a new DeliveryAgent object to deliver the message with the
-    given \a id.
+    given \a id. \a owner is notified when the DeliveryAgent is done,
+    however it went.
 */
 
-DeliveryAgent::DeliveryAgent( uint id )
+DeliveryAgent::DeliveryAgent( uint id, EventHandler * owner )
     : d( new DeliveryAgentData )
 {
     setLog( new Log );
     Scope x( log() );
     log( "Attempting delivery for message " + fn( id ) );
     d->messageId = id;
+    d->owner = owner;
 }
 
 
@@ -130,6 +133,8 @@ void DeliveryAgent::execute()
         d->t->rollback();
         d->messageId = 0;
         log( "Could not find/lock deliveries row; aborting" );
+        if ( d->owner )
+            d->owner->notify();
         return;
     }
 
@@ -142,7 +147,8 @@ void DeliveryAgent::execute()
 
         if ( !( d->message->hasHeaders() &&
                 d->message->hasAddresses() &&
-                d->message->hasBodies() ) )
+                ( d->message->hasBodies() ||
+                  d->message->hasRfc822() ) ) )
             return;
 
         createDSN();
@@ -151,6 +157,8 @@ void DeliveryAgent::execute()
             d->t->rollback();
             d->messageId = 0;
             log( "Delivery already completed; will do nothing", Log::Debug );
+            if ( d->owner )
+                d->owner->notify();
             return;
         }
     }
@@ -212,6 +220,8 @@ void DeliveryAgent::execute()
     }
 
     d->messageId = 0;
+    if ( d->owner )
+        d->owner->notify();
 }
 
 
@@ -221,7 +231,7 @@ void DeliveryAgent::execute()
 
 bool DeliveryAgent::working() const
 {
-    if ( d->t && !d->t->done() )
+    if ( d->messageId && d->t && !d->t->done() )
         return true;
     return false;
 }
@@ -239,7 +249,7 @@ Message * DeliveryAgent::fetchMessage( uint messageId )
     Fetcher * f = new Fetcher( m, this );
     f->fetch( Fetcher::Addresses );
     f->fetch( Fetcher::OtherHeader );
-    f->fetch( Fetcher::Body );
+    f->fetch( Fetcher::Rendered );
     f->setTransaction( d->t );
     f->execute();
     return m;
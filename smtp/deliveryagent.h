@@ -18,7 +18,7 @@ class DeliveryAgent
     : public EventHandler
 {
 public:
-    DeliveryAgent( uint );
+    DeliveryAgent( uint, EventHandler * );
 
     uint messageId() const;
 
@@ -410,6 +410,18 @@ void SMTP::setBody( const EString & b )
 }
 
 
+/*! Appends \a b to the body recorded by setBody(). Unlike fetching
+    body(), appending and calling setBody(), this doesn't copy the
+    body each time, so a message sent in many BDAT chunks costs linear
+    time and little memory.
+*/
+
+void SMTP::appendBody( const EString & b )
+{
+    d->body.append( b );
+}
+
+
 /*! Returns what setBody() set. Used for SmtpBdat instances to
     coordinate the body.
 */
@@ -49,6 +49,7 @@ public:
     List<class SmtpRcptTo> * rcptTo() const;
 
     void setBody( const EString & );
+    void appendBody( const EString & );
     EString body() const;
 
     bool isFirstCommand( SmtpCommand * ) const;
@@ -24,6 +24,9 @@
 #include "smtp.h"
 #include "user.h"
 
+// memchr
+#include <string.h>
+
 
 class SmtpDataData
     : public Garbage
@@ -125,31 +128,53 @@ void SmtpData::execute()
     }
 
     // state 1: have sent 354, have not yet received CR LF "." CR LF.
-    while ( d->state == 1 ) {
+    if ( d->state == 1 ) {
+        // we move all the complete lines we have into the body in one
+        // go, rather than allocating a string for each line.
         Buffer * r = server()->readBuffer();
-        EString * line = r->removeLine( 262144 );
-        if ( !line && r->size() > 262144 ) {
+        EString in = r->slice( r->size() );
+        const char * s = in.data();
+        uint l = in.length();
+        uint p = 0;
+        bool tooLong = false;
+        while ( d->state == 1 && p < l && !tooLong ) {
+            const char * lf = (const char *)memchr( s + p, 10, l - p );
+            if ( !lf )
+                break;
+            uint e = lf - s;
+            if ( e - p >= 262144 ) {
+                tooLong = true;
+                break;
+            }
+            uint start = p;
+            uint n = e - p;
+            if ( n && s[e-1] == 13 )
+                n--;
+            p = e + 1;
+            if ( n == 1 && s[start] == '.' ) {
+                d->state = 2;
+                server()->setInputState( SMTP::Command );
+                server()->setBody( d->body );
+            }
+            else {
+                if ( n && s[start] == '.' ) {
+                    start++;
+                    n--;
+                }
+                d->body.append( s + start, n );
+                d->body.append( "\r\n", 2 );
+            }
+        }
+        r->remove( p );
+        if ( tooLong || ( d->state == 1 && r->size() > 262144 ) ) {
             respond( 500, "Line too long (legal maximum is 998 bytes)",
                      "5.5.2" );
             finish();
             server()->setState( Connection::Closing );
-        }
-        if ( !line )
             return;
-
-        if ( *line == "." ) {
-            d->state = 2;
-            server()->setInputState( SMTP::Command );
-            server()->setBody( d->body );
-        }
-        else if ( (*line)[0] == '.' ) {
-            d->body.append( line->mid( 1 ) );
-            d->body.append( "\r\n" );
-        }
-        else {
-            d->body.append( *line );
-            d->body.append( "\r\n" );
         }
+        if ( d->state == 1 )
+            return;
     }
 
     // bdat/burl start at state 2.
@@ -470,6 +495,9 @@ Injectee * SmtpData::message( const EString & body )
              "\r\n";
 
     d->body = rp + received + body;
+    // the server's copy of the body is no longer needed, and a large
+    // message shouldn't be kept in memory twice.
+    server()->setBody( "" );
     Injectee * m = new Injectee;
     m->parse( d->body );
     // if the sender is another dickhead specifying <> in From to
@@ -590,7 +618,7 @@ void SmtpBdat::execute()
         Buffer * r = server()->readBuffer();
         if ( r->size() < d->size )
             return;
-        d->chunk = r->string( d->size );
+        d->chunk = r->slice( d->size );
         r->remove( d->size );
         server()->setInputState( SMTP::Command );
         d->read = true;
@@ -599,9 +627,8 @@ void SmtpBdat::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b = server()->body();
-    b.append( d->chunk );
-    server()->setBody( b );
+    server()->appendBody( d->chunk );
+    d->chunk.truncate();
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -687,9 +714,7 @@ void SmtpBurl::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b( server()->body() );
-    b.append( d->url->text() );
-    server()->setBody( b );
+    server()->appendBody( d->url->text() );
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -14,6 +14,7 @@
 #include "smtpclient.h"
 #include "allocator.h"
 #include "scope.h"
+#include "graph.h"
 
 #define SPOOLINTERVAL    900
 #define SSPOOLINTERVAL  "900"  /* Keep this in sync with SPOOLINTERVAL */
@@ -22,19 +23,33 @@
 static SpoolManager * sm;
 static bool shutdown;
 
+static GraphableNumber * queueDepth = 0;
+static GraphableCounter * deliveryAttempts = 0;
+
+
+class SpoolFeeder
+    : public EventHandler
+{
+public:
+    SpoolFeeder(): EventHandler() {}
+    void execute() { if ( ::sm ) ::sm->feed(); }
+};
+
 
 class SpoolManagerData
     : public Garbage
 {
 public:
     SpoolManagerData()
-        : q( 0 ), t( 0 ), again( false )
+        : q( 0 ), t( 0 ), again( false ), feeder( new SpoolFeeder )
     {}
 
     Query * q;
     Timer * t;
     List<DeliveryAgent> agents;
+    List<DeliveryAgent> queued;
     bool again;
+    SpoolFeeder * feeder;
 };
 
 
@@ -43,6 +58,11 @@ public:
     This class periodically attempts to deliver mail from the
     deliveries table to a smarthost using DeliveryAgent.
 
+    At most smarthost-connections DeliveryAgent objects work at once;
+    the rest wait in a queue and are started as soon as others
+    finish. The queue depth and the number of delivery attempts are
+    graphed as spool-queue-depth and delivery-attempts.
+
     Each archiveopteryx process has only one instance of this class,
     which is created by SpoolManager::setup().
 */
@@ -87,6 +107,12 @@ void SpoolManager::execute()
                 d->agents.take( a );
             }
         }
+        a = d->queued;
+        while ( a ) {
+            have.add( a->messageId() );
+            delay = SPOOLINTERVAL;
+            ++a;
+        }
 
         log( "Starting queue run" );
         d->again = false;
@@ -131,12 +157,9 @@ void SpoolManager::execute()
         while ( d->q->hasResults() ) {
             Row * r = d->q->nextRow();
             int64 deliverableAt = r->getBigint( "delay" );
-            if ( deliverableAt <= 0 ) {
-                DeliveryAgent * a
-                    = new DeliveryAgent( r->getInt( "message" ) );
-                (void)new Timer( a, d->agents.count() * 5 );
-                d->agents.append( a );
-            }
+            if ( deliverableAt <= 0 )
+                d->queued.append( new DeliveryAgent( r->getInt( "message" ),
+                                                     d->feeder ) );
             else if ( delay > deliverableAt )
                 delay = deliverableAt;
         }
@@ -149,6 +172,40 @@ void SpoolManager::execute()
     }
 
     reset();
+    feed();
+}
+
+
+/*! Starts as many queued DeliveryAgent objects as the
+    smarthost-connections setting allows. Called whenever a queue run
+    finds something to do and whenever a DeliveryAgent finishes.
+*/
+
+void SpoolManager::feed()
+{
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        if ( a->working() )
+            ++a;
+        else
+            d->agents.take( a );
+    }
+
+    uint max = Configuration::scalar( Configuration::SmartHostConnections );
+    if ( !max )
+        max = 1;
+    while ( !d->queued.isEmpty() && d->agents.count() < max ) {
+        DeliveryAgent * a = d->queued.shift();
+        d->agents.append( a );
+        if ( !::deliveryAttempts )
+            ::deliveryAttempts = new GraphableCounter( "delivery-attempts" );
+        ::deliveryAttempts->tick();
+        a->notify();
+    }
+
+    if ( !::queueDepth )
+        ::queueDepth = new GraphableNumber( "spool-queue-depth" );
+    ::queueDepth->setValue( d->queued.count() );
 }
 
 
@@ -225,6 +282,8 @@ void SpoolManager::shutdown()
         delete sm->d->t;
         sm->d->t = 0;
     }
+    if ( ::sm )
+        sm->d->queued.clear();
     ::sm = 0;
     ::shutdown = true;
     ::log( "Shutting down outgoing mail due to software problem. "
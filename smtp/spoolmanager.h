@@ -18,6 +18,7 @@ public:
     static void shutdown();
 
     void deliverNewMessage();
+    void feed();
 
 private:
     class SpoolManagerData * d;